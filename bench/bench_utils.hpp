@@ -0,0 +1,74 @@
+#ifndef BENCH_UTILS_HPP
+#define BENCH_UTILS_HPP
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Measures wall-clock time since construction.
+class BenchTimer {
+ public:
+  BenchTimer() : start_(std::chrono::steady_clock::now()) {}
+
+  double seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start_)
+        .count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// The timing of one benchmarked operation.
+struct BenchTiming {
+  long long iterations;
+  double ns_per_op;
+};
+
+/**
+ * @brief Times an operation by running it in growing batches until a batch
+ * takes at least min_seconds. The operation returns a value that is folded
+ * into a volatile sink so the compiler cannot drop the call.
+ * @param op The operation to time; it must return something convertible to
+ * double.
+ * @param min_seconds The minimum duration of the measured batch.
+ * @return The size of the measured batch and the time per operation.
+ */
+template <typename Op>
+BenchTiming time_operation(Op op, double min_seconds) {
+  static volatile double sink = 0;
+  for (long long batch = 1;; batch *= 2) {
+    double acc = 0;
+    BenchTimer timer;
+    for (long long i = 0; i < batch; ++i) {
+      acc += static_cast<double>(op());
+    }
+    const double elapsed = timer.seconds();
+    sink = sink + acc;
+    if (elapsed >= min_seconds) {
+      return {batch, elapsed * 1e9 / batch};
+    }
+  }
+}
+
+/**
+ * @brief Opens the stream results are written to: the named file, or
+ * standard output if the name is empty.
+ * @return The stream, or null if the file could not be opened.
+ */
+inline std::ostream *open_bench_output(const std::string &filename,
+                                       std::ofstream &file) {
+  if (filename.empty()) {
+    return &std::cout;
+  }
+  file.open(filename);
+  if (!file.is_open()) {
+    std::cerr << "Could not open output file: " << filename << std::endl;
+    return nullptr;
+  }
+  return &file;
+}
+
+#endif  // BENCH_UTILS_HPP
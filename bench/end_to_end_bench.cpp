@@ -0,0 +1,278 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_utils.hpp"
+#include "deciphering_utils.hpp"
+#include "language_model.hpp"
+#include "metropolis_hastings.hpp"
+#include "reduced_precision.hpp"
+#include "utils.hpp"
+
+namespace {
+
+// Iterations between two checks of the current key against the saved key.
+constexpr int kCheckEvery = 1000;
+// Symbols that make up less than this share of the ciphertext letters carry
+// too little bigram evidence to be decoded reliably (capitals mostly), so the
+// key counts as correct once every more common symbol is right.
+constexpr double kMinShare = 0.005;
+
+/**
+ * @brief Counts the symbols of the ciphertext that a decoding permutation
+ * maps back to their plaintext symbol. The decoding is the inverse of the
+ * scrambling key, so symbol s is right when permutation[s] equals
+ * key.inverse(s).
+ */
+int count_correct_symbols(const Permutation &permutation,
+                          const Permutation &key,
+                          const std::vector<int> &symbols) {
+  int correct = 0;
+  for (int s : symbols) {
+    if (permutation[s] == key.inverse(s)) {
+      ++correct;
+    }
+  }
+  return correct;
+}
+
+// The outcome of one annealing run.
+struct AnnealRun {
+  Permutation state;
+  double seconds = 0;
+  long long correct_iteration = -1;
+  double correct_seconds = -1;
+  // Scored with double tables, whatever the run used.
+  double log_prob = 0;
+  double key_accuracy = 0;
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  std::string train_file = "data/warpeace_input.txt";
+  std::string plain_file = "data/this_is_water.txt";
+  std::string output_file;
+  int iters = 500000;
+  int runs = 3;
+  int order = 2;
+  uint64_t seed = 42;
+  // With float or int16 every run is repeated in double for comparison.
+  ScorePrecision precision = ScorePrecision::kDouble;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "-i" && i + 1 < argc) {
+      train_file = argv[++i];
+    } else if (arg == "-d" && i + 1 < argc) {
+      plain_file = argv[++i];
+    } else if (arg == "-o" && i + 1 < argc) {
+      output_file = argv[++i];
+    } else if (arg == "-precision" && i + 1 < argc &&
+               parse_score_precision(argv[i + 1], precision)) {
+      ++i;
+    } else if ((arg == "-iters" || arg == "-runs" || arg == "-order" ||
+                arg == "-seed") &&
+               i + 1 < argc) {
+      try {
+        if (arg == "-iters") {
+          iters = std::stoi(argv[++i]);
+        } else if (arg == "-order") {
+          order = std::stoi(argv[++i]);
+        } else if (arg == "-runs") {
+          runs = std::stoi(argv[++i]);
+        } else {
+          seed = std::stoull(argv[++i]);
+        }
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for " << arg << ": " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [-i <training_file>] [-d <plaintext_file>] "
+                   "[-o <json_file>] [-iters <number>] [-runs <number>] "
+                   "[-order <2-4>] [-seed <number>] "
+                   "[-precision <double|float|int16>]"
+                << std::endl;
+      return 1;
+    }
+  }
+  if (iters < 2 || runs < 1 || order < 2 || order > kMaxNgramOrder) {
+    std::cerr << "-iters must be at least 2, -runs at least 1 and -order "
+                 "from 2 to "
+              << kMaxNgramOrder << "." << std::endl;
+    return 1;
+  }
+
+  LanguageModel model;
+  BenchTimer train_timer;
+  if (!train_language_model_from_file(
+          train_file, std::thread::hardware_concurrency(), model, order)) {
+    return 1;
+  }
+  const double train_seconds = train_timer.seconds();
+  const std::vector<char> &chars = model.chars();
+  const std::map<char, int> &char_to_ix = model.char_to_ix();
+
+  std::string plain_text;
+  read_file(plain_file, plain_text);
+  if (plain_text.size() < 2) {
+    std::cerr << "Plaintext is missing or too short: " << plain_file
+              << std::endl;
+    return 1;
+  }
+
+  std::ofstream file;
+  std::ostream *out = open_bench_output(output_file, file);
+  if (out == nullptr) {
+    return 1;
+  }
+
+  const std::vector<char> az_chars = az_list();
+  const std::vector<int> az_symbols = get_symbol_indices(az_chars, char_to_ix);
+  const std::string key_file = output_file.empty()
+                                   ? std::string("end_to_end_bench.key")
+                                   : output_file + ".key";
+
+  *out << "{\n  \"benchmark\": \"end_to_end\",\n  \"plaintext\": \""
+       << plain_file << "\",\n  \"text_size\": " << plain_text.size()
+       << ",\n  \"order\": " << order << ",\n  \"iters\": " << iters
+       << ",\n  \"seed\": " << seed << ",\n  \"precision\": \""
+       << score_precision_name(precision) << "\""
+       << ",\n  \"train_seconds\": " << train_seconds << ",\n  \"runs\": [";
+
+  double total_rate = 0;
+  double total_accuracy = 0;
+  double total_agreement = 0;
+  for (int run = 0; run < runs; ++run) {
+    // Scramble the plaintext as scramble_text does, and read the key back
+    // from its saved form so the score is against what a user would have.
+    Rng key_rng(seed + run);
+    const Permutation scramble = generate_random_permutation(az_chars,
+                                                             key_rng);
+    const std::string cipher_text =
+        apply_permutation(plain_text, scramble, az_chars);
+    {
+      // save_permutation_map reports on stdout, where the JSON may go.
+      std::streambuf *stdout_buf = std::cout.rdbuf(nullptr);
+      save_permutation_map(scramble, az_chars, key_file);
+      std::cout.rdbuf(stdout_buf);
+    }
+    const Permutation key = load_permutation_map(key_file, char_to_ix);
+
+    std::vector<int> occurrences(chars.size(), 0);
+    for (char c : cipher_text) {
+      auto it = char_to_ix.find(c);
+      if (it != char_to_ix.end()) {
+        ++occurrences[it->second];
+      }
+    }
+    int n_letters = 0;
+    for (int s : az_symbols) {
+      n_letters += occurrences[s];
+    }
+    std::vector<int> present;
+    std::vector<int> frequent;
+    for (int s : az_symbols) {
+      if (occurrences[s] > 0) {
+        present.push_back(s);
+      }
+      if (occurrences[s] >= kMinShare * n_letters) {
+        frequent.push_back(s);
+      }
+    }
+
+    // Anneals one chain at the given precision; runs with the same seed
+    // start from the same key, so precisions can be compared run by run.
+    const NgramDensity exact(cipher_text, model);
+    auto anneal = [&](ScorePrecision anneal_precision) {
+      AnnealRun result;
+      NgramDensity density(cipher_text, model, anneal_precision);
+      UniformSwapProposal proposal(az_symbols);
+      ExponentialCooling schedule(1.0, 0.001, iters);
+      Rng rng = Rng::stream(seed + run, 1);
+      result.state = generate_random_permutation(chars, rng);
+      double log_prob = density.score(result.state);
+      BenchTimer timer;
+      for (int i = 0; i < iters; ++i) {
+        metropolis_hastings_step(result.state, log_prob, proposal, density,
+                                 schedule.temperature(), rng);
+        schedule.advance();
+        if (result.correct_iteration < 0 && (i + 1) % kCheckEvery == 0 &&
+            count_correct_symbols(result.state, key, frequent) ==
+                static_cast<int>(frequent.size())) {
+          result.correct_iteration = i + 1;
+          result.correct_seconds = timer.seconds();
+        }
+      }
+      result.seconds = timer.seconds();
+      // Whatever the tables, the key is judged by the double model.
+      result.log_prob = exact.score(result.state);
+      result.key_accuracy =
+          present.empty()
+              ? 1.0
+              : double(count_correct_symbols(result.state, key, present)) /
+                    present.size();
+      return result;
+    };
+
+    const AnnealRun result = anneal(precision);
+    const std::string decoded =
+        apply_permutation(cipher_text, result.state, chars);
+    size_t matching = 0;
+    for (size_t i = 0; i < decoded.size(); ++i) {
+      matching += decoded[i] == plain_text[i];
+    }
+    const double text_accuracy = double(matching) / decoded.size();
+    const double rate = iters / result.seconds;
+    total_rate += rate;
+    total_accuracy += result.key_accuracy;
+
+    *out << (run ? ",\n" : "\n") << "    {\"run\": " << run
+         << ", \"seconds\": " << result.seconds
+         << ", \"iterations_per_sec\": " << rate
+         << ", \"log_prob\": " << result.log_prob
+         << ", \"key_accuracy\": " << result.key_accuracy
+         << ", \"text_accuracy\": " << text_accuracy;
+    if (precision != ScorePrecision::kDouble) {
+      // The accuracy report: the same run in double, and how much of the
+      // decoded text the two agree on.
+      const AnnealRun reference = anneal(ScorePrecision::kDouble);
+      const std::string reference_decoded =
+          apply_permutation(cipher_text, reference.state, chars);
+      size_t agreeing = 0;
+      for (size_t i = 0; i < decoded.size(); ++i) {
+        agreeing += decoded[i] == reference_decoded[i];
+      }
+      total_agreement += double(agreeing) / decoded.size();
+      *out << ", \"double_seconds\": " << reference.seconds
+           << ", \"double_log_prob\": " << reference.log_prob
+           << ", \"double_key_accuracy\": " << reference.key_accuracy
+           << ", \"agreement_with_double\": "
+           << double(agreeing) / decoded.size();
+    }
+    *out << ", \"correct_key_iteration\": ";
+    if (result.correct_iteration < 0) {
+      *out << "null, \"time_to_correct_key\": null}";
+    } else {
+      *out << result.correct_iteration
+           << ", \"time_to_correct_key\": " << result.correct_seconds << "}";
+    }
+    std::cerr << "Run " << run + 1 << "/" << runs << ": " << rate
+              << " it/s, key accuracy " << result.key_accuracy << std::endl;
+  }
+  std::remove(key_file.c_str());
+
+  *out << "\n  ],\n  \"mean_iterations_per_sec\": " << total_rate / runs
+       << ",\n  \"mean_key_accuracy\": " << total_accuracy / runs;
+  if (precision != ScorePrecision::kDouble) {
+    *out << ",\n  \"mean_agreement_with_double\": " << total_agreement / runs;
+  }
+  *out << "\n}" << std::endl;
+  return 0;
+}
@@ -0,0 +1,281 @@
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "bench_utils.hpp"
+#include "deciphering_utils.hpp"
+#include "language_model.hpp"
+#include "metropolis_hastings.hpp"
+#include "reduced_precision.hpp"
+#include "sparse_bigrams.hpp"
+#include "translate.hpp"
+#include "utils.hpp"
+
+namespace {
+
+// An alphabet to benchmark, defined by how it rewrites the training corpus.
+struct AlphabetCase {
+  const char *name;
+  std::string (*filter)(const std::string &);
+};
+
+// Lowercase letters and space.
+std::string lowercase_filter(const std::string &text) {
+  std::string out(text.size(), ' ');
+  for (size_t i = 0; i < text.size(); ++i) {
+    const unsigned char c = text[i];
+    if (std::isalpha(c)) {
+      out[i] = std::tolower(c);
+    }
+  }
+  return out;
+}
+
+// Upper and lowercase letters and space.
+std::string letters_filter(const std::string &text) {
+  std::string out(text.size(), ' ');
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (std::isalpha(static_cast<unsigned char>(text[i]))) {
+      out[i] = text[i];
+    }
+  }
+  return out;
+}
+
+// Every character of the corpus.
+std::string full_filter(const std::string &text) { return text; }
+
+void write_result(std::ostream &out, bool &first, const std::string &name,
+                  const std::string &alphabet, int alphabet_size,
+                  size_t text_size, const BenchTiming &timing) {
+  out << (first ? "\n" : ",\n") << "    {\"name\": \"" << name
+      << "\", \"alphabet\": \"" << alphabet
+      << "\", \"alphabet_size\": " << alphabet_size
+      << ", \"text_size\": " << text_size
+      << ", \"iterations\": " << timing.iterations
+      << ", \"ns_per_op\": " << timing.ns_per_op << "}";
+  first = false;
+}
+
+// The largest relative difference allowed between a vector kernel, which
+// sums in a different order, and the dense function.
+constexpr double kSparseTolerance = 1e-12;
+
+/**
+ * @brief Checks a sparse kernel against compute_log_probability_by_counts on
+ * random permutations: the scalar kernel must match exactly and the vector
+ * kernels to within kSparseTolerance.
+ * @return False, after reporting the mismatch, if the kernel disagrees.
+ */
+bool check_sparse_kernel(const SparseBigramCounts &sparse_counts,
+                         const TransitionCounts &counts, int first_ix,
+                         const LanguageModel &model, SimdLevel level,
+                         Rng &rng) {
+  for (int trial = 0; trial < 100; ++trial) {
+    const Permutation permutation =
+        generate_random_permutation(model.chars(), rng);
+    const double dense = compute_log_probability_by_counts(
+        counts, first_ix, permutation, model);
+    const double sparse = compute_log_probability_by_sparse_counts(
+        sparse_counts, first_ix, permutation, model, level);
+    const double error = std::fabs(sparse - dense) / std::fabs(dense);
+    if (level == SimdLevel::kScalar ? sparse != dense
+                                    : !(error <= kSparseTolerance)) {
+      std::cerr << "The " << simd_level_name(level)
+                << " sparse kernel gives " << sparse << " where the dense one"
+                << " gives " << dense << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  std::string corpus_file = "data/warpeace_input.txt";
+  std::string output_file;
+  double min_time = 0.2;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "-i" && i + 1 < argc) {
+      corpus_file = argv[++i];
+    } else if (arg == "-o" && i + 1 < argc) {
+      output_file = argv[++i];
+    } else if (arg == "-min_time" && i + 1 < argc) {
+      try {
+        min_time = std::stod(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -min_time: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [-i <corpus_file>] [-o <json_file>] [-min_time <seconds>]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  std::string corpus;
+  read_file(corpus_file, corpus);
+  if (corpus.size() < 200000) {
+    std::cerr << "Corpus is missing or too small: " << corpus_file
+              << std::endl;
+    return 1;
+  }
+
+  std::ofstream file;
+  std::ostream *out = open_bench_output(output_file, file);
+  if (out == nullptr) {
+    return 1;
+  }
+
+  const AlphabetCase alphabets[] = {{"lowercase", lowercase_filter},
+                                    {"letters", letters_filter},
+                                    {"full", full_filter}};
+  const size_t text_sizes[] = {1000, 10000, 100000};
+  // Every sparse kernel this CPU can run.
+  std::vector<SimdLevel> simd_levels = {SimdLevel::kScalar};
+  for (SimdLevel level : {SimdLevel::kAvx2, SimdLevel::kAvx512}) {
+    if (level <= detect_simd_level()) {
+      simd_levels.push_back(level);
+    }
+  }
+
+  *out << "{\n  \"benchmark\": \"micro\",\n  \"min_time\": " << min_time
+       << ",\n  \"simd_level\": \"" << simd_level_name(detect_simd_level())
+       << "\",\n  \"results\": [";
+  bool first = true;
+
+  for (const AlphabetCase &alphabet : alphabets) {
+    const std::string filtered = alphabet.filter(corpus);
+    const LanguageModel model = train_language_model(filtered);
+    const std::vector<char> &chars = model.chars();
+    const std::map<char, int> &char_to_ix = model.char_to_ix();
+    const int n = model.size();
+    std::cerr << "Benchmarking the " << alphabet.name << " alphabet (" << n
+              << " symbols)..." << std::endl;
+
+    // The slow path scores against the raw probabilities.
+    const std::vector<double> frequency =
+        get_frequency_statistics(filtered, chars, char_to_ix);
+    const DoubleMatrix transition =
+        get_transition_matrix(filtered, chars, char_to_ix);
+
+    std::vector<int> symbols(n);
+    for (int k = 0; k < n; ++k) {
+      symbols[k] = k;
+    }
+    Rng rng(1);
+    const Permutation permutation = generate_random_permutation(chars, rng);
+
+    const BenchTiming propose = time_operation(
+        [&]() { return propose_move(permutation, symbols, rng)[0]; },
+        min_time);
+    write_result(*out, first, "propose_move", alphabet.name, n, 0, propose);
+
+    for (size_t text_size : text_sizes) {
+      // Take the text from the middle of the corpus, away from the preamble.
+      const std::string text = filtered.substr(filtered.size() / 2, text_size);
+      const TransitionCounts counts =
+          compute_transition_counts(text, char_to_ix);
+      const int first_ix =
+          char_to_ix.count(text[0]) ? char_to_ix.at(text[0]) : -1;
+
+      write_result(*out, first, "compute_log_probability", alphabet.name, n,
+                   text_size, time_operation([&]() {
+                     return compute_log_probability(text, permutation,
+                                                    char_to_ix, frequency,
+                                                    transition);
+                   }, min_time));
+      write_result(*out, first, "compute_log_probability_by_counts",
+                   alphabet.name, n, text_size, time_operation([&]() {
+                     return compute_log_probability_by_counts(
+                         counts, first_ix, permutation, model);
+                   }, min_time));
+      const SparseBigramCounts sparse_counts =
+          compute_sparse_bigram_counts(counts);
+      for (SimdLevel level : simd_levels) {
+        if (!check_sparse_kernel(sparse_counts, counts, first_ix, model,
+                                 level, rng)) {
+          return 1;
+        }
+        const std::string name =
+            std::string("compute_log_probability_by_sparse_counts_") +
+            simd_level_name(level);
+        write_result(*out, first, name, alphabet.name, n, text_size,
+                     time_operation([&]() {
+                       return compute_log_probability_by_sparse_counts(
+                           sparse_counts, first_ix, permutation, model, level);
+                     }, min_time));
+      }
+      write_result(*out, first, "compute_swap_delta_by_counts", alphabet.name,
+                   n, text_size, time_operation([&]() {
+                     const int a = rng.uniform_int(n);
+                     const int b = rng.uniform_int(n);
+                     return compute_swap_delta_by_counts(
+                         counts, first_ix, permutation, a, b, model);
+                   }, min_time));
+      // The swap kernel the decoder dispatches to for this alphabet size,
+      // at each table precision.
+      for (ScorePrecision precision :
+           {ScorePrecision::kDouble, ScorePrecision::kFloat,
+            ScorePrecision::kInt16}) {
+        const NgramDensity density(text, model, precision);
+        std::string name = "ngram_density_delta";
+        if (precision != ScorePrecision::kDouble) {
+          name = name + "_" + score_precision_name(precision);
+        }
+        write_result(*out, first, name, alphabet.name, n, text_size,
+                     time_operation([&]() {
+                       const SymbolSwap move = {
+                           static_cast<int>(rng.uniform_int(n)),
+                           static_cast<int>(rng.uniform_int(n))};
+                       return density.delta(permutation, 0.0, move);
+                     }, min_time));
+      }
+      write_result(*out, first, "apply_permutation", alphabet.name, n,
+                   text_size, time_operation([&]() {
+                     return apply_permutation(text, permutation, chars)[0];
+                   }, min_time));
+      // The translator has one vector kernel, which AVX-512 machines share.
+      const ByteTranslator translator(permutation, chars);
+      std::string expected(text.size(), '\0');
+      translator.translate(text.data(), &expected[0], text.size(),
+                           SimdLevel::kScalar);
+      std::string translated(text.size(), '\0');
+      for (SimdLevel level : simd_levels) {
+        if (level > SimdLevel::kAvx2) {
+          continue;
+        }
+        translator.translate(text.data(), &translated[0], text.size(), level);
+        if (translated != expected) {
+          std::cerr << "The " << simd_level_name(level)
+                    << " translator disagrees with the table." << std::endl;
+          return 1;
+        }
+        write_result(*out, first,
+                     std::string("byte_translator_") + simd_level_name(level),
+                     alphabet.name, n, text_size, time_operation([&]() {
+                       translator.translate(text.data(), &translated[0],
+                                            text.size(), level);
+                       return translated[0];
+                     }, min_time));
+      }
+      write_result(*out, first, "get_transition_matrix", alphabet.name, n,
+                   text_size, time_operation([&]() {
+                     return get_transition_matrix(text, chars,
+                                                  char_to_ix)[0][0];
+                   }, min_time));
+    }
+  }
+
+  *out << "\n  ]\n}" << std::endl;
+  return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef AFFINITY_HPP
+#define AFFINITY_HPP
+
+#include <vector>
+
+/**
+ * @brief Returns the CPUs this process may run on, in ascending order. Off
+ * Linux, or if the mask cannot be read, returns 0 .. hardware_concurrency-1.
+ */
+std::vector<int> available_cpus();
+
+/**
+ * @brief Returns the NUMA node a CPU belongs to, read from sysfs, or 0 if
+ * the machine does not report one.
+ */
+int cpu_numa_node(int cpu);
+
+/**
+ * @brief Restricts the calling thread to one CPU. Memory the thread touches
+ * first is then allocated on that CPU's NUMA node by the kernel's default
+ * policy.
+ * @return False if the thread could not be pinned.
+ */
+bool pin_current_thread(int cpu);
+
+#endif  // AFFINITY_HPP
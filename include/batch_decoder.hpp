@@ -0,0 +1,46 @@
+#ifndef BATCH_DECODER_HPP
+#define BATCH_DECODER_HPP
+
+#include <cstdint>
+#include <string>
+
+#include "language_model.hpp"
+#include "metropolis_hastings.hpp"
+#include "reduced_precision.hpp"
+
+// Settings for decoding many ciphertexts against one model.
+struct BatchOptions {
+  // A directory of ciphertext files, a manifest file listing one ciphertext
+  // path per line, or "-" to read one ciphertext per line from stdin.
+  std::string source;
+  // Where each job's deciphered text and key are written.
+  std::string output_dir = ".";
+  int iters = 500000;
+  // Independent annealing chains per ciphertext; the best one is kept.
+  int chains_per_job = 2;
+  int n_threads = 1;
+  uint64_t seed = 0;
+  // Polish each job's best key by steepest descent before writing it.
+  bool polish = true;
+  // The number type of the bigram tables the chains score with.
+  ScorePrecision precision = ScorePrecision::kDouble;
+  // The cooling schedule of every chain.
+  ScheduleOptions schedule;
+};
+
+/**
+ * @brief Decodes every ciphertext from a batch source with one loaded model.
+ * The chains of all jobs run as tasks on one shared thread pool, and jobs
+ * are read while earlier ones are still running, so a long-lived stdin
+ * stream works as a decode daemon. For a job named N the deciphered text is
+ * written to <output_dir>/N.decoded.txt and the key to <output_dir>/N.key.
+ * A job whose chains or polish throw, for instance because memory ran out,
+ * is reported as failed and the other jobs carry on.
+ * @param model The language model shared by all jobs.
+ * @param options The batch settings.
+ * @return The number of jobs decoded, or -1 if the source could not be read
+ * or two of its files would share a job name.
+ */
+int decode_batch(const LanguageModel &model, const BatchOptions &options);
+
+#endif  // BATCH_DECODER_HPP
@@ -0,0 +1,155 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "permutation.hpp"
+
+// Defined in metropolis_hastings.hpp and reduced_precision.hpp, which build
+// on this header.
+enum class ScheduleKind;
+enum class ScorePrecision;
+
+// Identifies a checkpoint file and its layout version.
+constexpr char kCheckpointMagic[8] = {'M', 'C', 'M', 'C', 'C', 'K', 'P',
+                                      'T'};
+constexpr uint32_t kCheckpointVersion = 2;
+
+// Everything a chain needs to continue exactly where it was.
+struct ChainCheckpoint {
+  long long iteration = 0;
+  long long accepts = 0;
+  double log_prob = 0;
+  double best_log_prob = 0;
+  // The temperature of the next iteration.
+  double temperature = 0;
+  std::array<uint64_t, 4> rng_state = {0, 0, 0, 0};
+  Permutation state;
+};
+
+/**
+ * @brief A checkpoint of a whole run of independent annealing chains. The
+ * run parameters are stored with the chains so a resumed run continues
+ * with the same budget, schedule and scoring precision, and the text hash
+ * guards against resuming on a different ciphertext or alphabet.
+ */
+struct RunCheckpoint {
+  uint64_t seed = 0;
+  int iters = 0;
+  ScheduleKind schedule{};
+  double initial_temp = 0;
+  double final_temp = 0;
+  ScorePrecision precision{};
+  uint64_t text_hash = 0;
+  int n_chars = 0;
+  std::vector<ChainCheckpoint> chains;
+};
+
+/**
+ * @brief Hashes the text being decoded together with the model alphabet.
+ */
+uint64_t checkpoint_text_hash(const std::string &text,
+                              const std::vector<char> &chars);
+
+/**
+ * @brief Writes a checkpoint to a temporary file next to filename, flushes
+ * it to disk and renames it over filename, so a reader sees either the old
+ * or the new checkpoint and never a partial one.
+ * @return False, after reporting the error, if the file could not be
+ * written.
+ */
+bool save_checkpoint(const RunCheckpoint &checkpoint,
+                     const std::string &filename);
+
+/**
+ * @brief Reads a checkpoint written by save_checkpoint.
+ * @return False, after reporting the error, if the file is missing or is
+ * not a valid checkpoint.
+ */
+bool load_checkpoint(const std::string &filename, RunCheckpoint &checkpoint);
+
+/**
+ * @brief Collects chain checkpoints and writes them from a background
+ * thread, so the chains never wait on disk. Every interval the writer
+ * raises a request; each chain notices it at its next poll, copies its
+ * state into its own slot and carries on, and once every chain has answered
+ * (or finished) the writer saves the run. A chain that has not started,
+ * for instance because it is queued for a thread, is saved at its starting
+ * checkpoint without waiting for it. A final checkpoint is written when the
+ * writer stops.
+ */
+class CheckpointWriter {
+ public:
+  /**
+   * @param filename The checkpoint file.
+   * @param start The run parameters and the chains' starting checkpoints,
+   * which are saved for chains that have not started yet.
+   * @param interval_seconds The time between two checkpoints.
+   */
+  CheckpointWriter(const std::string &filename, const RunCheckpoint &start,
+                   double interval_seconds);
+
+  // Stops the writer if stop() was not called.
+  ~CheckpointWriter();
+
+  CheckpointWriter(const CheckpointWriter &) = delete;
+  CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+  // How many iterations a chain runs between two polls of requested().
+  static constexpr int kPollEvery = 1024;
+
+  // True if the writer is waiting for this chain's state.
+  bool requested(int chain) const {
+    return request_.load(std::memory_order_acquire) !=
+           slots_[chain].generation.load(std::memory_order_relaxed);
+  }
+
+  // Marks a chain as running, so later requests wait for its answer.
+  // Chain thread only, before its first poll.
+  void start(int chain) {
+    slots_[chain].started.store(true, std::memory_order_release);
+  }
+
+  /**
+   * @brief Hands a chain's state to the writer. Chain thread only.
+   * @param chain The index of the chain.
+   * @param checkpoint The chain's state.
+   * @param finished True for the chain's last state.
+   */
+  void submit(int chain, const ChainCheckpoint &checkpoint, bool finished);
+
+  // Writes a final checkpoint and joins the writer thread.
+  void stop();
+
+ private:
+  struct alignas(64) Slot {
+    std::mutex mutex;
+    ChainCheckpoint checkpoint;
+    std::atomic<uint64_t> generation{0};
+    std::atomic<bool> started{false};
+    std::atomic<bool> finished{false};
+  };
+
+  void run();
+  void collect_and_save();
+
+  const std::string filename_;
+  RunCheckpoint run_;
+  const double interval_seconds_;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<uint64_t> request_;
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
+  bool stopping_;
+  std::thread thread_;
+};
+
+#endif  // CHECKPOINT_HPP
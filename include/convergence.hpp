@@ -0,0 +1,83 @@
+#ifndef CONVERGENCE_HPP
+#define CONVERGENCE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
+
+#include "permutation.hpp"
+
+// The rules that end a multi-chain run early. A value of 0 disables a rule.
+struct ConvergenceOptions {
+  // Stop once this many chains sit on the same key.
+  int agree_chains = 0;
+  // Stop once a chain has run this many iterations without the best log
+  // probability of any chain improving.
+  long long patience = 0;
+  // Stop after this many seconds of wall-clock time.
+  double time_limit = 0;
+  // How many iterations a chain runs between two publishes.
+  int publish_every = 1000;
+};
+
+// Why a run stopped early.
+enum class StopReason { kNone, kAgreement, kPatience, kTimeLimit };
+
+const char *stop_reason_name(StopReason reason);
+
+/**
+ * @brief A lock-free board that running chains publish their key and score
+ * to. Every publish checks the stopping rules, and once one fires, every
+ * chain learns from its next publish that it should stop. Each chain writes
+ * only its own cache-line-sized slot; the shared best score is updated with
+ * compare-and-swap. Chains may start at different times, for instance when
+ * they queue for a thread, so patience is counted on each chain's own
+ * iterations: a chain notes at which of its iterations it last saw the
+ * shared best change.
+ */
+class ConvergenceBoard {
+ public:
+  ConvergenceBoard(int n_chains, const ConvergenceOptions &options);
+
+  int publish_every() const { return options_.publish_every; }
+  double time_limit() const { return options_.time_limit; }
+
+  /**
+   * @brief Records the current key and score of a chain and applies the
+   * stopping rules.
+   * @param chain The index of the publishing chain.
+   * @param state The chain's current permutation.
+   * @param log_prob The log likelihood of the state.
+   * @param iteration The number of iterations the chain has run; it must
+   * grow from one publish of the chain to the next.
+   * @return False once the run should stop.
+   */
+  bool publish(int chain, const Permutation &state, double log_prob,
+               long long iteration);
+
+  bool stopped() const { return stopped_.load(std::memory_order_relaxed); }
+  void stop(StopReason reason);
+  StopReason stop_reason() const { return stop_reason_.load(); }
+  double best_log_prob() const { return best_log_prob_.load(); }
+
+ private:
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> key_hash{0};
+    // Only the owning chain reads these: the shared best it last saw, and
+    // the iteration at which it saw it change.
+    double seen_best = -std::numeric_limits<double>::infinity();
+    long long seen_at = 0;
+  };
+
+  const int n_chains_;
+  const ConvergenceOptions options_;
+  const std::chrono::steady_clock::time_point deadline_;
+  std::unique_ptr<Slot[]> slots_;
+  alignas(64) std::atomic<double> best_log_prob_;
+  std::atomic<bool> stopped_;
+  std::atomic<StopReason> stop_reason_;
+};
+
+#endif  // CONVERGENCE_HPP
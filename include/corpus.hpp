@@ -0,0 +1,66 @@
+#ifndef CORPUS_HPP
+#define CORPUS_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Marks a byte value that never occurs in the corpus.
+constexpr uint64_t kNeverSeen = UINT64_MAX;
+
+// The highest n-gram order a model can be trained with.
+constexpr int kMaxNgramOrder = 4;
+
+/**
+ * @brief Unigram and bigram counts of a corpus indexed directly by byte
+ * value, after newlines have been turned into spaces as read_file does. For
+ * orders above 2 the n-grams of that order are counted as well.
+ */
+struct CorpusCounts {
+  explicit CorpusCounts(int order = 2);
+
+  /**
+   * @brief Adds the counts of another part of the corpus.
+   */
+  void merge(const CorpusCounts &other);
+
+  // The number of characters in the corpus.
+  uint64_t length;
+  // [c] is the number of times byte c occurs.
+  std::vector<uint64_t> unigram;
+  // [c1 * 256 + c2] is the number of times byte c2 follows byte c1.
+  std::vector<uint64_t> bigram;
+  // [c] is the position of the first occurrence of byte c, or kNeverSeen.
+  std::vector<uint64_t> first_seen;
+  // The n-gram order counted, from 2 to kMaxNgramOrder.
+  int order;
+  // When order > 2, the count of every n-gram of that order that occurs,
+  // keyed by its bytes packed first byte highest.
+  std::unordered_map<uint32_t, uint64_t> ngram;
+};
+
+/**
+ * @brief Counts the characters and character pairs of a text held in memory.
+ * @param text The text, with newlines already replaced by spaces.
+ * @param order The n-gram order to count.
+ * @return The counts of the text.
+ */
+CorpusCounts count_text(const std::string &text, int order = 2);
+
+/**
+ * @brief Counts the characters and character pairs of a file without
+ * loading it. The file is memory-mapped and split across threads, each of
+ * which fills its own histograms and releases the pages it has finished
+ * with, so memory use does not grow with the size of the corpus. The counts
+ * match those of count_text on the output of read_file.
+ * @param filename The corpus file.
+ * @param n_threads The number of threads to count with.
+ * @param order The n-gram order to count.
+ * @param counts Receives the counts.
+ * @return True on success.
+ */
+bool count_corpus_file(const std::string &filename, int n_threads, int order,
+                       CorpusCounts &counts);
+
+#endif  // CORPUS_HPP
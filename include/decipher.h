@@ -0,0 +1,85 @@
+#ifndef DECIPHER_H
+#define DECIPHER_H
+
+/*
+ * A C interface to Solver, for services written in other languages. It is
+ * built as the shared library libdecipher. Every function is safe to call
+ * from several threads at once, except that a solver must not be
+ * destroyed while a call on it is running.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct decipher_solver decipher_solver;
+
+enum decipher_precision {
+  DECIPHER_PRECISION_DOUBLE = 0,
+  DECIPHER_PRECISION_FLOAT = 1,
+  DECIPHER_PRECISION_INT16 = 2
+};
+
+enum decipher_schedule {
+  DECIPHER_SCHEDULE_EXPONENTIAL = 0,
+  DECIPHER_SCHEDULE_LINEAR = 1,
+  DECIPHER_SCHEDULE_ADAPTIVE = 2
+};
+
+/* The settings of one decode call; see DecodeOptions. */
+typedef struct {
+  int iters;
+  int chains;
+  uint64_t seed;
+  /* Nonzero to polish the best key by steepest descent. */
+  int polish;
+  /* One of decipher_precision. */
+  int precision;
+  /* One of decipher_schedule, with the default temperatures. */
+  int schedule;
+} decipher_options;
+
+/* What one decode call found and did; see DecodeStats. */
+typedef struct {
+  double log_prob;
+  int chains;
+  long long iterations;
+  int polish_swaps;
+  double seconds;
+} decipher_stats;
+
+/* Fills options with the defaults of DecodeOptions. */
+void decipher_default_options(decipher_options *options);
+
+/*
+ * Loads a model written by train_model and starts a pool of n_threads
+ * workers. Returns NULL, after reporting the error on stderr, if the model
+ * cannot be loaded.
+ */
+decipher_solver *decipher_solver_create(const char *model_file,
+                                        int n_threads);
+
+void decipher_solver_destroy(decipher_solver *solver);
+
+/* The model alphabet as a NUL-terminated string, owned by the solver. */
+const char *decipher_alphabet(const decipher_solver *solver);
+
+/*
+ * Decodes length bytes of ciphertext. plaintext, if not NULL, receives
+ * length bytes and a NUL. key, if not NULL, receives for each character of
+ * decipher_alphabet, in order, the character it decodes to, and a NUL.
+ * stats, if not NULL, receives the score and stats of the call. options
+ * may be NULL for the defaults. Returns 0 on success and -1 on error.
+ */
+int decipher_decode(decipher_solver *solver, const char *ciphertext,
+                    size_t length, const decipher_options *options,
+                    char *plaintext, char *key, decipher_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DECIPHER_H */
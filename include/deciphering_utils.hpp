@@ -1,21 +1,30 @@
 #ifndef DECIPHERING_UTILS_HPP
 #define DECIPHERING_UTILS_HPP
 
+#include <array>
+#include <cstdint>
 #include <map>
 #include <string>
 #include <vector>
 
-// A 2D vector to store the counts of character transitions.
-using TransitionCounts = std::vector<std::vector<int> >;
+#include "language_model.hpp"
+#include "matrix.hpp"
+#include "permutation.hpp"
+#include "reduced_precision.hpp"
+#include "rng.hpp"
+#include "sparse_bigrams.hpp"
+
+// The counts of character transitions: [i][j] is how often j follows i.
+using TransitionCounts = Matrix<int>;
 
 // Function declarations
 double compute_log_probability(
-    const std::string &text, const std::map<char, char> &permutation_map,
+    const std::string &text, const Permutation &permutation,
     const std::map<char, int> &char_to_ix,
     const std::vector<double> &frequency_statistics,
-    const std::vector<std::vector<double> > &transition_matrix);
-std::map<char, char> propose_move(const std::map<char, char> &p_map,
-                                  const std::vector<char> &chars);
+    const DoubleMatrix &transition_matrix);
+Permutation propose_move(const Permutation &permutation,
+                         const std::vector<int> &symbols, Rng &rng);
 
 /**
  * @brief Computes the bigram (character pair) counts for a given text.
@@ -23,7 +32,7 @@ std::map<char, char> propose_move(const std::map<char, char> &p_map,
  * @param text The input text string.
  * @param char_to_ix A map from characters to their corresponding integer
  * index.
- * @return A 2D vector where [i][j] is the number of times character j follows
+ * @return A matrix where [i][j] is the number of times character j follows
  * character i.
  */
 TransitionCounts compute_transition_counts(
@@ -34,20 +43,355 @@ TransitionCounts compute_transition_counts(
  * transition counts. This is the fast version used inside the MCMC loop.
  * @param text_transition_counts The pre-calculated bigram counts of the text
  * to be decoded.
- * @param first_char_in_text The first character of the text to be decoded.
- * @param permutation_map The current permutation map being tested.
- * @param char_to_ix A map from characters to their integer index.
- * @param log_frequency_statistics The pre-calculated log of the frequency
- * statistics.
- * @param log_transition_matrix The pre-calculated log of the transition
- * matrix.
+ * @param first_ix The index of the first character of the text to be
+ * decoded, or -1 if it is not part of the alphabet.
+ * @param permutation The current permutation being tested.
+ * @param model The language model holding the pre-calculated log frequency
+ * statistics and log transition matrix.
  * @return The log likelihood of the text under the given permutation.
  */
 double compute_log_probability_by_counts(
-    const TransitionCounts &text_transition_counts, char first_char_in_text,
-    const std::map<char, char> &permutation_map,
-    const std::map<char, int> &char_to_ix,
-    const std::vector<double> &log_frequency_statistics,
-    const std::vector<std::vector<double> > &log_transition_matrix);
+    const TransitionCounts &text_transition_counts, int first_ix,
+    const Permutation &permutation, const LanguageModel &model);
+
+/**
+ * @brief Computes the change in log likelihood caused by swapping the images
+ * of two symbols in a permutation. Only the rows and columns of the two
+ * symbols are touched, so the cost is linear in the alphabet size.
+ * @param text_transition_counts The pre-calculated bigram counts of the text
+ * to be decoded.
+ * @param first_ix The index of the first character of the text to be
+ * decoded, or -1 if it is not part of the alphabet.
+ * @param permutation The current permutation.
+ * @param a The index of the first symbol to swap.
+ * @param b The index of the second symbol to swap.
+ * @param model The language model holding the pre-calculated log frequency
+ * statistics and log transition matrix.
+ * @return The log likelihood after the swap minus the log likelihood before.
+ */
+double compute_swap_delta_by_counts(
+    const TransitionCounts &text_transition_counts, int first_ix,
+    const Permutation &permutation, int a, int b, const LanguageModel &model);
+
+// The working matrices of compute_all_swap_deltas. They keep their size
+// between calls, so repeated batches over one alphabet do not allocate.
+struct SwapDeltaScratch {
+  DoubleMatrix counts;
+  DoubleMatrix log_probs;
+  DoubleMatrix transposed_log_probs;
+  DoubleMatrix rows;
+  DoubleMatrix cols;
+  DoubleMatrix all;
+};
+
+/**
+ * @brief Computes compute_swap_delta_by_counts for every pair of symbols at
+ * once. The deltas are assembled from two products of the counts with the
+ * permuted model, which run as dense loops the compiler vectorizes, so the
+ * whole table costs about as much as a few hundred single deltas. The
+ * results agree with the single-swap kernel up to rounding.
+ * @param deltas Receives a symmetric matrix over the model's symbols whose
+ * cell (a, b) is the change in log likelihood of swapping the images of a
+ * and b.
+ * @param scratch Working matrices, reused when already the right size.
+ */
+void compute_all_swap_deltas(const TransitionCounts &text_transition_counts,
+                             int first_ix, const Permutation &permutation,
+                             const LanguageModel &model, DoubleMatrix &deltas,
+                             SwapDeltaScratch &scratch);
+
+// The alphabet sizes that get a compile-time swap kernel: lowercase letters
+// and space, both cases and space, and printable ASCII with newline.
+constexpr int kFixedAlphabetSizes[] = {27, 53, 96};
+
+/**
+ * @brief Returns the smallest fixed alphabet size that can hold n symbols,
+ * or 0 if n is larger than all of them.
+ */
+int fixed_alphabet_size(int n);
+
+/**
+ * @brief compute_swap_delta_by_counts for an alphabet of at most N symbols,
+ * with the size known at compile time. The counts must be padded with zeros
+ * to N x N and come with their transpose, so the row and the column of a
+ * symbol are both contiguous. The count differences of the two symbols are
+ * then taken over fixed-length stack arrays, which the compiler unrolls and
+ * vectorizes, and only the symbols with a non-zero difference touch the
+ * model. The terms are added in the same order as the generic kernel, so
+ * the result is identical.
+ * @tparam N The padded alphabet size, one of kFixedAlphabetSizes.
+ * @tparam Model A LanguageModel, or a ReducedLogTable whose values are then
+ * summed in its own number type and scale.
+ */
+template <int N, typename Model>
+auto compute_swap_delta_fixed(const TransitionCounts &counts,
+                              const TransitionCounts &transposed_counts,
+                              int first_ix, const Permutation &permutation,
+                              int a, int b, const Model &model) {
+  // double for a LanguageModel, float or int32 for a reduced table.
+  using Accumulator = decltype(model.log_frequency(0) * 1);
+  if (a == b) {
+    return Accumulator(0);
+  }
+  const int pa = permutation[a];
+  const int pb = permutation[b];
+
+  Accumulator delta = 0;
+  if (first_ix == a) {
+    delta += model.log_frequency(pb) - model.log_frequency(pa);
+  } else if (first_ix == b) {
+    delta += model.log_frequency(pa) - model.log_frequency(pb);
+  }
+
+  const int *row_a = &counts(a, 0);
+  const int *row_b = &counts(b, 0);
+  const int *col_a = &transposed_counts(a, 0);
+  const int *col_b = &transposed_counts(b, 0);
+  std::array<int, N> row_diff;
+  std::array<int, N> col_diff;
+  for (int k = 0; k < N; ++k) {
+    row_diff[k] = row_a[k] - row_b[k];
+    col_diff[k] = col_a[k] - col_b[k];
+  }
+  row_diff[a] = row_diff[b] = col_diff[a] = col_diff[b] = 0;
+
+  // Symbols past the real alphabet have zero counts and are skipped here,
+  // so the model is never read outside its rows.
+  const auto *log_row_pa = model.log_transition_row(pa);
+  const auto *log_row_pb = model.log_transition_row(pb);
+  for (int k = 0; k < N; ++k) {
+    if ((row_diff[k] | col_diff[k]) == 0) {
+      continue;
+    }
+    const int pk = permutation[k];
+    if (row_diff[k] != 0) {
+      delta += row_diff[k] * (log_row_pb[pk] - log_row_pa[pk]);
+    }
+    if (col_diff[k] != 0) {
+      const auto *log_row_pk = model.log_transition_row(pk);
+      delta += col_diff[k] * (log_row_pk[pb] - log_row_pk[pa]);
+    }
+  }
+
+  delta += row_a[a] * (log_row_pb[pb] - log_row_pa[pa]);
+  delta += row_b[b] * (log_row_pa[pa] - log_row_pb[pb]);
+  delta += row_a[b] * (log_row_pb[pa] - log_row_pa[pb]);
+  delta += row_b[a] * (log_row_pa[pb] - log_row_pb[pa]);
+
+  return delta;
+}
+
+/**
+ * @brief The distinct n-grams of a text to be decoded and how often each
+ * occurs. An n-gram is stored as the alphabet indices of its characters
+ * packed into the bytes of a key, first index highest, as LanguageModel
+ * expects. N-grams with characters outside the alphabet are left out.
+ */
+struct NgramCounts {
+  int order;
+  std::vector<uint32_t> keys;
+  std::vector<int> counts;
+  // [s] lists the positions in keys of the n-grams that contain symbol s,
+  // so a swap of two symbols only revisits the n-grams it changes.
+  std::vector<std::vector<int> > by_symbol;
+};
+
+/**
+ * @brief Aggregates the n-grams of a text once, before the MCMC simulation,
+ * as compute_transition_counts does for bigrams.
+ * @param text The input text string.
+ * @param char_to_ix A map from characters to their integer index.
+ * @param order The n-gram order, from 3 to kMaxNgramOrder.
+ * @return The n-gram counts of the text.
+ */
+NgramCounts compute_ngram_counts(const std::string &text,
+                                 const std::map<char, int> &char_to_ix,
+                                 int order);
+
+/**
+ * @brief Computes the log likelihood of a text from its n-gram counts under
+ * a model of the same order: the sum of log p(last | context) over the
+ * text's n-grams.
+ * @param ngram_counts The pre-calculated n-gram counts of the text.
+ * @param permutation The current permutation being tested.
+ * @param model A language model of order ngram_counts.order.
+ * @return The log likelihood of the text under the given permutation.
+ */
+double compute_log_probability_by_ngrams(const NgramCounts &ngram_counts,
+                                         const Permutation &permutation,
+                                         const LanguageModel &model);
+
+/**
+ * @brief Computes the change in the n-gram log likelihood caused by
+ * swapping the images of two symbols. Only the n-grams that contain one of
+ * the symbols are rescored.
+ * @param ngram_counts The pre-calculated n-gram counts of the text.
+ * @param permutation The current permutation.
+ * @param a The index of the first symbol to swap.
+ * @param b The index of the second symbol to swap.
+ * @param model A language model of order ngram_counts.order.
+ * @return The log likelihood after the swap minus the log likelihood before.
+ */
+double compute_swap_delta_by_ngrams(const NgramCounts &ngram_counts,
+                                    const Permutation &permutation, int a,
+                                    int b, const LanguageModel &model);
+
+/**
+ * @brief Density policy for metropolis_hastings_annealing that scores a
+ * permutation against pre-calculated bigram counts and scores swap moves
+ * incrementally.
+ */
+class BigramDensity {
+ public:
+  BigramDensity(const TransitionCounts &text_transition_counts, int first_ix,
+                const LanguageModel &model)
+      : counts_(text_transition_counts), first_ix_(first_ix), model_(model) {}
+
+  double score(const Permutation &permutation) const {
+    return compute_log_probability_by_counts(counts_, first_ix_, permutation,
+                                             model_);
+  }
+
+  template <typename Move>
+  double delta(const Permutation &permutation, double,
+               const Move &move) const {
+    return compute_swap_delta_by_counts(counts_, first_ix_, permutation,
+                                        move.a, move.b, model_);
+  }
+
+ private:
+  const TransitionCounts &counts_;
+  int first_ix_;
+  const LanguageModel &model_;
+};
+
+/**
+ * @brief Density policy that scores with the n-gram order the model was
+ * trained with: the bigram kernels for an order 2 model, and the n-gram
+ * tables for higher orders. The text is aggregated once at that order.
+ * Full bigram rescores walk the text's sparse bigram list with the best
+ * SIMD kernel the CPU has. Bigram swaps use a kernel compiled for the
+ * alphabet size when one of kFixedAlphabetSizes fits the model. A bigram
+ * model can also be scored from float or int16 copies of its tables; that
+ * needs a fixed-size kernel, and the density stays in double otherwise.
+ */
+class NgramDensity {
+ public:
+  /**
+   * @param text The text to be decoded.
+   * @param model The language model to score with.
+   * @param precision The number type of the bigram tables.
+   * @param local_tables Swap deltas read a private copy of the double
+   * tables rather than the shared model, so a density built by a pinned
+   * thread keeps its hot data on that thread's NUMA node.
+   */
+  NgramDensity(const std::string &text, const LanguageModel &model,
+               ScorePrecision precision = ScorePrecision::kDouble,
+               bool local_tables = false);
+
+  /**
+   * @brief Replaces the text being decoded, keeping the model, precision
+   * and tables. A bigram density recounts into its existing buffers, so a
+   * reused density allocates nothing once it has seen a text of the size;
+   * int16 tables are only requantized if the text needs a new scale.
+   */
+  void reset(const std::string &text);
+
+  // The precision actually used, which may be kDouble despite the request.
+  ScorePrecision precision() const { return precision_; }
+
+  double score(const Permutation &permutation) const {
+    if (model_.order() > 2) {
+      return compute_log_probability_by_ngrams(ngram_counts_, permutation,
+                                               model_);
+    }
+    switch (precision_) {
+      case ScorePrecision::kFloat:
+        return compute_log_probability_by_table(sparse_counts_, first_ix_,
+                                                permutation, float_table_);
+      case ScorePrecision::kInt16:
+        return compute_log_probability_by_table(sparse_counts_, first_ix_,
+                                                permutation, int16_table_);
+      default:
+        return compute_log_probability_by_sparse_counts(
+            sparse_counts_, first_ix_, permutation, model_);
+    }
+  }
+
+  template <typename Move>
+  double delta(const Permutation &permutation, double,
+               const Move &move) const {
+    if (model_.order() > 2) {
+      return compute_swap_delta_by_ngrams(ngram_counts_, permutation, move.a,
+                                          move.b, model_);
+    }
+    switch (precision_) {
+      case ScorePrecision::kFloat:
+        return fixed_delta(float_table_, permutation, move.a, move.b) *
+               float_table_.inverse_scale();
+      case ScorePrecision::kInt16:
+        return fixed_delta(int16_table_, permutation, move.a, move.b) *
+               int16_table_.inverse_scale();
+      default:
+        if (fixed_size_ == 0) {
+          return compute_swap_delta_by_counts(transition_counts_, first_ix_,
+                                              permutation, move.a, move.b,
+                                              model_);
+        }
+        if (local_tables_) {
+          return fixed_delta(double_table_, permutation, move.a, move.b);
+        }
+        return fixed_delta(model_, permutation, move.a, move.b);
+    }
+  }
+
+  /**
+   * @brief Computes the change in log likelihood of every swap of two of
+   * the given symbols, as a matrix over the model's symbols; cells of other
+   * symbols are zero. Bigram models fill it in one batch. Neither deltas
+   * nor scratch is reallocated if it already has the model's size.
+   */
+  void swap_deltas(const Permutation &permutation,
+                   const std::vector<int> &symbols, DoubleMatrix &deltas,
+                   SwapDeltaScratch &scratch) const;
+
+ private:
+  // Dispatches to the swap kernel compiled for fixed_size_.
+  template <typename Model>
+  auto fixed_delta(const Model &model, const Permutation &permutation, int a,
+                   int b) const {
+    switch (fixed_size_) {
+      case 27:
+        return compute_swap_delta_fixed<27>(transition_counts_,
+                                            transposed_counts_, first_ix_,
+                                            permutation, a, b, model);
+      case 53:
+        return compute_swap_delta_fixed<53>(transition_counts_,
+                                            transposed_counts_, first_ix_,
+                                            permutation, a, b, model);
+      default:
+        return compute_swap_delta_fixed<96>(transition_counts_,
+                                            transposed_counts_, first_ix_,
+                                            permutation, a, b, model);
+    }
+  }
+
+  const LanguageModel &model_;
+  // The compile-time kernel's alphabet size, or 0 for the generic kernel.
+  int fixed_size_;
+  ScorePrecision precision_;
+  TransitionCounts transition_counts_;
+  // Only filled for a fixed-size kernel.
+  TransitionCounts transposed_counts_;
+  SparseBigramCounts sparse_counts_;
+  int first_ix_;
+  NgramCounts ngram_counts_;
+  // Only the table matching precision_ is filled, and the double one only
+  // for local tables.
+  bool local_tables_;
+  ReducedLogTable<double> double_table_;
+  ReducedLogTable<float> float_table_;
+  ReducedLogTable<int16_t> int16_table_;
+};
 
-#endif  // DECIPHERING_UTILS_HPP
\ No newline at end of file
+#endif  // DECIPHERING_UTILS_HPP
@@ -0,0 +1,74 @@
+#ifndef ISLAND_HPP
+#define ISLAND_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "deciphering_utils.hpp"
+#include "permutation.hpp"
+#include "thread_pool.hpp"
+
+// The settings of a coordinator or a worker of a multi-process run.
+struct IslandOptions {
+  // "unix:<path>", "<host>:<port>" for TCP, or a bare socket path.
+  std::string endpoint;
+  // Guards against workers decoding a different text or alphabet; see
+  // checkpoint_text_hash.
+  uint64_t text_hash = 0;
+  int n_chars = 0;
+  // Worker only: the annealing budget and chains of this process.
+  int iters = 500000;
+  int n_chains = 1;
+  uint64_t seed = 0;
+  // Worker only: iterations between two exchanges with the coordinator.
+  int exchange_every = 100000;
+  double initial_temp = 1.0;
+  double final_temp = 0.001;
+  // Coordinator only: keep accepting until this many workers have joined.
+  int expected_workers = 1;
+};
+
+// The best key a coordinator or worker ended up with.
+struct IslandResult {
+  Permutation best_state;
+  double best_log_prob;
+};
+
+/**
+ * @brief Runs this process's chains as one island of a multi-process run.
+ * The budget is cut into segments of exchange_every iterations along one
+ * cooling schedule. After each segment the worker reports its best key to
+ * the coordinator if it improved, and adopts the best key the coordinator
+ * broadcast meanwhile as a migrant that replaces its worst chain. A worker
+ * whose coordinator goes away, or rejects it for decoding a different
+ * text, carries on alone.
+ * @param density The density of the text to decode.
+ * @param chars The model alphabet.
+ * @param symbols The symbols the chains may swap.
+ * @param options The endpoint, budget and exchange settings.
+ * @param pool The pool the chains run on.
+ * @param result Receives the best key of this worker.
+ * @return False, after reporting the error, if the coordinator could not
+ * be reached.
+ */
+bool run_island_worker(const NgramDensity &density,
+                       const std::vector<char> &chars,
+                       const std::vector<int> &symbols,
+                       const IslandOptions &options, ThreadPool &pool,
+                       IslandResult &result);
+
+/**
+ * @brief Accepts workers on the endpoint, merges the keys they report and
+ * broadcasts every new global best to the other workers. A worker that
+ * disconnects is dropped and the run goes on without it. Returns once
+ * expected_workers have joined and every worker has finished or died.
+ * @param options The endpoint, the text guard and expected_workers.
+ * @param result Receives the best key reported by any worker.
+ * @return False, after reporting the error, if the endpoint could not be
+ * opened or no worker reported a key.
+ */
+bool run_island_coordinator(const IslandOptions &options,
+                            IslandResult &result);
+
+#endif  // ISLAND_HPP
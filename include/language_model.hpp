@@ -0,0 +1,232 @@
+#ifndef LANGUAGE_MODEL_HPP
+#define LANGUAGE_MODEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "corpus.hpp"
+
+// Identifies a binary language model file and its layout version. Version 2
+// adds the n-gram table; version 1 files are still read as bigram models.
+constexpr char kModelMagic[8] = {'M', 'C', 'M', 'C', 'L', 'M', '\0', '\0'};
+constexpr uint32_t kModelVersion = 2;
+
+/**
+ * @brief The fixed-size header at the start of a binary model file. All
+ * offsets are in bytes from the start of the file and 64-byte aligned.
+ */
+struct ModelFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_chars;
+  // The number of doubles between the starts of two transition matrix rows.
+  uint32_t row_stride;
+  // The n-gram order; 0 in version 1 files, which are bigram models.
+  uint32_t order;
+  uint64_t chars_offset;
+  uint64_t log_frequency_offset;
+  uint64_t log_transition_offset;
+  uint64_t file_size;
+  // The NgramTableHeader when order > 2, otherwise 0.
+  uint64_t ngram_offset;
+};
+
+/**
+ * @brief Describes the two hash tables of a model of order 3 or more: one
+ * holding the smoothed conditional log-probability of every n-gram seen in
+ * training, and one holding, for every (n-1)-gram context seen, the
+ * log-probability of an n-gram in that context that was never seen. Values
+ * are quantized to 16 bits: log p = -code * step.
+ */
+struct NgramTableHeader {
+  uint32_t log2_capacity;
+  uint32_t context_log2_capacity;
+  double step;
+  uint64_t slots_offset;
+  uint64_t context_slots_offset;
+};
+
+// Marks an empty slot of a QuantizedLogTable. Keys pack alphabet indices
+// into bytes, and an alphabet has at most 255 characters, so no n-gram can
+// have this key.
+constexpr uint32_t kEmptyNgramKey = UINT32_MAX;
+
+// One slot of a QuantizedLogTable. The key and its code share a slot so a
+// probe touches a single cache line.
+struct NgramSlot {
+  uint32_t key;
+  uint16_t code;
+  uint16_t unused;
+};
+
+/**
+ * @brief A read-only open-addressing hash table from packed n-gram keys to
+ * 16-bit codes, with linear probing. It is a view of a model image.
+ */
+class QuantizedLogTable {
+ public:
+  QuantizedLogTable() : slots_(nullptr), shift_(32), mask_(0) {}
+  QuantizedLogTable(const NgramSlot *slots, int log2_capacity)
+      : slots_(slots),
+        shift_(32 - log2_capacity),
+        mask_((uint32_t{1} << log2_capacity) - 1) {}
+
+  // The slot a key hashes to before probing.
+  static uint32_t home_slot(uint32_t key, int shift) {
+    return (key * 0x9e3779b1u) >> shift;
+  }
+
+  // Returns the code stored under key, or -1 if the key is absent.
+  int find(uint32_t key) const {
+    for (uint32_t slot = home_slot(key, shift_);; slot = (slot + 1) & mask_) {
+      const NgramSlot &stored = slots_[slot];
+      if (stored.key == key) {
+        return stored.code;
+      }
+      if (stored.key == kEmptyNgramKey) {
+        return -1;
+      }
+    }
+  }
+
+ private:
+  const NgramSlot *slots_;
+  int shift_;
+  uint32_t mask_;
+};
+
+/**
+ * @brief The character statistics learned from a training text: the
+ * alphabet, the log unigram frequencies and the log bigram transition
+ * matrix. The tables use the binary file layout, so a model is either built
+ * in memory or memory-mapped straight from a file written by
+ * save_language_model, in which case processes share its pages.
+ */
+class LanguageModel {
+ public:
+  LanguageModel();
+  ~LanguageModel();
+  LanguageModel(LanguageModel &&other) noexcept;
+  LanguageModel &operator=(LanguageModel &&other) noexcept;
+  LanguageModel(const LanguageModel &) = delete;
+  LanguageModel &operator=(const LanguageModel &) = delete;
+
+  int size() const { return chars_.size(); }
+  // The n-gram order the model was trained with, from 2 to kMaxNgramOrder.
+  int order() const { return order_; }
+  const std::vector<char> &chars() const { return chars_; }
+  const std::map<char, int> &char_to_ix() const { return char_to_ix_; }
+
+  double log_frequency(int i) const { return log_frequency_[i]; }
+  const double *log_transition_row(int i) const {
+    return log_transition_ + static_cast<size_t>(i) * row_stride_;
+  }
+  double log_transition(int i, int j) const {
+    return log_transition_row(i)[j];
+  }
+  // The number of doubles between the starts of two transition rows.
+  size_t row_stride() const { return row_stride_; }
+
+  /**
+   * @brief Returns log p(last | context) for an n-gram of the model's order,
+   * given as alphabet indices packed into the bytes of key, first index
+   * highest. If the context never occurred in training, this backs off to
+   * the bigram transition of the last two characters, which keeps the score
+   * informative for the mostly unseen n-grams of a random key. Only valid
+   * when order() > 2.
+   */
+  double log_ngram(uint32_t key) const {
+    int code = ngrams_.find(key);
+    if (code < 0) {
+      code = contexts_.find(key >> 8);
+      if (code < 0) {
+        return log_transition((key >> 8) & 255, key & 255);
+      }
+    }
+    return -code * step_;
+  }
+
+  friend LanguageModel build_language_model(const CorpusCounts &counts);
+  friend bool save_language_model(const LanguageModel &model,
+                                  const std::string &filename);
+  friend bool load_language_model(const std::string &filename,
+                                  LanguageModel &model);
+
+ private:
+  // Points the table views at a buffer laid out like a model file.
+  void attach(const unsigned char *image, size_t size);
+  void release();
+
+  std::vector<char> chars_;
+  std::map<char, int> char_to_ix_;
+  // The whole model in file layout, whether owned or mapped.
+  const unsigned char *image_;
+  size_t image_size_;
+  const double *log_frequency_;
+  const double *log_transition_;
+  size_t row_stride_;
+  int order_;
+  QuantizedLogTable ngrams_;
+  QuantizedLogTable contexts_;
+  double step_;
+  // The file image when the model was trained in this process.
+  std::vector<unsigned char> storage_;
+  // The mapping when the model was loaded from a file.
+  void *mapping_;
+  size_t mapping_size_;
+};
+
+/**
+ * @brief Builds a language model from corpus counts. The alphabet is every
+ * character of the corpus in order of first appearance, the transition
+ * matrix uses add-1 smoothing, and logs are taken with a small epsilon so
+ * unseen characters do not give -infinity. For orders above 2 the n-gram
+ * conditionals use add-1 smoothing over the alphabet as well.
+ * @param counts The counts of the training corpus.
+ * @return The trained model.
+ */
+LanguageModel build_language_model(const CorpusCounts &counts);
+
+/**
+ * @brief Builds a language model from a training text held in memory.
+ * @param text The training text.
+ * @param order The n-gram order, from 2 to kMaxNgramOrder.
+ * @return The trained model.
+ */
+LanguageModel train_language_model(const std::string &text, int order = 2);
+
+/**
+ * @brief Builds a language model by streaming a training file through
+ * count_corpus_file, without holding the corpus in memory.
+ * @param filename The training file.
+ * @param n_threads The number of threads to count with.
+ * @param model Receives the trained model.
+ * @param order The n-gram order, from 2 to kMaxNgramOrder.
+ * @return True on success.
+ */
+bool train_language_model_from_file(const std::string &filename,
+                                    int n_threads, LanguageModel &model,
+                                    int order = 2);
+
+/**
+ * @brief Writes a model to a versioned binary file.
+ * @param model The model to save.
+ * @param filename The name of the file to write.
+ * @return True on success.
+ */
+bool save_language_model(const LanguageModel &model,
+                         const std::string &filename);
+
+/**
+ * @brief Memory-maps a binary model file written by save_language_model.
+ * @param filename The name of the file to map.
+ * @param model Receives the mapped model.
+ * @return True on success; false if the file is missing or not a model of
+ * this version.
+ */
+bool load_language_model(const std::string &filename, LanguageModel &model);
+
+#endif  // LANGUAGE_MODEL_HPP
@@ -0,0 +1,200 @@
+#ifndef LEXICON_HPP
+#define LEXICON_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "deciphering_utils.hpp"
+#include "matrix.hpp"
+#include "permutation.hpp"
+
+// Identifies a binary lexicon file and its layout version.
+constexpr char kLexiconMagic[8] = {'M', 'C', 'M', 'C', 'L', 'E', 'X', '\0'};
+constexpr uint32_t kLexiconVersion = 1;
+
+// The fixed-size header at the start of a binary lexicon file. It is
+// followed by the displacements, the fingerprints and the log-probabilities.
+struct LexiconFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_buckets;
+  uint64_t n_slots;
+  uint64_t n_words;
+  double miss_log_prob;
+};
+
+/**
+ * @brief The words of a training corpus and their log frequencies, stored
+ * as a perfect hash: a word's 64-bit hash picks a bucket, the bucket's
+ * displacement picks the word's slot, and no two words share a slot. A slot
+ * holds only a 32-bit fingerprint of the hash and a float, eight bytes per
+ * word, instead of the word itself. A word that is absent matches a
+ * fingerprint with probability 2^-32 at most. Words are maximal runs of the
+ * letters a-z and A-Z, folded to lower case.
+ */
+class Lexicon {
+ public:
+  Lexicon() : n_words_(0), miss_log_prob_(0) {}
+
+  // The hash of the empty word; hash_char extends a hash by one character.
+  static constexpr uint64_t kHashSeed = 0xcbf29ce484222325ull;
+  // FNV-1a on the character folded to lower case.
+  static uint64_t hash_char(uint64_t hash, char c) {
+    const char folded = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    return (hash ^ static_cast<unsigned char>(folded)) * 0x100000001b3ull;
+  }
+
+  bool empty() const { return n_words_ == 0; }
+  size_t size() const { return n_words_; }
+
+  // The log frequency of the word with this hash, or miss_log_prob().
+  double log_prob(uint64_t hash) const {
+    const uint32_t bucket =
+        static_cast<uint32_t>(hash) % displacements_.size();
+    const size_t slot =
+        slot_of(hash, displacements_[bucket], fingerprints_.size());
+    return fingerprints_[slot] == static_cast<uint32_t>(hash >> 32)
+               ? log_probs_[slot]
+               : miss_log_prob_;
+  }
+
+  // Below the log frequency of every word, so a miss never beats a hit.
+  double miss_log_prob() const { return miss_log_prob_; }
+
+  friend Lexicon build_lexicon(
+      const std::unordered_map<std::string, uint64_t> &word_counts);
+  friend bool save_lexicon(const Lexicon &lexicon,
+                           const std::string &filename);
+  friend bool load_lexicon(const std::string &filename, Lexicon &lexicon);
+
+ private:
+  static size_t slot_of(uint64_t hash, uint32_t displacement,
+                        size_t n_slots) {
+    // The splitmix64 finalizer, so every displacement is a fresh hash.
+    uint64_t x = hash + displacement * 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return (x ^ (x >> 31)) % n_slots;
+  }
+
+  std::vector<uint32_t> displacements_;
+  std::vector<uint32_t> fingerprints_;
+  std::vector<float> log_probs_;
+  size_t n_words_;
+  double miss_log_prob_;
+};
+
+/**
+ * @brief Builds a lexicon from folded words and their counts. A word's log
+ * frequency is log(count / total), and a miss scores as half a count.
+ */
+Lexicon build_lexicon(
+    const std::unordered_map<std::string, uint64_t> &word_counts);
+
+/**
+ * @brief Builds the lexicon of a training file, streamed in chunks so the
+ * corpus need not fit in memory.
+ * @return False, after reporting the error, if the file cannot be read.
+ */
+bool build_lexicon_from_file(const std::string &filename, Lexicon &lexicon);
+
+// The lexicon file kept alongside a model file.
+std::string lexicon_file_name(const std::string &model_file);
+
+/**
+ * @brief Writes a lexicon to a versioned binary file.
+ * @return True on success.
+ */
+bool save_lexicon(const Lexicon &lexicon, const std::string &filename);
+
+/**
+ * @brief Reads a binary lexicon file written by save_lexicon.
+ * @return True on success; false if the file is missing or not a lexicon
+ * of this version.
+ */
+bool load_lexicon(const std::string &filename, Lexicon &lexicon);
+
+/**
+ * @brief The words of a text to be decoded: its maximal runs of letters
+ * as alphabet indices, each distinct run once with its count. A key maps
+ * letters to letters, so the runs are the words of every decoding.
+ */
+struct TextWords {
+  // The symbols of word w are symbols[offsets[w] .. offsets[w + 1]).
+  std::vector<uint8_t> symbols;
+  std::vector<uint32_t> offsets;
+  std::vector<int> counts;
+  // [s] lists the words that contain symbol s, each once.
+  std::vector<std::vector<int> > by_symbol;
+};
+
+/**
+ * @brief Splits a text into its words once, before the MCMC simulation.
+ * @param text The text to be decoded.
+ * @param chars The model alphabet.
+ */
+TextWords compute_text_words(const std::string &text,
+                             const std::vector<char> &chars);
+
+// The word stage that ends each chain of a decode: over the last fraction
+// of its iterations the chain scores with a LexiconDensity of the given
+// weight.
+struct LexiconStage {
+  const Lexicon &lexicon;
+  const TextWords &words;
+  double weight;
+  double fraction;
+};
+
+/**
+ * @brief Density policy that adds a word-level score to an NgramDensity:
+ * weight times the sum of the lexicon log frequencies of the decoded
+ * words. A swap only rescores the words that contain one of the swapped
+ * symbols. Lexicon hits on whole words pin down the rare letters that
+ * character n-grams leave ambiguous.
+ */
+class LexiconDensity {
+ public:
+  /**
+   * @param base The character-level density.
+   * @param words The words of the text base scores.
+   * @param chars The model alphabet.
+   * @param lexicon The lexicon to look the decoded words up in.
+   * @param weight The weight of the word score against the base score.
+   */
+  LexiconDensity(const NgramDensity &base, const TextWords &words,
+                 const std::vector<char> &chars, const Lexicon &lexicon,
+                 double weight);
+
+  double score(const Permutation &permutation) const;
+
+  template <typename Move>
+  double delta(const Permutation &permutation, double log_prob,
+               const Move &move) const {
+    return base_.delta(permutation, log_prob, move) +
+           weight_ * word_delta(permutation, move.a, move.b);
+  }
+
+  // NgramDensity::swap_deltas plus the weighted word deltas.
+  void swap_deltas(const Permutation &permutation,
+                   const std::vector<int> &symbols, DoubleMatrix &deltas,
+                   SwapDeltaScratch &scratch) const;
+
+ private:
+  // The log frequency of word w with symbol a mapped to image_a and b to
+  // image_b, and every other symbol s to permutation[s].
+  double word_log_prob(int w, const Permutation &permutation, int a,
+                       int image_a, int b, int image_b) const;
+  // The change in the unweighted word score from swapping a and b.
+  double word_delta(const Permutation &permutation, int a, int b) const;
+
+  const NgramDensity &base_;
+  const TextWords &words_;
+  const std::vector<char> &chars_;
+  const Lexicon &lexicon_;
+  double weight_;
+};
+
+#endif  // LEXICON_HPP
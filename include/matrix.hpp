@@ -0,0 +1,178 @@
+#ifndef MATRIX_HPP
+#define MATRIX_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// The alignment of a matrix's storage and of each of its rows: one cache
+// line, which is also the width of the widest vector loads we use.
+constexpr size_t kMatrixAlignment = 64;
+
+/**
+ * @brief A standard allocator whose blocks are aligned to Alignment bytes.
+ */
+template <typename T, size_t Alignment = kMatrixAlignment>
+struct AlignedAllocator {
+  using value_type = T;
+
+  template <typename U>
+  struct rebind {
+    using other = AlignedAllocator<U, Alignment>;
+  };
+
+  AlignedAllocator() = default;
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(
+        ::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+  }
+  void deallocate(T *p, size_t) {
+    ::operator delete(p, std::align_val_t(Alignment));
+  }
+
+  template <typename U>
+  bool operator==(const AlignedAllocator<U, Alignment> &) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const AlignedAllocator<U, Alignment> &) const {
+    return false;
+  }
+};
+
+/**
+ * @brief A non-owning view of one matrix row. It is as cheap to pass as a
+ * pointer, but knows its length and can be iterated.
+ */
+template <typename T>
+class RowSpan {
+ public:
+  RowSpan(T *data, size_t size) : data_(data), size_(size) {}
+
+  T &operator[](size_t j) const { return data_[j]; }
+  T *data() const { return data_; }
+  size_t size() const { return size_; }
+  T *begin() const { return data_; }
+  T *end() const { return data_ + size_; }
+
+ private:
+  T *data_;
+  size_t size_;
+};
+
+/**
+ * @brief A dense row-major matrix in one contiguous block. The block and
+ * every row start on a kMatrixAlignment boundary: rows are padded to a
+ * whole number of cache lines, so stride() can exceed cols(). Padding cells
+ * hold T() and stay that way, so a kernel may read or sum whole strides.
+ * @tparam T The element type; its size must divide kMatrixAlignment.
+ */
+template <typename T>
+class Matrix {
+  static_assert(kMatrixAlignment % sizeof(T) == 0,
+                "Matrix elements must tile a cache line");
+
+ public:
+  Matrix() : rows_(0), cols_(0), stride_(0) {}
+
+  /**
+   * @brief Creates a rows x cols matrix with every cell set to value.
+   */
+  Matrix(size_t rows, size_t cols, const T &value = T())
+      : rows_(rows),
+        cols_(cols),
+        stride_(padded_stride(cols)),
+        data_(rows * stride_, T()) {
+    fill(value);
+  }
+
+  // The number of elements between the starts of two rows.
+  static size_t padded_stride(size_t cols) {
+    const size_t per_line = kMatrixAlignment / sizeof(T);
+    return (cols + per_line - 1) / per_line * per_line;
+  }
+
+  size_t rows() const { return rows_; }
+  size_t cols() const { return cols_; }
+  size_t stride() const { return stride_; }
+  bool empty() const { return rows_ == 0 || cols_ == 0; }
+
+  T &operator()(size_t i, size_t j) { return data_[i * stride_ + j]; }
+  const T &operator()(size_t i, size_t j) const {
+    return data_[i * stride_ + j];
+  }
+
+  RowSpan<T> row(size_t i) { return RowSpan<T>(&data_[i * stride_], cols_); }
+  RowSpan<const T> row(size_t i) const {
+    return RowSpan<const T>(&data_[i * stride_], cols_);
+  }
+  // Allows m[i][j], as with nested vectors.
+  RowSpan<T> operator[](size_t i) { return row(i); }
+  RowSpan<const T> operator[](size_t i) const { return row(i); }
+
+  // The whole block, rows() * stride() elements including padding.
+  T *data() { return data_.data(); }
+  const T *data() const { return data_.data(); }
+
+  // Sets every cell, leaving the padding at T().
+  void fill(const T &value) {
+    for (size_t i = 0; i < rows_; ++i) {
+      std::fill_n(&data_[i * stride_], cols_, value);
+    }
+  }
+
+  // Returns a copy with rows and columns exchanged.
+  Matrix transposed() const {
+    Matrix out(cols_, rows_);
+    for (size_t i = 0; i < rows_; ++i) {
+      for (size_t j = 0; j < cols_; ++j) {
+        out(j, i) = (*this)(i, j);
+      }
+    }
+    return out;
+  }
+
+  /**
+   * @brief Returns a rows x cols copy: cells inside both shapes are kept and
+   * new cells are T().
+   */
+  Matrix resized(size_t rows, size_t cols) const {
+    Matrix out(rows, cols);
+    for (size_t i = 0; i < std::min(rows, rows_); ++i) {
+      std::copy_n(&data_[i * stride_], std::min(cols, cols_), &out(i, 0));
+    }
+    return out;
+  }
+
+  /**
+   * @brief Returns a copy converted element-wise to U, e.g. a float copy of
+   * a double table to halve its cache footprint.
+   */
+  template <typename U>
+  Matrix<U> cast() const {
+    Matrix<U> out(rows_, cols_);
+    for (size_t i = 0; i < rows_; ++i) {
+      const T *src = &data_[i * stride_];
+      U *dst = &out(i, 0);
+      for (size_t j = 0; j < cols_; ++j) {
+        dst[j] = static_cast<U>(src[j]);
+      }
+    }
+    return out;
+  }
+
+ private:
+  size_t rows_;
+  size_t cols_;
+  size_t stride_;
+  std::vector<T, AlignedAllocator<T> > data_;
+};
+
+using DoubleMatrix = Matrix<double>;
+using FloatMatrix = Matrix<float>;
+
+#endif  // MATRIX_HPP
@@ -1,21 +1,586 @@
 #ifndef METROPOLIS_HASTINGS_HPP
 #define METROPOLIS_HASTINGS_HPP
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <functional>
-#include <map>
+#include <limits>
 #include <string>
 #include <vector>
 
-// Function declarations
-std::map<char, char> metropolis_hastings_annealing(
-    const std::map<char, char> &initial_state,
-    std::function<std::map<char, char>(const std::map<char, char> &,
-                                       const std::vector<char> &)>
+#include "checkpoint.hpp"
+#include "convergence.hpp"
+#include "deciphering_utils.hpp"
+#include "matrix.hpp"
+#include "permutation.hpp"
+#include "rng.hpp"
+#include "telemetry.hpp"
+#include "utils.hpp"
+
+// A proposed exchange of the images of two symbol indices.
+struct SymbolSwap {
+  int a;
+  int b;
+};
+
+inline void apply_move(Permutation &state, const SymbolSwap &move) {
+  state.swap(move.a, move.b);
+}
+
+// A proposal that replaces the whole state.
+inline void apply_move(Permutation &state, const Permutation &move) {
+  state = move;
+}
+
+/**
+ * @brief Proposal policy that swaps the images of two distinct symbols
+ * chosen uniformly from a fixed set.
+ */
+class UniformSwapProposal {
+ public:
+  // Requires at least two symbols.
+  explicit UniformSwapProposal(const std::vector<int> &symbols)
+      : symbols_(symbols) {}
+
+  SymbolSwap operator()(const Permutation &, Rng &rng) const {
+    const uint32_t n = symbols_.size();
+    int x = rng.uniform_int(n);
+    int y = rng.uniform_int(n);
+    while (x == y) {
+      y = rng.uniform_int(n);
+    }
+    return {symbols_[x], symbols_[y]};
+  }
+
+ private:
+  const std::vector<int> &symbols_;
+};
+
+/**
+ * @brief Cooling policy that decays the temperature exponentially from
+ * initial_temp to final_temp over iters steps.
+ */
+class ExponentialCooling {
+ public:
+  ExponentialCooling(double initial_temp, double final_temp, int iters)
+      : temp_(initial_temp),
+        factor_(std::pow(final_temp / initial_temp, 1.0 / (iters - 1))) {}
+
+  double temperature() const { return temp_; }
+  void advance() { temp_ *= factor_; }
+  // Continues a schedule from a checkpointed temperature.
+  void set_temperature(double temp) { temp_ = temp; }
+
+ private:
+  double temp_;
+  double factor_;
+};
+
+/**
+ * @brief Cooling policy that decays the temperature exponentially from
+ * initial_temp to final_temp over a wall-clock budget instead of an
+ * iteration count. The clock is read once every 1024 steps.
+ */
+class TimedExponentialCooling {
+ public:
+  TimedExponentialCooling(double initial_temp, double final_temp,
+                          double seconds)
+      : initial_temp_(initial_temp),
+        ratio_(final_temp / initial_temp),
+        seconds_(seconds),
+        start_(std::chrono::steady_clock::now()),
+        temp_(initial_temp),
+        steps_(0) {}
+
+  double temperature() const { return temp_; }
+  void advance() {
+    if (++steps_ % 1024 == 0) {
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start_;
+      temp_ = initial_temp_ *
+              std::pow(ratio_, std::min(1.0, elapsed.count() / seconds_));
+    }
+  }
+
+ private:
+  double initial_temp_;
+  double ratio_;
+  double seconds_;
+  std::chrono::steady_clock::time_point start_;
+  double temp_;
+  unsigned steps_;
+};
+
+/**
+ * @brief Cooling policy that lowers the temperature linearly from
+ * initial_temp to final_temp over iters steps. It spends more of the run
+ * hot than ExponentialCooling.
+ */
+class LinearCooling {
+ public:
+  LinearCooling(double initial_temp, double final_temp, int iters)
+      : temp_(initial_temp),
+        final_temp_(final_temp),
+        step_((initial_temp - final_temp) / (iters - 1)) {}
+
+  double temperature() const { return temp_; }
+  void advance() { temp_ = std::max(final_temp_, temp_ - step_); }
+  // Continues a schedule from a checkpointed temperature.
+  void set_temperature(double temp) { temp_ = temp; }
+
+ private:
+  double temp_;
+  double final_temp_;
+  double step_;
+};
+
+/**
+ * @brief Cooling policy that steers the temperature by the acceptance rate
+ * of moves that lower the log likelihood. The target rate falls
+ * geometrically from initial_acceptance to final_acceptance over iters
+ * steps. After every window of steps (a hundredth of iters, kept within
+ * 100..1000) the measured rate is compared to the target and the
+ * temperature rescaled. Moves that leave the log likelihood unchanged,
+ * such as swaps of two letters the text lacks, are not counted. Because
+ * log-likelihood deltas grow with the length of the text, a fixed schedule
+ * is too hot for long texts and too cold for short ones; following an
+ * acceptance trajectory spends the iterations in the same regime for any
+ * length.
+ */
+class AdaptiveCooling {
+ public:
+  AdaptiveCooling(double initial_temp, int iters, double initial_acceptance,
+                  double final_acceptance)
+      : window_(std::max(kMinWindow, std::min(kMaxWindow, iters / 100))),
+        temp_(initial_temp),
+        target_(initial_acceptance),
+        target_factor_(std::pow(final_acceptance / initial_acceptance,
+                                static_cast<double>(window_) / iters)),
+        proposed_(0),
+        accepted_(0),
+        steps_(0) {}
+
+  double temperature() const { return temp_; }
+
+  // Counts a move the engine proposed at the current temperature.
+  void observe(double delta, bool accepted) {
+    if (delta < 0) {
+      ++proposed_;
+      accepted_ += accepted;
+    }
+  }
+
+  void advance() {
+    if (++steps_ % window_ != 0) {
+      return;
+    }
+    // Smoothed, so the rate is never 0 or 1.
+    const double rate = (accepted_ + 0.5) / (proposed_ + 1.0);
+    // A worsening move is accepted with probability exp(-loss / T), so the
+    // rate is about exp(-c / T), and T * ln(rate) / ln(target) would hit
+    // the target. The step is bounded to damp the noise of one window.
+    const double factor = std::log(rate) / std::log(target_);
+    temp_ *= std::min(kMaxStep, std::max(1.0 / kMaxStep, factor));
+    target_ *= target_factor_;
+    proposed_ = 0;
+    accepted_ = 0;
+  }
+
+  void set_temperature(double temp) { temp_ = temp; }
+
+ private:
+  // The temperature is updated once per window of moves: often enough for
+  // a hundred updates, but on no fewer moves than kMinWindow.
+  static constexpr int kMinWindow = 100;
+  static constexpr int kMaxWindow = 1000;
+  static constexpr double kMaxStep = 1.25;
+
+  int window_;
+  double temp_;
+  double target_;
+  double target_factor_;
+  int proposed_;
+  int accepted_;
+  unsigned steps_;
+};
+
+/**
+ * @brief Picks the temperature at which a chain starting from state would
+ * accept a given share of its worsening moves: draws samples proposals,
+ * and bisects for the temperature T at which the mean of exp(-loss / T)
+ * over their losses equals target_acceptance. The losses scale with the
+ * length of the text, and so does the temperature.
+ * @return The calibrated temperature, or 1 if no sampled move lost.
+ */
+template <typename Proposal, typename Density>
+double calibrate_initial_temperature(const Permutation &state,
+                                     Proposal &proposal, Density &density,
+                                     Rng &rng, double target_acceptance,
+                                     int samples = 1000) {
+  const double log_prob = density.score(state);
+  std::vector<double> losses;
+  for (int k = 0; k < samples; ++k) {
+    const double delta = density.delta(state, log_prob, proposal(state, rng));
+    if (delta < 0) {
+      losses.push_back(-delta);
+    }
+  }
+  if (losses.empty()) {
+    return 1.0;
+  }
+  double low = 1e-6;
+  double high = 1e6;
+  for (int step = 0; step < 100; ++step) {
+    const double mid = std::sqrt(low * high);
+    double acceptance = 0;
+    for (double loss : losses) {
+      acceptance += std::exp(-loss / mid);
+    }
+    if (acceptance / losses.size() > target_acceptance) {
+      high = mid;
+    } else {
+      low = mid;
+    }
+  }
+  return std::sqrt(low * high);
+}
+
+// The cooling schedules a run can pick from the command line.
+enum class ScheduleKind { kExponential, kLinear, kAdaptive };
+
+// Parses "exponential", "linear" or "adaptive"; false for anything else.
+bool parse_schedule_kind(const std::string &name, ScheduleKind &kind);
+
+const char *schedule_kind_name(ScheduleKind kind);
+
+// The cooling schedule of a fixed-budget chain.
+struct ScheduleOptions {
+  ScheduleKind kind = ScheduleKind::kExponential;
+  double initial_temp = 1.0;
+  double final_temp = 0.001;
+  // Adaptive only: calibrate the initial temperature from a burn-in rather
+  // than using initial_temp.
+  bool calibrate = true;
+  // Adaptive only: the target acceptance rate of worsening moves at the
+  // start and at the end of the run.
+  double initial_acceptance = 0.5;
+  double final_acceptance = 0.001;
+};
+
+/**
+ * @brief Builds the schedule options ask for over iters steps and returns
+ * run(schedule). An adaptive schedule is first calibrated from the chain's
+ * initial state, which draws from the chain's generator.
+ */
+template <typename Proposal, typename Density, typename Run>
+auto run_with_schedule(const ScheduleOptions &options, int iters,
+                       const Permutation &initial_state, Proposal &proposal,
+                       Density &density, Rng &rng, Run run) {
+  switch (options.kind) {
+    case ScheduleKind::kLinear: {
+      LinearCooling schedule(options.initial_temp, options.final_temp, iters);
+      return run(schedule);
+    }
+    case ScheduleKind::kAdaptive: {
+      const double initial_temp =
+          options.calibrate
+              ? calibrate_initial_temperature(initial_state, proposal,
+                                              density, rng,
+                                              options.initial_acceptance)
+              : options.initial_temp;
+      AdaptiveCooling schedule(initial_temp, iters,
+                               options.initial_acceptance,
+                               options.final_acceptance);
+      return run(schedule);
+    }
+    default: {
+      ExponentialCooling schedule(options.initial_temp, options.final_temp,
+                                  iters);
+      return run(schedule);
+    }
+  }
+}
+
+// Passes a move's outcome to schedules that adapt to it; for the others
+// this is a no-op the compiler drops.
+template <typename Schedule>
+inline auto observe_move(Schedule &schedule, double delta, bool accepted, int)
+    -> decltype(schedule.observe(delta, accepted)) {
+  schedule.observe(delta, accepted);
+}
+template <typename Schedule>
+inline void observe_move(Schedule &, double, bool, long) {}
+
+/**
+ * @brief Performs one Metropolis-Hastings step at a fixed temperature.
+ * @param state The current state, updated in place if the move is accepted.
+ * @param log_prob The cached log likelihood of the state, updated with it.
+ * @param delta_out If not null, receives the delta of the proposed move.
+ * @return True if the proposed move was accepted.
+ */
+template <typename Proposal, typename Density>
+inline bool metropolis_hastings_step(Permutation &state, double &log_prob,
+                                     Proposal &proposal, Density &density,
+                                     double temp, Rng &rng,
+                                     double *delta_out = nullptr) {
+  const auto move = proposal(state, rng);
+  const double delta = density.delta(state, log_prob, move);
+  if (delta_out != nullptr) {
+    *delta_out = delta;
+  }
+
+  // Standard Metropolis-Hastings acceptance criterion, but with temperature.
+  // Improving moves are always accepted, so they skip the uniform draw and
+  // the logarithm.
+  if (delta >= 0 || delta / temp > std::log(rng.uniform_real())) {
+    apply_move(state, move);
+    log_prob += delta;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief A chain's counters, carried from one engine call to the next when
+ * its run is split into several, such as population rounds. A call counts
+ * the iterations and accepted moves it publishes and reports on from
+ * these, and adds its own to them when it returns, so they grow
+ * monotonically over the whole run.
+ */
+struct ChainProgress {
+  long long iteration = 0;
+  long long accepts = 0;
+  double best_log_prob = -std::numeric_limits<double>::infinity();
+  // False for a call that the chain's run continues after; only the last
+  // call reports the chain finished.
+  bool last = true;
+};
+
+/**
+ * @brief Runs Metropolis-Hastings with simulated annealing. The engine is
+ * parameterized on its policies so the whole inner loop can be inlined:
+ *  - proposal(state, rng) returns a move for apply_move().
+ *  - density.score(state) returns the full log likelihood of a state, and
+ *    density.delta(state, log_prob, move) the change caused by a move.
+ *  - schedule.temperature() gives the current temperature and
+ *    schedule.advance() cools it by one step. A schedule that also has
+ *    observe(delta, accepted) is told the outcome of every move.
+ * The log likelihood of the current state is cached and only updated by the
+ * delta of accepted moves. Progress is never written from the chain itself:
+ * if telemetry is given, the chain records its counters there periodically
+ * and once more when it finishes. If a convergence board is given, the chain
+ * publishes to it periodically and stops early once the board says so.
+ * If a checkpoint writer is given, the chain hands it a snapshot of its
+ * state whenever the writer asks, and its final state when it finishes; a
+ * chain started from such a snapshot continues exactly as the original
+ * would have, provided the caller restored the generator and the schedule's
+ * temperature from it too. All randomness is drawn from the chain's own
+ * generator.
+ * @param initial_state The starting permutation.
+ * @param rng The chain's random number generator.
+ * @param iters The number of iterations to run.
+ * @param telemetry The chain's telemetry, or null.
+ * @param board The board shared by all chains of the run, or null.
+ * @param chain The index of this chain on the board and the checkpoints.
+ * @param checkpoints The writer of the run's checkpoints, or null.
+ * @param resume The checkpoint to continue from, or null to start from
+ * initial_state.
+ * @param progress The counters of the chain's earlier calls, advanced by
+ * this one, or null if this call is the chain's whole run.
+ * @return The final permutation of the chain.
+ */
+template <typename Proposal, typename Density, typename Schedule>
+Permutation metropolis_hastings_annealing(
+    const Permutation &initial_state, Proposal &proposal, Density &density,
+    Schedule &schedule, Rng &rng, int iters,
+    ChainTelemetry *telemetry = nullptr, ConvergenceBoard *board = nullptr,
+    int chain = 0, CheckpointWriter *checkpoints = nullptr,
+    const ChainCheckpoint *resume = nullptr,
+    ChainProgress *progress = nullptr) {
+  Permutation current_state = resume ? resume->state : initial_state;
+  // A resumed chain keeps its cached score bit for bit rather than
+  // rescoring, so it follows the same path as the uninterrupted run.
+  double p1 = resume ? resume->log_prob : density.score(current_state);
+  double best = resume ? resume->best_log_prob : p1;
+  if (progress != nullptr) {
+    best = std::max(best, progress->best_log_prob);
+  }
+  long long accepts = resume ? resume->accepts : 0;
+  int done = resume ? resume->iteration : 0;
+  // Counters of earlier calls, added to what this call publishes.
+  const long long base_iteration = progress ? progress->iteration : 0;
+  const long long base_accepts = progress ? progress->accepts : 0;
+  int until_publish = 0;
+  if (board != nullptr) {
+    until_publish = board->publish_every() -
+                    (base_iteration + done) % board->publish_every();
+  }
+  const int sample_every = telemetry != nullptr ? telemetry->sample_every() : 0;
+  long long next_sample =
+      sample_every > 0
+          ? ((base_iteration + done) / sample_every + 1) * sample_every
+          : std::numeric_limits<long long>::max();
+  if (checkpoints != nullptr) {
+    checkpoints->start(chain);
+  }
+  // A continued run keeps measuring its rate from where it started.
+  if (telemetry != nullptr && base_iteration == 0) {
+    telemetry->start(done);
+  }
+  auto snapshot = [&]() {
+    ChainCheckpoint checkpoint;
+    checkpoint.iteration = done;
+    checkpoint.accepts = accepts;
+    checkpoint.log_prob = p1;
+    checkpoint.best_log_prob = best;
+    checkpoint.temperature = schedule.temperature();
+    checkpoint.rng_state = rng.state();
+    checkpoint.state = current_state;
+    return checkpoint;
+  };
+
+  // A chain that queued for a thread may start after the run has stopped.
+  const bool stopped = board != nullptr && board->stopped();
+  while (!stopped && done < iters) {
+    const double temp = schedule.temperature();
+    double delta = 0;
+    const bool accepted = metropolis_hastings_step(
+        current_state, p1, proposal, density, temp, rng, &delta);
+    if (accepted) {
+      ++accepts;
+      best = std::max(best, p1);
+    }
+    observe_move(schedule, delta, accepted, 0);
+    ++done;
+
+    // Cool the temperature for the next iteration
+    schedule.advance();
+
+    if (base_iteration + done == next_sample) {
+      telemetry->record(base_iteration + done, base_accepts + accepts, temp,
+                        p1, best, current_state);
+      next_sample += sample_every;
+    }
+
+    if (board != nullptr && --until_publish == 0) {
+      if (!board->publish(chain, current_state, p1, base_iteration + done)) {
+        break;
+      }
+      until_publish = board->publish_every();
+    }
+
+    if (checkpoints != nullptr && done % CheckpointWriter::kPollEvery == 0 &&
+        checkpoints->requested(chain)) {
+      checkpoints->submit(chain, snapshot(), false);
+    }
+  }
+
+  if (checkpoints != nullptr) {
+    checkpoints->submit(chain, snapshot(), true);
+  }
+  if (telemetry != nullptr && (progress == nullptr || progress->last)) {
+    telemetry->record(base_iteration + done, base_accepts + accepts,
+                      schedule.temperature(), p1, best, current_state, true);
+  }
+  if (progress != nullptr) {
+    progress->iteration += done;
+    progress->accepts += accepts;
+    progress->best_log_prob = best;
+  }
+  return current_state;
+}
+
+/**
+ * @brief Polishes an annealed key by steepest descent: scores every swap of
+ * two symbols in one batch, applies the best one if it improves the log
+ * likelihood, and repeats until none does. The result is a local optimum
+ * under swaps, which annealing at a low final temperature only approaches
+ * by chance.
+ * @param state The key to polish, updated in place.
+ * @param density A density with swap_deltas(permutation, symbols, deltas,
+ * scratch).
+ * @param symbols The symbols whose images may be swapped.
+ * @param deltas, scratch Buffers for the batched deltas, reused across
+ * calls so a caller that keeps them does not allocate.
+ * @param max_swaps An upper bound on the number of swaps applied.
+ * @return The number of swaps applied.
+ */
+template <typename Density>
+int steepest_descent_polish(Permutation &state, const Density &density,
+                            const std::vector<int> &symbols,
+                            DoubleMatrix &deltas, SwapDeltaScratch &scratch,
+                            int max_swaps = 1000) {
+  // Gains below this are rounding noise between the batched and the exact
+  // deltas rather than real improvements.
+  constexpr double kMinGain = 1e-9;
+  int swaps = 0;
+  while (swaps < max_swaps) {
+    density.swap_deltas(state, symbols, deltas, scratch);
+    double best_gain = kMinGain;
+    SymbolSwap best_move = {-1, -1};
+    for (size_t x = 0; x < symbols.size(); ++x) {
+      for (size_t y = x + 1; y < symbols.size(); ++y) {
+        const double gain = deltas(symbols[x], symbols[y]);
+        if (gain > best_gain) {
+          best_gain = gain;
+          best_move = {symbols[x], symbols[y]};
+        }
+      }
+    }
+    if (best_move.a < 0) {
+      break;
+    }
+    apply_move(state, best_move);
+    ++swaps;
+  }
+  return swaps;
+}
+
+// As above, with buffers that live for this call only.
+template <typename Density>
+int steepest_descent_polish(Permutation &state, const Density &density,
+                            const std::vector<int> &symbols,
+                            int max_swaps = 1000) {
+  DoubleMatrix deltas;
+  SwapDeltaScratch scratch;
+  return steepest_descent_polish(state, density, symbols, deltas, scratch,
+                                 max_swaps);
+}
+
+// Compatibility wrappers around the templated engine.
+Permutation metropolis_hastings_annealing(
+    const Permutation &initial_state,
+    std::function<Permutation(const Permutation &, const std::vector<int> &,
+                              Rng &)>
         proposal_function,
-    std::function<double(const std::string &, const std::map<char, char> &)>
+    std::function<double(const std::string &, const Permutation &)>
         log_density,
-    const std::vector<char> &chars, const std::string &text, int iters = 500000,
+    const std::vector<int> &symbols, const std::vector<char> &chars,
+    const std::string &text, Rng &rng, int iters = 500000,
+    int print_every = 99000, double initial_temp = 1.0,
+    double final_temp = 0.001);
+
+/**
+ * @brief Runs simulated annealing over uniform swap moves, scoring each
+ * proposal with an incremental delta instead of a full rescore.
+ * @param initial_state The starting permutation.
+ * @param log_density Returns the full log likelihood of a permutation.
+ * @param log_density_delta Returns the change in log likelihood of swapping
+ * the images of two symbol indices under the given permutation.
+ * @param symbols The symbol indices whose images may be swapped.
+ * @param chars The alphabet, used for progress output only.
+ * @param text The text being decoded, used for progress output only.
+ * @param rng The chain's random number generator.
+ * @return The final permutation of the chain.
+ */
+Permutation metropolis_hastings_annealing(
+    const Permutation &initial_state,
+    std::function<double(const Permutation &)> log_density,
+    std::function<double(const Permutation &, int, int)> log_density_delta,
+    const std::vector<int> &symbols, const std::vector<char> &chars,
+    const std::string &text, Rng &rng, int iters = 500000,
     int print_every = 99000, double initial_temp = 1.0,
     double final_temp = 0.001);
 
-#endif  // METROPOLIS_HASTINGS_HPP
\ No newline at end of file
+#endif  // METROPOLIS_HASTINGS_HPP
@@ -0,0 +1,205 @@
+#ifndef PARALLEL_TEMPERING_HPP
+#define PARALLEL_TEMPERING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "affinity.hpp"
+#include "convergence.hpp"
+#include "metropolis_hastings.hpp"
+#include "permutation.hpp"
+#include "rng.hpp"
+#include "telemetry.hpp"
+
+/**
+ * @brief A reusable sense-reversing barrier built on two atomics. Waiting
+ * threads yield instead of blocking on a mutex, which keeps the short
+ * exchange rounds of parallel tempering cheap.
+ */
+class SpinBarrier {
+ public:
+  explicit SpinBarrier(int count)
+      : count_(count), waiting_(0), generation_(0) {}
+
+  void wait() {
+    const unsigned generation = generation_.load(std::memory_order_acquire);
+    if (waiting_.fetch_add(1, std::memory_order_acq_rel) + 1 == count_) {
+      waiting_.store(0, std::memory_order_relaxed);
+      generation_.fetch_add(1, std::memory_order_release);
+    } else {
+      while (generation_.load(std::memory_order_acquire) == generation) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+ private:
+  const int count_;
+  std::atomic<int> waiting_;
+  std::atomic<unsigned> generation_;
+};
+
+/**
+ * @brief Returns n temperatures spaced geometrically from t_min to t_max.
+ */
+inline std::vector<double> geometric_temperature_ladder(int n, double t_min,
+                                                        double t_max) {
+  std::vector<double> temperatures(n, t_min);
+  for (int k = 1; k < n; ++k) {
+    temperatures[k] = t_min * std::pow(t_max / t_min, double(k) / (n - 1));
+  }
+  return temperatures;
+}
+
+// The outcome of a parallel tempering run.
+struct TemperingResult {
+  Permutation best_state;
+  double best_log_prob;
+  // Swap attempts and acceptances between rungs k and k + 1.
+  std::vector<long long> swap_attempts;
+  std::vector<long long> swap_accepts;
+};
+
+/**
+ * @brief Runs replica-exchange Metropolis-Hastings. Replica k runs on its own
+ * thread at temperatures[k], since all replicas must run at once to meet;
+ * every swap_every iterations the replicas meet at a barrier and
+ * alternately the even or the odd neighbouring pairs try to exchange
+ * states. Each pair is decided by the thread of its lower rung, so the
+ * exchange itself needs no locking.
+ * @param initial_states One starting permutation per replica.
+ * @param temperatures The temperature ladder, coldest first.
+ * @param rngs One random number generator per replica.
+ * @param iters The number of iterations each replica runs.
+ * @param swap_every The number of iterations between exchange rounds.
+ * @param telemetry If given, replica k records its counters to chain k of
+ * the reporter.
+ * @param board If given, the coldest replica publishes to it after every
+ * exchange round and all replicas stop together once it says so.
+ * @param cpus If not empty, replica k's thread is pinned to
+ * cpus[k % cpus.size()].
+ * @return The best state seen by any replica and the swap statistics.
+ */
+template <typename Proposal, typename Density>
+TemperingResult parallel_tempering(
+    const std::vector<Permutation> &initial_states, Proposal &proposal,
+    Density &density, const std::vector<double> &temperatures,
+    std::vector<Rng> &rngs, int iters, int swap_every,
+    TelemetryReporter *telemetry = nullptr, ConvergenceBoard *board = nullptr,
+    const std::vector<int> &cpus = std::vector<int>()) {
+  // Each replica gets its own cache line so neighbours do not false share.
+  struct alignas(64) Replica {
+    Permutation state;
+    double log_prob;
+    Permutation best_state;
+    double best_log_prob;
+  };
+
+  const int n = initial_states.size();
+  std::vector<Replica> replicas(n);
+  for (int k = 0; k < n; ++k) {
+    replicas[k].state = initial_states[k];
+    replicas[k].log_prob = density.score(initial_states[k]);
+    replicas[k].best_state = replicas[k].state;
+    replicas[k].best_log_prob = replicas[k].log_prob;
+  }
+
+  TemperingResult result;
+  result.swap_attempts.assign(n > 1 ? n - 1 : 0, 0);
+  result.swap_accepts.assign(n > 1 ? n - 1 : 0, 0);
+
+  SpinBarrier barrier(n);
+  // Written by the coldest replica's thread between the two barriers of a
+  // round, and read by every thread after the second.
+  bool stop_requested = false;
+  std::vector<std::thread> threads;
+  for (int k = 0; k < n; ++k) {
+    threads.emplace_back([&, k]() {
+      if (!cpus.empty()) {
+        pin_current_thread(cpus[k % cpus.size()]);
+      }
+      Rng &rng = rngs[k];
+      const double temp = temperatures[k];
+      ChainTelemetry *chain_telemetry =
+          telemetry != nullptr ? &telemetry->chain(k) : nullptr;
+      const int sample_every =
+          chain_telemetry != nullptr ? chain_telemetry->sample_every() : 0;
+      long long next_sample = sample_every > 0
+                                  ? sample_every
+                                  : std::numeric_limits<long long>::max();
+      long long accepts = 0;
+      int round = 0;
+      int done = 0;
+      while (done < iters) {
+        Replica &replica = replicas[k];
+        const int steps = std::min(swap_every, iters - done);
+        for (int s = 0; s < steps; ++s) {
+          if (metropolis_hastings_step(replica.state, replica.log_prob,
+                                       proposal, density, temp, rng)) {
+            ++accepts;
+            if (replica.log_prob > replica.best_log_prob) {
+              replica.best_log_prob = replica.log_prob;
+              replica.best_state = replica.state;
+            }
+          }
+          if (done + s + 1 == next_sample) {
+            chain_telemetry->record(done + s + 1, accepts, temp,
+                                    replica.log_prob, replica.best_log_prob,
+                                    replica.state);
+            next_sample += sample_every;
+          }
+        }
+        done += steps;
+
+        // Exchange round: alternate between the even and the odd pairs so
+        // that every replica takes part in at most one exchange.
+        barrier.wait();
+        if (k + 1 < n && k % 2 == round % 2) {
+          Replica &colder = replicas[k];
+          Replica &hotter = replicas[k + 1];
+          const double log_alpha = (hotter.log_prob - colder.log_prob) *
+                                   (1.0 / temp - 1.0 / temperatures[k + 1]);
+          ++result.swap_attempts[k];
+          if (log_alpha >= 0 || std::log(rng.uniform_real()) < log_alpha) {
+            std::swap(colder.state, hotter.state);
+            std::swap(colder.log_prob, hotter.log_prob);
+            ++result.swap_accepts[k];
+          }
+        }
+        if (k == 0 && board != nullptr &&
+            !board->publish(0, replicas[0].best_state,
+                            replicas[0].best_log_prob, done)) {
+          stop_requested = true;
+        }
+        barrier.wait();
+        if (stop_requested) {
+          break;
+        }
+        ++round;
+      }
+      if (chain_telemetry != nullptr) {
+        chain_telemetry->record(done, accepts, temp, replicas[k].log_prob,
+                                replicas[k].best_log_prob, replicas[k].state,
+                                true);
+      }
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+
+  result.best_log_prob = -std::numeric_limits<double>::infinity();
+  for (const Replica &replica : replicas) {
+    if (replica.best_log_prob > result.best_log_prob) {
+      result.best_log_prob = replica.best_log_prob;
+      result.best_state = replica.best_state;
+    }
+  }
+  return result;
+}
+
+#endif  // PARALLEL_TEMPERING_HPP
@@ -0,0 +1,73 @@
+#ifndef PERMUTATION_HPP
+#define PERMUTATION_HPP
+
+#include <array>
+#include <cstdint>
+#include <utility>
+
+// The largest alphabet a permutation can hold: one symbol per byte value.
+constexpr int kMaxSymbols = 256;
+
+/**
+ * @brief A permutation of the symbol indices [0, size) together with its
+ * inverse. Both directions live in fixed-size arrays, so copying, swapping
+ * and lookups never touch the heap.
+ */
+class Permutation {
+ public:
+  Permutation() : Permutation(0) {}
+
+  /**
+   * @brief Creates the identity permutation over `size` symbols.
+   */
+  explicit Permutation(int size) : size_(size) {
+    for (int i = 0; i < kMaxSymbols; ++i) {
+      forward_[i] = static_cast<uint8_t>(i);
+      inverse_[i] = static_cast<uint8_t>(i);
+    }
+  }
+
+  int size() const { return size_; }
+
+  // The index that symbol i is mapped to.
+  int operator[](int i) const { return forward_[i]; }
+
+  // The symbol that is mapped to index j.
+  int inverse(int j) const { return inverse_[j]; }
+
+  /**
+   * @brief Exchanges the images of symbols a and b in place.
+   */
+  void swap(int a, int b) {
+    std::swap(forward_[a], forward_[b]);
+    inverse_[forward_[a]] = static_cast<uint8_t>(a);
+    inverse_[forward_[b]] = static_cast<uint8_t>(b);
+  }
+
+  /**
+   * @brief Maps symbol i to index j, giving i's old image to the symbol that
+   * previously mapped to j so the permutation stays a bijection.
+   */
+  void set(int i, int j) { swap(i, inverse_[j]); }
+
+  // A 64-bit FNV-1a hash of the mapping, for cheap equality checks.
+  uint64_t hash() const {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < size_; ++i) {
+      h = (h ^ forward_[i]) * 0x100000001b3ULL;
+    }
+    return h;
+  }
+
+  bool operator==(const Permutation &other) const {
+    return size_ == other.size_ && forward_ == other.forward_;
+  }
+  bool operator!=(const Permutation &other) const { return !(*this == other); }
+
+ private:
+  std::array<uint8_t, kMaxSymbols> forward_;
+  std::array<uint8_t, kMaxSymbols> inverse_;
+  int size_;
+};
+
+#endif  // PERMUTATION_HPP
@@ -0,0 +1,162 @@
+#ifndef POPULATION_ANNEALING_HPP
+#define POPULATION_ANNEALING_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+#include <sstream>
+#include <vector>
+
+#include "convergence.hpp"
+#include "metropolis_hastings.hpp"
+#include "permutation.hpp"
+#include "rng.hpp"
+#include "telemetry.hpp"
+#include "thread_pool.hpp"
+
+// The shape of a population annealing run.
+struct PopulationOptions {
+  // The number of chains; typically several times the number of cores.
+  int population = 0;
+  // The number of segments the budget is cut into; the population is culled
+  // between two segments.
+  int rounds = 8;
+  // The share of the chains, worst first, that are replaced after a round.
+  double cull_fraction = 0.5;
+  // The number of random letter swaps applied to a respawned copy.
+  int perturb_swaps = 2;
+  double initial_temp = 1.0;
+  double final_temp = 0.001;
+};
+
+// The outcome of a population annealing run.
+struct PopulationResult {
+  Permutation best_state;
+  double best_log_prob;
+  // The number of chains replaced over the whole run.
+  int respawned;
+};
+
+/**
+ * @brief Runs a population of annealing chains on a thread pool and, after
+ * every round, replaces the worst chains with perturbed copies of the best
+ * ones, in the style of successive halving. The temperature follows one
+ * exponential schedule over the whole budget, so a respawned copy continues
+ * at the temperature its parent reached. Each chain keeps its own
+ * generator, and a round's tasks only touch their own chain, so a run is
+ * reproducible however the pool schedules them.
+ * @param initial_states One starting permutation per chain.
+ * @param rngs One random number generator per chain.
+ * @param iters The number of iterations each chain runs over all rounds.
+ * @param symbols The symbols a perturbation may swap.
+ * @param options The population, round and culling settings.
+ * @param pool The pool the chains run on.
+ * @param board If given, chains publish to it and the run ends after the
+ * round in which it says to stop.
+ * @param telemetry If given, one chain per population member; each reports
+ * its samples over the whole run and a final sample once the run ends.
+ * @param progress If given, a summary line is written after every round.
+ * @return The best state of the final population.
+ */
+template <typename Proposal, typename Density>
+PopulationResult population_annealing(
+    const std::vector<Permutation> &initial_states, Proposal &proposal,
+    Density &density, std::vector<Rng> &rngs, int iters,
+    const std::vector<int> &symbols, const PopulationOptions &options,
+    ThreadPool &pool, ConvergenceBoard *board = nullptr,
+    TelemetryReporter *telemetry = nullptr,
+    std::ostream *progress = nullptr) {
+  const int n = initial_states.size();
+  const int rounds = std::max(1, options.rounds);
+  std::vector<Permutation> states = initial_states;
+  std::vector<double> log_probs(n);
+  std::vector<int> order(n);
+  // Each chain's iterations count on over the rounds, as the board and the
+  // telemetry expect. The run may end early on the board's word, so the
+  // final samples are recorded here once it has ended.
+  std::vector<ChainProgress> chain_progress(n);
+  for (ChainProgress &p : chain_progress) {
+    p.last = false;
+  }
+  const int n_cull =
+      std::min(n - 1, static_cast<int>(options.cull_fraction * n));
+
+  // The temperature after a fraction x of the budget.
+  auto temperature_at = [&](double x) {
+    return options.initial_temp *
+           std::pow(options.final_temp / options.initial_temp, x);
+  };
+
+  PopulationResult result;
+  result.respawned = 0;
+  double final_temp = options.initial_temp;
+  for (int round = 0; round < rounds; ++round) {
+    const int begin = static_cast<long long>(iters) * round / rounds;
+    const int end = static_cast<long long>(iters) * (round + 1) / rounds;
+    const double t_begin = temperature_at(double(round) / rounds);
+    const double t_end = temperature_at(double(round + 1) / rounds);
+    for (int i = 0; i < n; ++i) {
+      pool.submit([&, i]() {
+        ExponentialCooling schedule(t_begin, t_end, end - begin);
+        ChainTelemetry *chain_telemetry =
+            telemetry != nullptr ? &telemetry->chain(i) : nullptr;
+        states[i] = metropolis_hastings_annealing(
+            states[i], proposal, density, schedule, rngs[i], end - begin,
+            chain_telemetry, board, i, nullptr, nullptr, &chain_progress[i]);
+        log_probs[i] = density.score(states[i]);
+      });
+    }
+    pool.wait();
+    final_temp = t_end;
+
+    for (int i = 0; i < n; ++i) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(),
+              [&](int x, int y) { return log_probs[x] > log_probs[y]; });
+    if (progress != nullptr) {
+      // One write per line, so it does not interleave with telemetry lines
+      // sharing the stream.
+      std::ostringstream line;
+      line << "Round " << round + 1 << "/" << rounds << " (Temp: " << t_end
+           << "): best log prob " << log_probs[order[0]] << ", median "
+           << log_probs[order[n / 2]] << ", worst " << log_probs[order[n - 1]]
+           << "\n";
+      *progress << line.str() << std::flush;
+    }
+    if (round + 1 == rounds || (board != nullptr && board->stopped())) {
+      break;
+    }
+
+    // Replace the worst chains with copies of the survivors, best first,
+    // each shaken by a few swaps drawn from the replaced chain's generator.
+    const int survivors = n - n_cull;
+    for (int k = 0; k < n_cull; ++k) {
+      const int victim = order[n - 1 - k];
+      const int parent = order[k % survivors];
+      states[victim] = states[parent];
+      for (int s = 0; s < options.perturb_swaps; ++s) {
+        Rng &rng = rngs[victim];
+        states[victim].swap(symbols[rng.uniform_int(symbols.size())],
+                            symbols[rng.uniform_int(symbols.size())]);
+      }
+      log_probs[victim] = density.score(states[victim]);
+    }
+    result.respawned += n_cull;
+  }
+
+  if (telemetry != nullptr) {
+    for (int i = 0; i < n; ++i) {
+      telemetry->chain(i).record(
+          chain_progress[i].iteration, chain_progress[i].accepts, final_temp,
+          log_probs[i], std::max(log_probs[i], chain_progress[i].best_log_prob),
+          states[i], true);
+    }
+  }
+
+  result.best_state = states[order[0]];
+  result.best_log_prob = log_probs[order[0]];
+  return result;
+}
+
+#endif  // POPULATION_ANNEALING_HPP
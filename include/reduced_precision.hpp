@@ -0,0 +1,105 @@
+#ifndef REDUCED_PRECISION_HPP
+#define REDUCED_PRECISION_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "language_model.hpp"
+#include "matrix.hpp"
+#include "permutation.hpp"
+#include "sparse_bigrams.hpp"
+
+// The number type the bigram scoring tables are kept in.
+enum class ScorePrecision { kDouble, kFloat, kInt16 };
+
+// Parses "double", "float" or "int16"; returns false for anything else.
+bool parse_score_precision(const std::string &name, ScorePrecision &precision);
+
+const char *score_precision_name(ScorePrecision precision);
+
+/**
+ * @brief The largest scale at which a model's log probabilities can be
+ * stored as int16 and a text of total_count bigrams can be scored in int32
+ * without overflow. A swap delta touches each count at most a few times, so
+ * bounding eight times the full score keeps every delta in range too. Short
+ * texts get the full int16 resolution; long ones trade some of it away.
+ * @param model The bigram model to quantize.
+ * @param total_count The number of bigrams in the text to be scored.
+ */
+double int16_log_scale(const LanguageModel &model, long long total_count);
+
+/**
+ * @brief A copy of a bigram model's log tables at reduced precision, with
+ * the same accessors as LanguageModel so the swap kernels can read either.
+ * Each value is the log probability times scale(), rounded for integer
+ * types. Sums run in Accumulator, int32 for integer tables, and are turned
+ * back into log probabilities by multiplying with inverse_scale(). A float
+ * table is half and an int16 table a quarter of the double one, so more of
+ * it stays in cache. A double table at scale 1 is an exact private copy,
+ * which a thread can allocate on its own NUMA node.
+ * @tparam T double, float or int16_t.
+ */
+template <typename T>
+class ReducedLogTable {
+ public:
+  using Accumulator =
+      typename std::conditional<std::is_integral<T>::value, int32_t, T>::type;
+
+  ReducedLogTable() : scale_(1.0) {}
+
+  ReducedLogTable(const LanguageModel &model, double scale)
+      : log_transition_(model.size(), model.size()),
+        log_frequency_(model.size()),
+        scale_(scale) {
+    for (int i = 0; i < model.size(); ++i) {
+      log_frequency_[i] = convert(model.log_frequency(i));
+      for (int j = 0; j < model.size(); ++j) {
+        log_transition_(i, j) = convert(model.log_transition(i, j));
+      }
+    }
+  }
+
+  const T *log_transition_row(int i) const {
+    return log_transition_.row(i).data();
+  }
+  T log_frequency(int i) const { return log_frequency_[i]; }
+  bool empty() const { return log_frequency_.empty(); }
+  double scale() const { return scale_; }
+  double inverse_scale() const { return 1.0 / scale_; }
+
+ private:
+  T convert(double log_prob) const {
+    return std::is_integral<T>::value
+               ? static_cast<T>(std::lround(log_prob * scale_))
+               : static_cast<T>(log_prob * scale_);
+  }
+
+  Matrix<T> log_transition_;
+  std::vector<T> log_frequency_;
+  double scale_;
+};
+
+/**
+ * @brief compute_log_probability_by_sparse_counts over a reduced table,
+ * summed in the table's accumulator type.
+ */
+template <typename T>
+double compute_log_probability_by_table(
+    const SparseBigramCounts &sparse_counts, int first_ix,
+    const Permutation &permutation, const ReducedLogTable<T> &table) {
+  using Accumulator = typename ReducedLogTable<T>::Accumulator;
+  Accumulator log_prob =
+      first_ix < 0 ? 0 : table.log_frequency(permutation[first_ix]);
+  for (size_t k = 0; k < sparse_counts.size; ++k) {
+    const T *log_row =
+        table.log_transition_row(permutation[sparse_counts.rows[k]]);
+    log_prob += static_cast<Accumulator>(sparse_counts.counts[k]) *
+                log_row[permutation[sparse_counts.cols[k]]];
+  }
+  return log_prob * table.inverse_scale();
+}
+
+#endif  // REDUCED_PRECISION_HPP
@@ -0,0 +1,112 @@
+#ifndef RNG_HPP
+#define RNG_HPP
+
+#include <array>
+#include <cstdint>
+#include <limits>
+
+/**
+ * @brief A small, fast xoshiro256** generator. Each MCMC chain owns one, so
+ * drawing a number never touches shared state or the operating system, and a
+ * fixed seed makes a run bit-reproducible.
+ */
+class Rng {
+ public:
+  using result_type = uint64_t;
+
+  /**
+   * @brief Seeds the generator by expanding `seed` with splitmix64.
+   */
+  explicit Rng(uint64_t seed = 0) {
+    for (uint64_t &word : state_) {
+      seed += 0x9e3779b97f4a7c15ULL;
+      uint64_t z = seed;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      word = z ^ (z >> 31);
+    }
+  }
+
+  /**
+   * @brief Returns the generator for stream `index` of `seed`. Streams are
+   * 2^128 draws apart, so chains seeded this way never overlap.
+   */
+  static Rng stream(uint64_t seed, int index) {
+    Rng rng(seed);
+    for (int i = 0; i < index; ++i) {
+      rng.jump();
+    }
+    return rng;
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() {
+    return std::numeric_limits<result_type>::max();
+  }
+
+  result_type operator()() {
+    const uint64_t result = rotl(state_[1] * 5, 7) * 9;
+    const uint64_t t = state_[1] << 17;
+    state_[2] ^= state_[0];
+    state_[3] ^= state_[1];
+    state_[1] ^= state_[2];
+    state_[0] ^= state_[3];
+    state_[2] ^= t;
+    state_[3] = rotl(state_[3], 45);
+    return result;
+  }
+
+  /**
+   * @brief Returns an unbiased integer in [0, n) using Lemire's
+   * multiply-and-reject method.
+   */
+  uint32_t uniform_int(uint32_t n) {
+    uint64_t m = ((*this)() >> 32) * n;
+    uint32_t low = static_cast<uint32_t>(m);
+    if (low < n) {
+      const uint32_t threshold = -n % n;
+      while (low < threshold) {
+        m = ((*this)() >> 32) * n;
+        low = static_cast<uint32_t>(m);
+      }
+    }
+    return static_cast<uint32_t>(m >> 32);
+  }
+
+  // The generator's internal state, for checkpoints. Restoring it with
+  // set_state() continues the exact same sequence of draws.
+  const std::array<uint64_t, 4> &state() const { return state_; }
+  void set_state(const std::array<uint64_t, 4> &state) { state_ = state; }
+
+  // Returns a double in [0, 1) with 53 random bits.
+  double uniform_real() { return ((*this)() >> 11) * 0x1.0p-53; }
+
+  /**
+   * @brief Advances the generator by 2^128 draws.
+   */
+  void jump() {
+    static const uint64_t kJump[] = {0x180ec6d33cfd0abaULL,
+                                     0xd5a61266f0c9392cULL,
+                                     0xa9582618e03fc9aaULL,
+                                     0x39abdc4529b1661cULL};
+    std::array<uint64_t, 4> jumped = {0, 0, 0, 0};
+    for (uint64_t word : kJump) {
+      for (int bit = 0; bit < 64; ++bit) {
+        if (word & (uint64_t{1} << bit)) {
+          for (int i = 0; i < 4; ++i) {
+            jumped[i] ^= state_[i];
+          }
+        }
+        (*this)();
+      }
+    }
+    state_ = jumped;
+  }
+
+ private:
+  static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+  std::array<uint64_t, 4> state_;
+};
+
+#endif  // RNG_HPP
@@ -0,0 +1,164 @@
+#ifndef SOLVER_HPP
+#define SOLVER_HPP
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "checkpoint.hpp"
+#include "convergence.hpp"
+#include "deciphering_utils.hpp"
+#include "language_model.hpp"
+#include "lexicon.hpp"
+#include "metropolis_hastings.hpp"
+#include "permutation.hpp"
+#include "reduced_precision.hpp"
+#include "rng.hpp"
+#include "telemetry.hpp"
+#include "thread_pool.hpp"
+
+// The settings of one Solver::decode call.
+struct DecodeOptions {
+  // The annealing budget of each chain.
+  int iters = 500000;
+  // Independent annealing chains; the best one is kept.
+  int chains = 2;
+  // Chain c draws from Rng::stream(seed, c), so a call is reproducible.
+  uint64_t seed = 0;
+  // Polish the best key by steepest descent.
+  bool polish = true;
+  // The number type of the bigram tables the chains score with.
+  ScorePrecision precision = ScorePrecision::kDouble;
+  // The cooling schedule of every chain.
+  ScheduleOptions schedule;
+};
+
+// What one Solver::decode call did.
+struct DecodeStats {
+  int chains = 0;
+  // Annealing iterations over all chains.
+  long long iterations = 0;
+  int polish_swaps = 0;
+  // Wall-clock time of the call.
+  double seconds = 0;
+};
+
+// The outcome of one Solver::decode call.
+struct DecodeResult {
+  // chars[i] of the ciphertext decodes to chars[key[i]].
+  Permutation key;
+  std::string plaintext;
+  // The log likelihood of the plaintext, in double.
+  double log_prob = 0;
+  DecodeStats stats;
+};
+
+// What one chain of a decode reports to, continues from and ends with,
+// beyond the density it anneals on. Every member may be left null.
+struct ChainHooks {
+  ChainTelemetry *telemetry = nullptr;
+  // If the board has a time limit, the chain cools over that time rather
+  // than over its iterations, and runs until the board stops it.
+  ConvergenceBoard *board = nullptr;
+  CheckpointWriter *checkpoints = nullptr;
+  const ChainCheckpoint *resume = nullptr;
+  const LexiconStage *lexicon = nullptr;
+};
+
+/**
+ * @brief Draws the starting key of chain `chain` of a decode from the
+ * chain's stream of seed, leaving rng where the chain goes on drawing.
+ */
+Permutation chain_start(const std::vector<char> &chars, uint64_t seed,
+                        int chain, Rng &rng);
+
+/**
+ * @brief Runs chain `chain` of a decode: anneals its starting key on
+ * density under options.schedule for options.iters iterations. Solver,
+ * batch mode and run_deciphering all run their chains through here.
+ * @param chars The model alphabet.
+ * @param symbols The symbols whose images the chain swaps.
+ * @param options The seed, budget and schedule of the decode; the other
+ * settings are the caller's.
+ * @param key Receives the chain's final key.
+ * @return The log likelihood of the key under density, plus the weighted
+ * word score if the chain ended with a lexicon stage.
+ */
+double anneal_chain(const NgramDensity &density,
+                    const std::vector<char> &chars,
+                    const std::vector<int> &symbols,
+                    const DecodeOptions &options, int chain,
+                    const ChainHooks &hooks, Permutation &key);
+
+/**
+ * @brief Returns the density a decode judges and polishes its best key
+ * with. Reduced tables only steer the search, so unless density scores in
+ * double, a double density of text is built in exact, or recounted if
+ * exact already holds one.
+ */
+const NgramDensity &exact_density(const NgramDensity &density,
+                                  const std::string &text,
+                                  const LanguageModel &model,
+                                  std::unique_ptr<NgramDensity> &exact);
+
+/**
+ * @brief A decoder for embedding in a long-running service: it owns a
+ * language model and a thread pool, so a call pays neither process
+ * start-up nor training. decode() may be called from several threads at
+ * once; the chains of all calls share the pool. Each call borrows a
+ * session holding the text counts, scoring tables, chain slots and polish
+ * buffers of an earlier call and recounts the new text into them, so with
+ * a bigram model a solver under steady load stops allocating scoring
+ * buffers. Higher-order models still rebuild their n-gram count table for
+ * every text.
+ */
+class Solver {
+ public:
+  /**
+   * @param model The model to decode with; the solver keeps it.
+   * @param n_threads The number of workers in the solver's pool.
+   */
+  Solver(LanguageModel model, int n_threads);
+  ~Solver();
+
+  // Sessions refer to the model, so a solver stays where it was built.
+  Solver(const Solver &) = delete;
+  Solver &operator=(const Solver &) = delete;
+
+  const LanguageModel &model() const { return model_; }
+  int n_threads() const { return pool_.size(); }
+
+  /**
+   * @brief Anneals options.chains chains on the ciphertext, keeps the best
+   * key, polishes it and translates the ciphertext with it. Blocks until
+   * done; must not be called from a task running on a ThreadPool.
+   * @param ciphertext The text to decode.
+   * @param options The budget and scoring settings of this call.
+   * @param result Receives the key, plaintext, score and stats. Its
+   * plaintext buffer is reused, so passing the same result again avoids
+   * reallocating it.
+   * @return False, after reporting the error, if the options are invalid
+   * or a chain failed, for instance because memory ran out.
+   */
+  bool decode(const std::string &ciphertext, const DecodeOptions &options,
+              DecodeResult &result);
+
+ private:
+  struct Session;
+
+  // Takes an idle session scoring at the given precision, or builds one.
+  std::unique_ptr<Session> acquire_session(ScorePrecision precision);
+  void release_session(std::unique_ptr<Session> session);
+
+  LanguageModel model_;
+  // The letters of the alphabet, which the chains permute.
+  std::vector<int> symbols_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Session> > idle_sessions_;
+  // Last, so the workers are joined before the rest is destroyed.
+  ThreadPool pool_;
+};
+
+#endif  // SOLVER_HPP
@@ -0,0 +1,76 @@
+#ifndef SPARSE_BIGRAMS_HPP
+#define SPARSE_BIGRAMS_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "language_model.hpp"
+#include "matrix.hpp"
+#include "permutation.hpp"
+
+// The instruction sets the sparse scoring kernel can use, in rising order.
+enum class SimdLevel { kScalar, kAvx2, kAvx512 };
+
+/**
+ * @brief The non-zero cells of a text's bigram counts as a list of
+ * (row, column, count) entries in row-major order. A short message fills
+ * only a few hundred of the N^2 cells, so a full rescore walks this list
+ * instead of the dense matrix. The list is padded with zero-count (0, 0)
+ * entries to a multiple of kSparseBigramPadding, so vector kernels need no
+ * remainder loop; padding adds exactly zero to a score.
+ */
+struct SparseBigramCounts {
+  std::vector<int32_t> rows;
+  std::vector<int32_t> cols;
+  std::vector<double> counts;
+  // The number of entries before the padding.
+  size_t size = 0;
+};
+
+// The widest kernel handles this many entries per step.
+constexpr size_t kSparseBigramPadding = 8;
+
+/**
+ * @brief Extracts the non-zero cells of a dense bigram count matrix.
+ * @param counts The bigram counts, as returned by compute_transition_counts.
+ * @return The cells with a positive count, in row-major order.
+ */
+SparseBigramCounts compute_sparse_bigram_counts(const Matrix<int> &counts);
+
+/**
+ * @brief Same as compute_sparse_bigram_counts, but refills an existing list
+ * in place; once its vectors have grown, refilling allocates nothing.
+ */
+void fill_sparse_bigram_counts(const Matrix<int> &counts,
+                               SparseBigramCounts &sparse_counts);
+
+/**
+ * @brief Returns the best kernel this CPU supports. The answer is computed
+ * once and cached.
+ */
+SimdLevel detect_simd_level();
+
+// The name of a level: "scalar", "avx2" or "avx512".
+const char *simd_level_name(SimdLevel level);
+
+/**
+ * @brief Computes the same log likelihood as compute_log_probability_by_counts
+ * from a sparse bigram list. The AVX2 and AVX-512 kernels gather the
+ * permuted indices and model entries and accumulate with FMA; they sum in a
+ * different order, so they agree with the dense function to rounding only.
+ * The scalar kernel visits the cells in the same order and gives the same
+ * bits.
+ * @param sparse_counts The sparse bigram counts of the text.
+ * @param first_ix The index of the first character of the text, or -1.
+ * @param permutation The permutation being tested.
+ * @param model The language model.
+ * @param level The kernel to use; levels the CPU lacks fall back to the
+ * best one it has.
+ * @return The log likelihood of the text under the given permutation.
+ */
+double compute_log_probability_by_sparse_counts(
+    const SparseBigramCounts &sparse_counts, int first_ix,
+    const Permutation &permutation, const LanguageModel &model,
+    SimdLevel level = detect_simd_level());
+
+#endif  // SPARSE_BIGRAMS_HPP
@@ -0,0 +1,66 @@
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+/**
+ * @brief A bounded lock-free queue for exactly one producer thread and one
+ * consumer thread. The two indices live on separate cache lines, and each
+ * side keeps a cached copy of the other's index so it only touches the
+ * shared line when the ring looks full or empty.
+ * @tparam T The element type; it is copied in and out.
+ * @tparam Capacity The number of slots, a power of two.
+ */
+template <typename T, size_t Capacity>
+class SpscRing {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "SpscRing capacity must be a power of two");
+
+ public:
+  /**
+   * @brief Appends a copy of value. Producer thread only.
+   * @return False, leaving the ring unchanged, if it is full.
+   */
+  bool try_push(const T &value) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_cache_ == Capacity) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head - tail_cache_ == Capacity) {
+        return false;
+      }
+    }
+    slots_[head & (Capacity - 1)] = value;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Removes the oldest element into value. Consumer thread only.
+   * @return False if the ring is empty.
+   */
+  bool try_pop(T &value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_cache_) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail == head_cache_) {
+        return false;
+      }
+    }
+    value = slots_[tail & (Capacity - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  // Written by the producer.
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t tail_cache_ = 0;
+  // Written by the consumer.
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t head_cache_ = 0;
+  alignas(64) std::array<T, Capacity> slots_;
+};
+
+#endif  // SPSC_RING_HPP
@@ -0,0 +1,125 @@
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "permutation.hpp"
+#include "spsc_ring.hpp"
+
+// How the reporter writes samples.
+enum class TelemetryFormat { kText, kJson };
+
+struct TelemetryOptions {
+  TelemetryFormat format = TelemetryFormat::kText;
+  // Iterations between two samples of a chain; 0 reports final samples only.
+  int sample_every = 99000;
+  // How long the reporter sleeps when every ring is empty.
+  int poll_ms = 20;
+};
+
+// A snapshot of one chain's counters.
+struct TelemetrySample {
+  long long iteration;
+  long long accepts;
+  double temperature;
+  double log_prob;
+  double best_log_prob;
+  double iters_per_sec;
+  bool final;
+  Permutation state;
+};
+
+/**
+ * @brief The producer side of one chain's telemetry. The chain's thread
+ * records a sample every sample_every() iterations and a final one when it
+ * finishes; recording computes the rate since the previous sample (or since
+ * the start, for the final one) and pushes the snapshot into a ring that the
+ * reporter drains. If the ring is full the sample is dropped and counted
+ * rather than blocking the chain.
+ */
+class alignas(64) ChainTelemetry {
+ public:
+  ChainTelemetry();
+
+  int sample_every() const { return sample_every_; }
+
+  // Measures rates from now and from this iteration on, so a chain that
+  // waited for a thread or resumed from a checkpoint reports its own pace.
+  // Chain thread only, before the first record().
+  void start(long long iteration);
+
+  void record(long long iteration, long long accepts, double temperature,
+              double log_prob, double best_log_prob, const Permutation &state,
+              bool final = false);
+
+ private:
+  friend class TelemetryReporter;
+
+  int sample_every_;
+  std::chrono::steady_clock::time_point start_time_;
+  std::chrono::steady_clock::time_point last_time_;
+  long long start_iteration_;
+  long long last_iteration_;
+  std::atomic<long long> dropped_;
+  SpscRing<TelemetrySample, 64> ring_;
+};
+
+/**
+ * @brief Collects telemetry from a fixed set of chains on one background
+ * thread, so the chains never write to a stream themselves. Samples are
+ * written as text lines or as JSON lines, one per sample, with a preview of
+ * the text decoded by the sampled key.
+ */
+class TelemetryReporter {
+ public:
+  /**
+   * @param n_chains The number of chains that will report.
+   * @param options The output format and sampling interval.
+   * @param chars The alphabet the chains' permutations are defined over.
+   * @param text The text being decoded; its start is shown in each sample.
+   * @param out The stream to write to; it must outlive the reporter.
+   */
+  TelemetryReporter(int n_chains, const TelemetryOptions &options,
+                    const std::vector<char> &chars, const std::string &text,
+                    std::ostream &out = std::cout);
+
+  // Stops the reporter if stop() was not called.
+  ~TelemetryReporter();
+
+  TelemetryReporter(const TelemetryReporter &) = delete;
+  TelemetryReporter &operator=(const TelemetryReporter &) = delete;
+
+  int size() const { return n_chains_; }
+  ChainTelemetry &chain(int index) { return chains_[index]; }
+
+  // Writes every pending sample and joins the reporter thread.
+  void stop();
+
+ private:
+  void run();
+  bool drain();
+  void write(int chain, const TelemetrySample &sample);
+
+  const int n_chains_;
+  const TelemetryOptions options_;
+  const std::vector<char> chars_;
+  const std::string preview_;
+  std::ostream &out_;
+  std::unique_ptr<ChainTelemetry[]> chains_;
+  std::atomic<bool> stopping_;
+  std::thread thread_;
+};
+
+/**
+ * @brief Parses a telemetry format name, "text" or "json".
+ * @return True if the name was recognised.
+ */
+bool parse_telemetry_format(const std::string &name, TelemetryFormat &format);
+
+#endif  // TELEMETRY_HPP
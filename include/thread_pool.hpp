@@ -0,0 +1,73 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief A fixed set of worker threads with one task queue each. Tasks
+ * submitted from outside the pool are dealt round-robin over the queues,
+ * and a task submitted by a running task goes to its own worker's queue.
+ * A worker takes its own tasks oldest first and, when it runs dry, steals
+ * the newest task of another worker, so uneven tasks still keep every
+ * worker busy. Tasks from different callers share the same workers, so a
+ * process never runs more busy threads than the pool holds.
+ */
+class ThreadPool {
+ public:
+  /**
+   * @param n_threads The number of workers.
+   * @param cpus If not empty, worker i is pinned to cpus[i % cpus.size()].
+   */
+  explicit ThreadPool(int n_threads, const std::vector<int> &cpus = {});
+
+  // Finishes every submitted task before joining the workers.
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  int size() const { return threads_.size(); }
+
+  // The index of the pool worker running the calling thread, or -1 if the
+  // caller is not a worker of any pool.
+  static int current_worker();
+
+  // Tasks run without a handler, so a task must catch its own exceptions;
+  // one that escapes ends the process.
+  void submit(std::function<void()> task);
+
+  // Blocks until every task submitted so far has finished. Must not be
+  // called from inside a task.
+  void wait();
+
+ private:
+  struct alignas(64) Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()> > tasks;
+  };
+
+  void worker(int index);
+  bool take(int index, std::function<void()> &task);
+
+  std::vector<std::thread> threads_;
+  std::unique_ptr<Queue[]> queues_;
+  std::atomic<unsigned> next_queue_;
+  // Guards the counters below and backs the two condition variables.
+  std::mutex mutex_;
+  std::condition_variable task_ready_;
+  std::condition_variable all_done_;
+  // Tasks submitted but not yet taken by a worker.
+  int queued_;
+  // Tasks submitted but not yet finished.
+  int pending_;
+  bool stopping_;
+};
+
+#endif  // THREAD_POOL_HPP
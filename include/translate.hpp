@@ -0,0 +1,68 @@
+#ifndef TRANSLATE_HPP
+#define TRANSLATE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "permutation.hpp"
+#include "sparse_bigrams.hpp"
+
+// The size of the buffer a file is translated through; memory use does not
+// grow with the file.
+constexpr size_t kTranslateChunkSize = 1 << 20;
+
+/**
+ * @brief Translates bytes through a 256-entry table built from a key. With
+ * AVX2 the table is applied 32 bytes at a time as byte shuffles, one per
+ * 16-entry block of the table that the key actually changes, so a key over
+ * the letters costs four shuffles per 32 bytes.
+ */
+class ByteTranslator {
+ public:
+  /**
+   * @param permutation The key; chars[i] becomes chars[permutation[i]].
+   * @param chars The alphabet the key is defined over.
+   * @param join_lines Translate newlines as spaces and drop a final newline,
+   * as read_file does, so a streamed file matches the in-memory path byte
+   * for byte.
+   */
+  ByteTranslator(const Permutation &permutation,
+                 const std::vector<char> &chars, bool join_lines = false);
+
+  bool join_lines() const { return join_lines_; }
+  char translate_byte(char c) const {
+    return table_[static_cast<unsigned char>(c)];
+  }
+
+  /**
+   * @brief Translates n bytes from in to out; in and out may be the same
+   * buffer.
+   */
+  void translate(const char *in, char *out, size_t n,
+                 SimdLevel level = detect_simd_level()) const;
+
+  std::string translate(const std::string &text) const;
+
+ private:
+  uint8_t table_[256];
+  // The high nibbles of the 16-entry blocks that are not the identity.
+  std::vector<uint8_t> changed_blocks_;
+  bool join_lines_;
+};
+
+/**
+ * @brief Translates a file into another in kTranslateChunkSize chunks with
+ * large unbuffered writes, so multi-gigabyte files need constant memory.
+ * @param translator The table to apply.
+ * @param input_file The file to read, or "-" for stdin.
+ * @param output_file The file to write, or "-" for stdout.
+ * @return False, after reporting the error, if a file could not be opened,
+ * read or written.
+ */
+bool translate_file(const ByteTranslator &translator,
+                    const std::string &input_file,
+                    const std::string &output_file);
+
+#endif  // TRANSLATE_HPP
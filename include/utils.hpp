@@ -5,31 +5,79 @@
 #include <string>
 #include <vector>
 
+#include "matrix.hpp"
+#include "permutation.hpp"
+#include "rng.hpp"
+
 // Function declarations
 std::vector<char> az_list();
-std::map<char, char> generate_random_permutation_map(
-    const std::vector<char> &chars);
-std::map<char, char> generate_identity_p_map(const std::vector<char> &chars);
+Permutation generate_random_permutation(const std::vector<char> &chars,
+                                        Rng &rng);
+Permutation generate_identity_permutation(const std::vector<char> &chars);
 std::vector<char> get_chars_from_text(const std::string &text);
 std::map<char, int> get_char_to_ix(const std::vector<char> &chars);
+
+/**
+ * @brief Looks up the indices of a set of symbols in the alphabet, skipping
+ * any symbol the alphabet does not contain.
+ * @param symbols The symbols to look up, e.g. az_list().
+ * @param char_to_ix A map from characters to their integer index.
+ * @return The indices of the symbols that are present in the alphabet.
+ */
+std::vector<int> get_symbol_indices(const std::vector<char> &symbols,
+                                    const std::map<char, int> &char_to_ix);
+
 std::vector<double> get_frequency_statistics(
     const std::string &text, const std::vector<char> &chars,
     const std::map<char, int> &char_to_ix);
-std::vector<std::vector<double> > get_transition_matrix(
+DoubleMatrix get_transition_matrix(
     const std::string &text, const std::vector<char> &chars,
     const std::map<char, int> &char_to_ix);
 std::string apply_permutation(const std::string &text,
-                              const std::map<char, char> &permutation_map);
+                              const Permutation &permutation,
+                              const std::vector<char> &chars);
 void read_file(const std::string &filename, std::string &text);
 
-void print_permutation_map(const std::map<char, char> &p_map);
+/**
+ * @brief Converts a permutation map into a dense permutation. Pairs whose
+ * characters are not in the alphabet are ignored.
+ * @param p_map The permutation map to convert.
+ * @param char_to_ix A map from characters to their integer index.
+ * @return The equivalent permutation over the alphabet.
+ */
+Permutation get_permutation_from_map(const std::map<char, char> &p_map,
+                                     const std::map<char, int> &char_to_ix);
+
+/**
+ * @brief Converts a dense permutation back into a permutation map.
+ * @param permutation The permutation to convert.
+ * @param chars The alphabet the permutation is defined over.
+ * @return A map from each character to the character it is mapped to.
+ */
+std::map<char, char> get_map_from_permutation(const Permutation &permutation,
+                                              const std::vector<char> &chars);
+
+void print_permutation_map(const Permutation &permutation,
+                           const std::vector<char> &chars);
 
 /**
- * @brief Saves a permutation map (cipher key) to a file.
- * * @param p_map The permutation map to save.
+ * @brief Saves a permutation (cipher key) to a file.
+ * * @param permutation The permutation to save.
+ * @param chars The alphabet the permutation is defined over.
  * @param filename The name of the file to save the key to.
  */
-void save_permutation_map(const std::map<char, char> &p_map,
+void save_permutation_map(const Permutation &permutation,
+                          const std::vector<char> &chars,
                           const std::string &filename);
 
-#endif  // UTILS_HPP
\ No newline at end of file
+/**
+ * @brief Loads a permutation (cipher key) written by save_permutation_map.
+ * @param filename The name of the file to load the key from.
+ * @param char_to_ix A map from characters to their integer index.
+ * @return The permutation read from the file, or the identity if the file
+ * could not be opened.
+ */
+Permutation load_permutation_map(const std::string &filename,
+                                 const std::map<char, int> &char_to_ix);
+
+#endif  // UTILS_HPP
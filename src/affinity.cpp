@@ -0,0 +1,71 @@
+#include "affinity.hpp"
+
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+std::vector<int> available_cpus() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &mask)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  if (cpus.empty()) {
+    const int n = std::max(1u, std::thread::hardware_concurrency());
+    for (int cpu = 0; cpu < n; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+int cpu_numa_node(int cpu) {
+#ifdef __linux__
+  // The CPU's sysfs directory holds a nodeN link for its node.
+  const std::string path =
+      "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR *dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return 0;
+  }
+  int node = 0;
+  while (dirent *entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+        name.find_first_not_of("0123456789", 4) == std::string::npos) {
+      node = std::stoi(name.substr(4));
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+#else
+  (void)cpu;
+  return 0;
+#endif
+}
+
+bool pin_current_thread(int cpu) {
+#ifdef __linux__
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  CPU_SET(cpu, &mask);
+  return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
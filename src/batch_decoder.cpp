@@ -0,0 +1,278 @@
+#include "batch_decoder.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "deciphering_utils.hpp"
+#include "metropolis_hastings.hpp"
+#include "solver.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// The state shared by the chains decoding one ciphertext.
+struct BatchJob {
+  std::string name;
+  std::string text;
+  // Holds the text's counts at the model's order; shared by the chains.
+  std::unique_ptr<NgramDensity> density;
+  uint64_t seed;
+  std::mutex mutex;
+  Permutation best_permutation;
+  double best_log_prob = -std::numeric_limits<double>::infinity();
+  int chains_remaining;
+  // The first error a chain threw, if any; a task must not let it escape
+  // into the pool.
+  bool failed = false;
+  std::string error;
+};
+
+/**
+ * @brief Bounds the number of jobs held in memory, so reading a large
+ * source waits for earlier jobs to finish instead of loading everything.
+ */
+class JobSlots {
+ public:
+  explicit JobSlots(int count) : free_(count) {}
+
+  void acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    released_.wait(lock, [this]() { return free_ > 0; });
+    --free_;
+  }
+
+  void release() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++free_;
+    }
+    released_.notify_one();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable released_;
+  int free_;
+};
+
+void write_job_result(const BatchJob &job, const LanguageModel &model,
+                      const std::string &output_dir) {
+  const std::string base = (fs::path(output_dir) / job.name).string();
+  std::ofstream out_f(base + ".decoded.txt");
+  if (!out_f.is_open()) {
+    std::cerr << "Error: Could not open file to save output: " << base
+              << ".decoded.txt" << std::endl;
+  } else {
+    out_f << apply_permutation(job.text, job.best_permutation, model.chars());
+    out_f.close();
+  }
+  save_permutation_map(job.best_permutation, model.chars(), base + ".key");
+
+  std::ostringstream line;
+  line << "Decoded " << job.name << " (log prob: " << job.best_log_prob
+       << ")\n";
+  std::cout << line.str() << std::flush;
+}
+
+/**
+ * @brief Lists the ciphertext files of a directory or manifest source.
+ */
+bool get_batch_paths(const std::string &source,
+                     std::vector<std::string> &paths) {
+  std::error_code ec;
+  if (fs::is_directory(source, ec)) {
+    for (const auto &entry : fs::directory_iterator(source, ec)) {
+      if (entry.is_regular_file()) {
+        paths.push_back(entry.path().string());
+      }
+    }
+    std::sort(paths.begin(), paths.end());
+    return !ec;
+  }
+  std::ifstream manifest(source);
+  if (!manifest.is_open()) {
+    std::cerr << "Unable to open batch source " << source << std::endl;
+    return false;
+  }
+  std::string line;
+  while (std::getline(manifest, line)) {
+    if (!line.empty()) {
+      paths.push_back(line);
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Checks that no two ciphertext files share a job name, the file
+ * name without its extension, since their results would overwrite each
+ * other.
+ * @return False, after reporting the clash, if two paths share a name.
+ */
+bool check_job_names(const std::vector<std::string> &paths) {
+  std::map<std::string, std::string> seen;
+  for (const std::string &path : paths) {
+    const std::string name = fs::path(path).stem().string();
+    const auto inserted = seen.emplace(name, path);
+    if (!inserted.second) {
+      std::cerr << "Batch files " << inserted.first->second << " and " << path
+                << " would both write results named " << name
+                << "; rename one of them." << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int decode_batch(const LanguageModel &model, const BatchOptions &options) {
+  const bool from_stdin = options.source == "-";
+  std::vector<std::string> paths;
+  if (!from_stdin && (!get_batch_paths(options.source, paths) ||
+                      !check_job_names(paths))) {
+    return -1;
+  }
+  std::error_code ec;
+  fs::create_directories(options.output_dir, ec);
+
+  const std::vector<int> az_symbols =
+      get_symbol_indices(az_list(), model.char_to_ix());
+  ThreadPool pool(options.n_threads);
+  JobSlots slots(4 * pool.size());
+  const int chains = std::max(1, options.chains_per_job);
+  int n_jobs = 0;
+  std::atomic<int> n_failed(0);
+
+  auto start = std::chrono::steady_clock::now();
+
+  auto submit_job = [&](const std::string &name, std::string text) {
+    slots.acquire();
+    auto job = std::make_shared<BatchJob>();
+    job->name = name;
+    job->text = std::move(text);
+    job->density.reset(
+        new NgramDensity(job->text, model, options.precision));
+    // Jobs get unrelated seeds; their chains get non-overlapping streams.
+    job->seed = Rng(options.seed + n_jobs)();
+    job->best_permutation = Permutation(model.size());
+    job->chains_remaining = chains;
+    ++n_jobs;
+
+    for (int c = 0; c < chains; ++c) {
+      pool.submit([&, job, c]() {
+        DecodeOptions chain_options;
+        chain_options.iters = options.iters;
+        chain_options.seed = job->seed;
+        chain_options.schedule = options.schedule;
+        const NgramDensity &density = *job->density;
+        Permutation result;
+        double log_prob = 0;
+        bool chain_failed = false;
+        std::string error;
+        try {
+          log_prob = anneal_chain(density, model.chars(), az_symbols,
+                                  chain_options, c, ChainHooks(), result);
+        } catch (const std::exception &e) {
+          chain_failed = true;
+          error = e.what();
+        } catch (...) {
+          chain_failed = true;
+          error = "unknown error";
+        }
+
+        bool last_chain;
+        {
+          std::lock_guard<std::mutex> lock(job->mutex);
+          if (chain_failed && !job->failed) {
+            job->failed = true;
+            job->error = error;
+          } else if (!chain_failed && log_prob > job->best_log_prob) {
+            job->best_log_prob = log_prob;
+            job->best_permutation = result;
+          }
+          last_chain = --job->chains_remaining == 0;
+        }
+        if (!last_chain) {
+          return;
+        }
+        // The job is finished off by its last chain whatever happened, so
+        // its slot is always released and the other jobs carry on.
+        if (!job->failed) {
+          try {
+            std::unique_ptr<NgramDensity> exact_storage;
+            const NgramDensity &exact =
+                exact_density(density, job->text, model, exact_storage);
+            if (options.polish) {
+              steepest_descent_polish(job->best_permutation, exact,
+                                      az_symbols);
+            }
+            job->best_log_prob = exact.score(job->best_permutation);
+            write_job_result(*job, model, options.output_dir);
+          } catch (const std::exception &e) {
+            job->failed = true;
+            job->error = e.what();
+          } catch (...) {
+            job->failed = true;
+            job->error = "unknown error";
+          }
+        }
+        if (job->failed) {
+          ++n_failed;
+          std::ostringstream line;
+          line << "Failed to decode " << job->name << ": " << job->error
+               << "\n";
+          std::cerr << line.str() << std::flush;
+        }
+        slots.release();
+      });
+    }
+  };
+
+  if (from_stdin) {
+    // Each line is one ciphertext; jobs start as soon as they are read.
+    std::string line;
+    for (int line_number = 1; std::getline(std::cin, line); ++line_number) {
+      if (!line.empty()) {
+        submit_job("stdin_" + std::to_string(line_number), line);
+      }
+    }
+  } else {
+    for (const std::string &path : paths) {
+      std::string text;
+      read_file(path, text);
+      if (text.empty()) {
+        std::cerr << "Skipping empty ciphertext " << path << std::endl;
+        continue;
+      }
+      submit_job(fs::path(path).stem().string(), std::move(text));
+    }
+  }
+  pool.wait();
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  const int n_decoded = n_jobs - n_failed;
+  std::cout << "Decoded " << n_decoded << " messages in " << elapsed.count()
+            << " s ("
+            << (elapsed.count() > 0 ? n_decoded / elapsed.count() : 0)
+            << " messages/sec)" << std::endl;
+  if (n_failed > 0) {
+    std::cout << n_failed << " messages failed." << std::endl;
+  }
+  return n_decoded;
+}
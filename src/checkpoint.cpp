@@ -0,0 +1,265 @@
+#include "checkpoint.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include "metropolis_hastings.hpp"
+#include "reduced_precision.hpp"
+
+namespace {
+
+// The fixed-size header at the start of a checkpoint file.
+struct CheckpointFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_chains;
+  uint64_t seed;
+  int64_t iters;
+  uint64_t text_hash;
+  uint32_t n_chars;
+  uint32_t schedule;
+  uint32_t precision;
+  uint32_t reserved;
+  double initial_temp;
+  double final_temp;
+};
+
+// One chain of a checkpoint file; the permutation is stored as its forward
+// table.
+struct ChainRecord {
+  int64_t iteration;
+  int64_t accepts;
+  double log_prob;
+  double best_log_prob;
+  double temperature;
+  uint64_t rng_state[4];
+  uint8_t forward[kMaxSymbols];
+};
+
+// The time between two polls of the chains while collecting a checkpoint.
+constexpr int kCollectPollMs = 1;
+
+}  // namespace
+
+uint64_t checkpoint_text_hash(const std::string &text,
+                              const std::vector<char> &chars) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (char c : chars) {
+    h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+  }
+  for (char c : text) {
+    h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+bool save_checkpoint(const RunCheckpoint &checkpoint,
+                     const std::string &filename) {
+  std::string image(sizeof(CheckpointFileHeader) +
+                        checkpoint.chains.size() * sizeof(ChainRecord),
+                    '\0');
+  CheckpointFileHeader header = {};
+  std::memcpy(header.magic, kCheckpointMagic, sizeof(kCheckpointMagic));
+  header.version = kCheckpointVersion;
+  header.n_chains = checkpoint.chains.size();
+  header.seed = checkpoint.seed;
+  header.iters = checkpoint.iters;
+  header.text_hash = checkpoint.text_hash;
+  header.n_chars = checkpoint.n_chars;
+  header.schedule = static_cast<uint32_t>(checkpoint.schedule);
+  header.precision = static_cast<uint32_t>(checkpoint.precision);
+  header.initial_temp = checkpoint.initial_temp;
+  header.final_temp = checkpoint.final_temp;
+  std::memcpy(&image[0], &header, sizeof(header));
+  for (size_t c = 0; c < checkpoint.chains.size(); ++c) {
+    const ChainCheckpoint &chain = checkpoint.chains[c];
+    ChainRecord record = {};
+    record.iteration = chain.iteration;
+    record.accepts = chain.accepts;
+    record.log_prob = chain.log_prob;
+    record.best_log_prob = chain.best_log_prob;
+    record.temperature = chain.temperature;
+    std::copy(chain.rng_state.begin(), chain.rng_state.end(),
+              record.rng_state);
+    for (int i = 0; i < kMaxSymbols; ++i) {
+      record.forward[i] = chain.state[i];
+    }
+    std::memcpy(&image[sizeof(header) + c * sizeof(record)], &record,
+                sizeof(record));
+  }
+
+  // Write beside the target and rename over it only once the data is on
+  // disk.
+  const std::string temp_file = filename + ".tmp";
+  int fd = open(temp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "Could not open checkpoint file: " << temp_file << std::endl;
+    return false;
+  }
+  size_t written = 0;
+  while (written < image.size()) {
+    const ssize_t n =
+        write(fd, image.data() + written, image.size() - written);
+    if (n <= 0) {
+      break;
+    }
+    written += n;
+  }
+  const bool synced = written == image.size() && fsync(fd) == 0;
+  close(fd);
+  if (!synced || std::rename(temp_file.c_str(), filename.c_str()) != 0) {
+    std::cerr << "Could not write checkpoint: " << filename << std::endl;
+    std::remove(temp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool load_checkpoint(const std::string &filename, RunCheckpoint &checkpoint) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Unable to open checkpoint file " << filename << std::endl;
+    return false;
+  }
+  const std::string image((std::istreambuf_iterator<char>(file)),
+                          std::istreambuf_iterator<char>());
+  CheckpointFileHeader header;
+  if (image.size() < sizeof(header)) {
+    std::cerr << "Not a checkpoint file: " << filename << std::endl;
+    return false;
+  }
+  std::memcpy(&header, image.data(), sizeof(header));
+  if (std::memcmp(header.magic, kCheckpointMagic, sizeof(kCheckpointMagic)) !=
+          0 ||
+      header.version != kCheckpointVersion ||
+      header.n_chars > static_cast<uint32_t>(kMaxSymbols) ||
+      header.schedule > static_cast<uint32_t>(ScheduleKind::kLinear) ||
+      header.precision > static_cast<uint32_t>(ScorePrecision::kInt16) ||
+      !(header.initial_temp > 0) || !(header.final_temp > 0) ||
+      image.size() !=
+          sizeof(header) + uint64_t{header.n_chains} * sizeof(ChainRecord)) {
+    std::cerr << "Not a checkpoint file of version " << kCheckpointVersion
+              << ": " << filename << std::endl;
+    return false;
+  }
+
+  checkpoint.seed = header.seed;
+  checkpoint.iters = header.iters;
+  checkpoint.schedule = static_cast<ScheduleKind>(header.schedule);
+  checkpoint.initial_temp = header.initial_temp;
+  checkpoint.final_temp = header.final_temp;
+  checkpoint.precision = static_cast<ScorePrecision>(header.precision);
+  checkpoint.text_hash = header.text_hash;
+  checkpoint.n_chars = header.n_chars;
+  checkpoint.chains.assign(header.n_chains, ChainCheckpoint());
+  for (uint32_t c = 0; c < header.n_chains; ++c) {
+    ChainRecord record;
+    std::memcpy(&record, image.data() + sizeof(header) + c * sizeof(record),
+                sizeof(record));
+    ChainCheckpoint &chain = checkpoint.chains[c];
+    chain.iteration = record.iteration;
+    chain.accepts = record.accepts;
+    chain.log_prob = record.log_prob;
+    chain.best_log_prob = record.best_log_prob;
+    chain.temperature = record.temperature;
+    std::copy(record.rng_state, record.rng_state + 4, chain.rng_state.begin());
+    // Rebuild the permutation one image at a time, rejecting anything that
+    // is not a bijection of the alphabet.
+    chain.state = Permutation(header.n_chars);
+    std::vector<bool> used(header.n_chars, false);
+    for (uint32_t i = 0; i < header.n_chars; ++i) {
+      const uint8_t j = record.forward[i];
+      if (j >= header.n_chars || used[j]) {
+        std::cerr << "Corrupt permutation in checkpoint " << filename
+                  << std::endl;
+        return false;
+      }
+      used[j] = true;
+      chain.state.set(i, j);
+    }
+  }
+  return true;
+}
+
+CheckpointWriter::CheckpointWriter(const std::string &filename,
+                                   const RunCheckpoint &start,
+                                   double interval_seconds)
+    : filename_(filename),
+      run_(start),
+      interval_seconds_(interval_seconds),
+      slots_(new Slot[start.chains.size()]),
+      request_(0),
+      stopping_(false) {
+  for (size_t c = 0; c < run_.chains.size(); ++c) {
+    slots_[c].checkpoint = run_.chains[c];
+  }
+  thread_ = std::thread([this]() { run(); });
+}
+
+CheckpointWriter::~CheckpointWriter() { stop(); }
+
+void CheckpointWriter::submit(int chain, const ChainCheckpoint &checkpoint,
+                              bool finished) {
+  Slot &slot = slots_[chain];
+  {
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    slot.checkpoint = checkpoint;
+  }
+  if (finished) {
+    slot.finished.store(true, std::memory_order_release);
+  }
+  slot.generation.store(request_.load(std::memory_order_acquire),
+                        std::memory_order_release);
+}
+
+void CheckpointWriter::stop() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(stop_mutex_);
+    stopping_ = true;
+  }
+  stop_cv_.notify_all();
+  thread_.join();
+  // Every chain has finished by now, so this records their final states.
+  collect_and_save();
+}
+
+void CheckpointWriter::run() {
+  const auto interval =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(interval_seconds_));
+  std::unique_lock<std::mutex> lock(stop_mutex_);
+  while (!stop_cv_.wait_for(lock, interval, [this]() { return stopping_; })) {
+    lock.unlock();
+    collect_and_save();
+    lock.lock();
+  }
+}
+
+void CheckpointWriter::collect_and_save() {
+  const uint64_t generation = request_.fetch_add(1) + 1;
+  const size_t n_chains = run_.chains.size();
+  for (size_t c = 0; c < n_chains; ++c) {
+    Slot &slot = slots_[c];
+    // A running chain answers within kPollEvery iterations; a finished
+    // chain has already left its last state, and one that has not started
+    // still holds its starting checkpoint.
+    while (slot.started.load(std::memory_order_acquire) &&
+           !slot.finished.load(std::memory_order_acquire) &&
+           slot.generation.load(std::memory_order_acquire) < generation) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(kCollectPollMs));
+    }
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    run_.chains[c] = slot.checkpoint;
+  }
+  save_checkpoint(run_, filename_);
+}
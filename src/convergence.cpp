@@ -0,0 +1,83 @@
+#include "convergence.hpp"
+
+#include <limits>
+
+const char *stop_reason_name(StopReason reason) {
+  switch (reason) {
+    case StopReason::kAgreement:
+      return "chains agreed on a key";
+    case StopReason::kPatience:
+      return "no improvement";
+    case StopReason::kTimeLimit:
+      return "time limit reached";
+    default:
+      return "iteration budget used";
+  }
+}
+
+ConvergenceBoard::ConvergenceBoard(int n_chains,
+                                   const ConvergenceOptions &options)
+    : n_chains_(n_chains),
+      options_(options),
+      deadline_(std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(options.time_limit))),
+      slots_(new Slot[n_chains]),
+      best_log_prob_(-std::numeric_limits<double>::infinity()),
+      stopped_(false),
+      stop_reason_(StopReason::kNone) {}
+
+bool ConvergenceBoard::publish(int chain, const Permutation &state,
+                               double log_prob, long long iteration) {
+  if (stopped()) {
+    return false;
+  }
+
+  // Raise the shared best score, and note on this chain's clock whether it
+  // changed since the chain last looked.
+  double best = best_log_prob_.load(std::memory_order_relaxed);
+  while (log_prob > best) {
+    if (best_log_prob_.compare_exchange_weak(best, log_prob)) {
+      best = log_prob;
+      break;
+    }
+  }
+  Slot &slot = slots_[chain];
+  if (best != slot.seen_best) {
+    slot.seen_best = best;
+    slot.seen_at = iteration;
+  }
+
+  if (options_.time_limit > 0 &&
+      std::chrono::steady_clock::now() >= deadline_) {
+    stop(StopReason::kTimeLimit);
+    return false;
+  }
+
+  if (options_.patience > 0 && iteration - slot.seen_at >= options_.patience) {
+    stop(StopReason::kPatience);
+    return false;
+  }
+
+  if (options_.agree_chains > 1) {
+    const uint64_t key_hash = state.hash();
+    slot.key_hash.store(key_hash, std::memory_order_relaxed);
+    int agreeing = 0;
+    for (int c = 0; c < n_chains_; ++c) {
+      if (slots_[c].key_hash.load(std::memory_order_relaxed) == key_hash) {
+        ++agreeing;
+      }
+    }
+    if (agreeing >= options_.agree_chains) {
+      stop(StopReason::kAgreement);
+      return false;
+    }
+  }
+  return true;
+}
+
+void ConvergenceBoard::stop(StopReason reason) {
+  StopReason expected = StopReason::kNone;
+  stop_reason_.compare_exchange_strong(expected, reason);
+  stopped_.store(true, std::memory_order_relaxed);
+}
@@ -0,0 +1,172 @@
+#include "corpus.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+namespace {
+
+// Each thread hands finished pages back to the kernel in blocks this large.
+constexpr uint64_t kBlockSize = 64 << 20;
+
+/**
+ * @brief Counts the characters in [begin, end) of data and the pairs and
+ * n-grams that start there. `length` is the logical length of the whole
+ * corpus, so the pair and n-grams that straddle `end` are counted here and
+ * not by the next range.
+ */
+void count_range(const unsigned char *data, uint64_t begin, uint64_t end,
+                 uint64_t length, const unsigned char *table,
+                 CorpusCounts &counts) {
+  if (begin >= end) {
+    return;
+  }
+  uint64_t *unigram = counts.unigram.data();
+  uint64_t *bigram = counts.bigram.data();
+  uint64_t *first_seen = counts.first_seen.data();
+
+  unsigned prev = table[data[begin]];
+  ++unigram[prev];
+  if (first_seen[prev] == kNeverSeen) {
+    first_seen[prev] = begin;
+  }
+  for (uint64_t pos = begin + 1; pos < end; ++pos) {
+    const unsigned c = table[data[pos]];
+    ++unigram[c];
+    ++bigram[prev * 256 + c];
+    if (first_seen[c] == kNeverSeen) {
+      first_seen[c] = pos;
+    }
+    prev = c;
+  }
+  if (end < length) {
+    ++bigram[prev * 256 + table[data[end]]];
+  }
+  counts.length += end - begin;
+
+  if (counts.order > 2) {
+    // Roll the last `order` bytes through a key; a full key is the n-gram
+    // that starts order - 1 bytes earlier.
+    const int order = counts.order;
+    const uint64_t mask = (uint64_t{1} << (8 * order)) - 1;
+    const uint64_t last = std::min(end + order - 1, length);
+    uint64_t key = 0;
+    for (uint64_t pos = begin; pos < last; ++pos) {
+      key = ((key << 8) | table[data[pos]]) & mask;
+      if (pos + 1 >= begin + order) {
+        ++counts.ngram[static_cast<uint32_t>(key)];
+      }
+    }
+  }
+}
+
+}  // namespace
+
+CorpusCounts::CorpusCounts(int order)
+    : length(0),
+      unigram(256, 0),
+      bigram(256 * 256, 0),
+      first_seen(256, kNeverSeen),
+      order(order) {}
+
+void CorpusCounts::merge(const CorpusCounts &other) {
+  length += other.length;
+  for (int c = 0; c < 256; ++c) {
+    unigram[c] += other.unigram[c];
+    first_seen[c] = std::min(first_seen[c], other.first_seen[c]);
+  }
+  for (size_t i = 0; i < bigram.size(); ++i) {
+    bigram[i] += other.bigram[i];
+  }
+  for (const auto &entry : other.ngram) {
+    ngram[entry.first] += entry.second;
+  }
+}
+
+CorpusCounts count_text(const std::string &text, int order) {
+  unsigned char identity[256];
+  for (int c = 0; c < 256; ++c) {
+    identity[c] = c;
+  }
+  CorpusCounts counts(order);
+  count_range(reinterpret_cast<const unsigned char *>(text.data()), 0,
+              text.size(), text.size(), identity, counts);
+  return counts;
+}
+
+bool count_corpus_file(const std::string &filename, int n_threads, int order,
+                       CorpusCounts &counts) {
+  counts = CorpusCounts(order);
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Unable to open file " << filename << std::endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    std::cerr << "Unable to read file " << filename << std::endl;
+    close(fd);
+    return false;
+  }
+  const uint64_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return true;
+  }
+  void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    std::cerr << "Unable to map file " << filename << std::endl;
+    return false;
+  }
+  madvise(mapping, size, MADV_SEQUENTIAL);
+  const unsigned char *data = static_cast<const unsigned char *>(mapping);
+
+  // Newlines become spaces, and a final newline is dropped, matching
+  // read_file.
+  unsigned char table[256];
+  for (int c = 0; c < 256; ++c) {
+    table[c] = c;
+  }
+  table[static_cast<unsigned char>('\n')] = ' ';
+  const uint64_t length = data[size - 1] == '\n' ? size - 1 : size;
+
+  n_threads = std::max(1, n_threads);
+  const uint64_t page = sysconf(_SC_PAGESIZE);
+  // Page-aligned ranges let each thread release its own pages.
+  const uint64_t per_thread =
+      std::max(page, (length / n_threads + page - 1) / page * page);
+  std::vector<CorpusCounts> partial(n_threads, CorpusCounts(order));
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      const uint64_t begin = std::min(length, t * per_thread);
+      const uint64_t end = std::min(length, begin + per_thread);
+      for (uint64_t block = begin; block < end; block += kBlockSize) {
+        const uint64_t block_end = std::min(end, block + kBlockSize);
+        count_range(data, block, block_end, length, table, partial[t]);
+        // Drop the pages of full blocks; the next range may still need the
+        // first byte after its own end.
+        const uint64_t release_end = block_end / page * page;
+        if (release_end > block) {
+          madvise(const_cast<unsigned char *>(data) + block,
+                  release_end - block, MADV_DONTNEED);
+        }
+      }
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  munmap(mapping, size);
+
+  for (const CorpusCounts &part : partial) {
+    counts.merge(part);
+  }
+  return true;
+}
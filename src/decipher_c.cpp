@@ -0,0 +1,118 @@
+#include "decipher.h"
+
+#include <cstring>
+#include <exception>
+#include <iostream>
+
+#include "solver.hpp"
+
+struct decipher_solver {
+  decipher_solver(LanguageModel model, int n_threads)
+      : solver(std::move(model), n_threads),
+        alphabet(solver.model().chars().begin(),
+                 solver.model().chars().end()) {}
+
+  Solver solver;
+  std::string alphabet;
+};
+
+void decipher_default_options(decipher_options *options) {
+  const DecodeOptions defaults;
+  options->iters = defaults.iters;
+  options->chains = defaults.chains;
+  options->seed = defaults.seed;
+  options->polish = defaults.polish;
+  options->precision = DECIPHER_PRECISION_DOUBLE;
+  options->schedule = DECIPHER_SCHEDULE_EXPONENTIAL;
+}
+
+decipher_solver *decipher_solver_create(const char *model_file,
+                                        int n_threads) {
+  try {
+    LanguageModel model;
+    if (model_file == nullptr || !load_language_model(model_file, model)) {
+      return nullptr;
+    }
+    return new decipher_solver(std::move(model), n_threads);
+  } catch (const std::exception &e) {
+    std::cerr << "Could not create solver: " << e.what() << std::endl;
+    return nullptr;
+  }
+}
+
+void decipher_solver_destroy(decipher_solver *solver) { delete solver; }
+
+const char *decipher_alphabet(const decipher_solver *solver) {
+  return solver->alphabet.c_str();
+}
+
+int decipher_decode(decipher_solver *solver, const char *ciphertext,
+                    size_t length, const decipher_options *options,
+                    char *plaintext, char *key, decipher_stats *stats) {
+  DecodeOptions decode_options;
+  if (options != nullptr) {
+    decode_options.iters = options->iters;
+    decode_options.chains = options->chains;
+    decode_options.seed = options->seed;
+    decode_options.polish = options->polish != 0;
+    switch (options->precision) {
+      case DECIPHER_PRECISION_DOUBLE:
+        decode_options.precision = ScorePrecision::kDouble;
+        break;
+      case DECIPHER_PRECISION_FLOAT:
+        decode_options.precision = ScorePrecision::kFloat;
+        break;
+      case DECIPHER_PRECISION_INT16:
+        decode_options.precision = ScorePrecision::kInt16;
+        break;
+      default:
+        std::cerr << "Unknown precision: " << options->precision << std::endl;
+        return -1;
+    }
+    switch (options->schedule) {
+      case DECIPHER_SCHEDULE_EXPONENTIAL:
+        decode_options.schedule.kind = ScheduleKind::kExponential;
+        break;
+      case DECIPHER_SCHEDULE_LINEAR:
+        decode_options.schedule.kind = ScheduleKind::kLinear;
+        break;
+      case DECIPHER_SCHEDULE_ADAPTIVE:
+        decode_options.schedule.kind = ScheduleKind::kAdaptive;
+        break;
+      default:
+        std::cerr << "Unknown schedule: " << options->schedule << std::endl;
+        return -1;
+    }
+  }
+  try {
+    // Each calling thread keeps its buffers, so steady calls reuse them.
+    thread_local std::string text;
+    thread_local DecodeResult result;
+    text.assign(ciphertext, length);
+    if (!solver->solver.decode(text, decode_options, result)) {
+      return -1;
+    }
+    if (plaintext != nullptr) {
+      std::memcpy(plaintext, result.plaintext.data(), length);
+      plaintext[length] = '\0';
+    }
+    if (key != nullptr) {
+      const std::string &alphabet = solver->alphabet;
+      for (size_t i = 0; i < alphabet.size(); ++i) {
+        key[i] = alphabet[result.key[i]];
+      }
+      key[alphabet.size()] = '\0';
+    }
+    if (stats != nullptr) {
+      stats->log_prob = result.log_prob;
+      stats->chains = result.stats.chains;
+      stats->iterations = result.stats.iterations;
+      stats->polish_swaps = result.stats.polish_swaps;
+      stats->seconds = result.stats.seconds;
+    }
+    return 0;
+  } catch (const std::exception &e) {
+    std::cerr << "Decoding failed: " << e.what() << std::endl;
+    return -1;
+  }
+}
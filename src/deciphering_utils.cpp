@@ -2,54 +2,45 @@
 
 #include <algorithm>
 #include <cmath>
-#include <random>
+#include <unordered_map>
 
 double compute_log_probability(
-    const std::string &text, const std::map<char, char> &permutation_map,
+    const std::string &text, const Permutation &permutation,
     const std::map<char, int> &char_to_ix,
     const std::vector<double> &frequency_statistics,
-    const std::vector<std::vector<double> > &transition_matrix) {
+    const DoubleMatrix &transition_matrix) {
   double log_prob = 0.0;
   if (text.empty()) {
     return log_prob;
   }
 
-  log_prob += std::log(
-      frequency_statistics[char_to_ix.at(permutation_map.at(text[0]))]);
+  if (char_to_ix.count(text[0])) {
+    log_prob +=
+        std::log(frequency_statistics[permutation[char_to_ix.at(text[0])]]);
+  }
 
   for (size_t i = 0; i < text.length() - 1; ++i) {
     char current_char = text[i];
     char next_char = text[i + 1];
-    if (permutation_map.count(current_char) &&
-        permutation_map.count(next_char)) {
-      char permuted_current = permutation_map.at(current_char);
-      char permuted_next = permutation_map.at(next_char);
-      if (char_to_ix.count(permuted_current) &&
-          char_to_ix.count(permuted_next)) {
-        log_prob += std::log(transition_matrix[char_to_ix.at(permuted_current)]
-                                              [char_to_ix.at(permuted_next)]);
-      }
+    if (char_to_ix.count(current_char) && char_to_ix.count(next_char)) {
+      int permuted_current = permutation[char_to_ix.at(current_char)];
+      int permuted_next = permutation[char_to_ix.at(next_char)];
+      log_prob += std::log(transition_matrix(permuted_current, permuted_next));
     }
   }
   return log_prob;
 }
 
-std::map<char, char> propose_move(const std::map<char, char> &p_map,
-                                  const std::vector<char> &chars) {
-  std::map<char, char> new_p_map = p_map;
-  std::random_device rd;
-  std::mt19937 g(rd());
-  std::uniform_int_distribution<> dis(0, chars.size() - 1);
-  int i = dis(g);
-  int j = dis(g);
+Permutation propose_move(const Permutation &permutation,
+                         const std::vector<int> &symbols, Rng &rng) {
+  Permutation new_permutation = permutation;
+  int i = rng.uniform_int(symbols.size());
+  int j = rng.uniform_int(symbols.size());
   while (i == j) {
-    j = dis(g);
+    j = rng.uniform_int(symbols.size());
   }
-  char char1 = chars[i];
-  char char2 = chars[j];
-  new_p_map[char1] = p_map.at(char2);
-  new_p_map[char2] = p_map.at(char1);
-  return new_p_map;
+  new_permutation.swap(symbols[i], symbols[j]);
+  return new_permutation;
 }
 
 /**
@@ -58,7 +49,7 @@ std::map<char, char> propose_move(const std::map<char, char> &p_map,
 TransitionCounts compute_transition_counts(
     const std::string &text, const std::map<char, int> &char_to_ix) {
   size_t n_chars = char_to_ix.size();
-  TransitionCounts counts(n_chars, std::vector<int>(n_chars, 0));
+  TransitionCounts counts(n_chars, n_chars, 0);
 
   if (text.length() < 2) {
     return counts;
@@ -68,7 +59,7 @@ TransitionCounts compute_transition_counts(
     char c1 = text[i];
     char c2 = text[i + 1];
     if (char_to_ix.count(c1) && char_to_ix.count(c2)) {
-      counts[char_to_ix.at(c1)][char_to_ix.at(c2)]++;
+      counts(char_to_ix.at(c1), char_to_ix.at(c2))++;
     }
   }
   return counts;
@@ -79,34 +70,378 @@ TransitionCounts compute_transition_counts(
  * transition counts.
  */
 double compute_log_probability_by_counts(
-    const TransitionCounts &text_transition_counts, char first_char_in_text,
-    const std::map<char, char> &permutation_map,
-    const std::map<char, int> &char_to_ix,
-    const std::vector<double> &log_frequency_statistics,
-    const std::vector<std::vector<double> > &log_transition_matrix) {
+    const TransitionCounts &text_transition_counts, int first_ix,
+    const Permutation &permutation, const LanguageModel &model) {
   // Start with the log probability of the first character.
-  double log_prob = log_frequency_statistics.at(
-      char_to_ix.at(permutation_map.at(first_char_in_text)));
+  double log_prob =
+      first_ix < 0 ? 0.0 : model.log_frequency(permutation[first_ix]);
 
-  // Create a vector representing the permutation map for faster access.
-  // p_map_indices[i] gives the permuted index of character i.
-  std::vector<int> p_map_indices(char_to_ix.size());
-  for (const auto &pair : permutation_map) {
-    if (char_to_ix.count(pair.first) && char_to_ix.count(pair.second)) {
-      p_map_indices[char_to_ix.at(pair.first)] = char_to_ix.at(pair.second);
+  // Add the log probabilities from the transition matrix, weighted by the
+  // counts.
+  const size_t n = text_transition_counts.rows();
+  for (size_t i = 0; i < n; ++i) {
+    const RowSpan<const int> counts = text_transition_counts.row(i);
+    const double *log_row = model.log_transition_row(permutation[i]);
+    for (size_t j = 0; j < n; ++j) {
+      if (counts[j] > 0) {
+        log_prob += counts[j] * log_row[permutation[j]];
+      }
     }
   }
 
-  // Add the log probabilities from the transition matrix, weighted by the
-  // counts.
-  for (size_t i = 0; i < text_transition_counts.size(); ++i) {
-    for (size_t j = 0; j < text_transition_counts[i].size(); ++j) {
-      if (text_transition_counts[i][j] > 0) {
-        log_prob += text_transition_counts[i][j] *
-                    log_transition_matrix[p_map_indices[i]][p_map_indices[j]];
+  return log_prob;
+}
+
+/**
+ * @brief Computes the change in log likelihood caused by swapping the images
+ * of symbols a and b.
+ */
+double compute_swap_delta_by_counts(
+    const TransitionCounts &text_transition_counts, int first_ix,
+    const Permutation &permutation, int a, int b, const LanguageModel &model) {
+  if (a == b) {
+    return 0.0;
+  }
+  const int pa = permutation[a];
+  const int pb = permutation[b];
+
+  double delta = 0.0;
+  if (first_ix == a) {
+    delta += model.log_frequency(pb) - model.log_frequency(pa);
+  } else if (first_ix == b) {
+    delta += model.log_frequency(pa) - model.log_frequency(pb);
+  }
+
+  const RowSpan<const int> row_a = text_transition_counts.row(a);
+  const RowSpan<const int> row_b = text_transition_counts.row(b);
+  const double *log_row_pa = model.log_transition_row(pa);
+  const double *log_row_pb = model.log_transition_row(pb);
+
+  // Cells (a, k)/(b, k) and (k, a)/(k, b) for every other symbol k. After the
+  // swap, row a reads from row pb of the model and vice versa, so each pair
+  // contributes (count_a - count_b) * (new - old).
+  for (size_t k = 0; k < text_transition_counts.rows(); ++k) {
+    if (static_cast<int>(k) == a || static_cast<int>(k) == b) {
+      continue;
+    }
+    const int pk = permutation[k];
+    const int row_diff = row_a[k] - row_b[k];
+    if (row_diff != 0) {
+      delta += row_diff * (log_row_pb[pk] - log_row_pa[pk]);
+    }
+    const int col_diff =
+        text_transition_counts(k, a) - text_transition_counts(k, b);
+    if (col_diff != 0) {
+      const double *log_row_pk = model.log_transition_row(pk);
+      delta += col_diff * (log_row_pk[pb] - log_row_pk[pa]);
+    }
+  }
+
+  // The four cells where both the row and the column are swapped.
+  delta += row_a[a] * (log_row_pb[pb] - log_row_pa[pa]);
+  delta += row_b[b] * (log_row_pa[pa] - log_row_pb[pb]);
+  delta += row_a[b] * (log_row_pb[pa] - log_row_pa[pb]);
+  delta += row_b[a] * (log_row_pa[pb] - log_row_pb[pa]);
+
+  return delta;
+}
+
+namespace {
+
+// Makes m an n x n matrix of zeros, reusing its block if it has that size.
+void zero_square_matrix(DoubleMatrix &m, int n) {
+  if (m.rows() != static_cast<size_t>(n) ||
+      m.cols() != static_cast<size_t>(n)) {
+    m = DoubleMatrix(n, n);
+  } else {
+    m.fill(0);
+  }
+}
+
+}  // namespace
+
+void compute_all_swap_deltas(const TransitionCounts &text_transition_counts,
+                             int first_ix, const Permutation &permutation,
+                             const LanguageModel &model, DoubleMatrix &deltas,
+                             SwapDeltaScratch &scratch) {
+  const int n = model.size();
+  DoubleMatrix &counts = scratch.counts;
+  DoubleMatrix &log_probs = scratch.log_probs;
+  DoubleMatrix &transposed_log_probs = scratch.transposed_log_probs;
+  DoubleMatrix &rows = scratch.rows;
+  DoubleMatrix &cols = scratch.cols;
+  zero_square_matrix(counts, n);
+  zero_square_matrix(log_probs, n);
+  zero_square_matrix(transposed_log_probs, n);
+  zero_square_matrix(rows, n);
+  zero_square_matrix(cols, n);
+  zero_square_matrix(deltas, n);
+
+  // The counts as doubles and the model seen through the permutation, so
+  // cell (i, j) of both refers to the same pair of text symbols.
+  for (int i = 0; i < n; ++i) {
+    const double *log_row = model.log_transition_row(permutation[i]);
+    for (int j = 0; j < n; ++j) {
+      counts(i, j) = text_transition_counts(i, j);
+      log_probs(i, j) = log_row[permutation[j]];
+      transposed_log_probs(j, i) = log_probs(i, j);
+    }
+  }
+
+  // rows(x, y) is row x of the counts dotted with row y of the model, and
+  // cols(x, y) the same for columns. Each non-zero count adds a scaled model
+  // row to one row of each, a loop over contiguous rows the compiler
+  // vectorizes.
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      const double count = counts(i, j);
+      if (count == 0) {
+        continue;
+      }
+      double *row_out = rows.row(i).data();
+      double *col_out = cols.row(j).data();
+      const double *model_col = transposed_log_probs.row(j).data();
+      const double *model_row = log_probs.row(i).data();
+      for (int y = 0; y < n; ++y) {
+        row_out[y] += count * model_col[y];
+        col_out[y] += count * model_row[y];
+      }
+    }
+  }
+
+  // Swapping a and b changes row a by (count_a - count_b) * (model_b -
+  // model_a) summed over the row, which expands into four dot products; the
+  // same holds for the columns. The cells where both the row and the column
+  // are swapped are counted twice by those sums and are corrected here.
+  for (int a = 0; a < n; ++a) {
+    for (int b = a + 1; b < n; ++b) {
+      const double c_aa = counts(a, a), c_ab = counts(a, b);
+      const double c_ba = counts(b, a), c_bb = counts(b, b);
+      const double m_aa = log_probs(a, a), m_ab = log_probs(a, b);
+      const double m_ba = log_probs(b, a), m_bb = log_probs(b, b);
+      double delta = rows(a, b) + rows(b, a) - rows(a, a) - rows(b, b) +
+                     cols(a, b) + cols(b, a) - cols(a, a) - cols(b, b);
+      delta -= (c_aa - c_ba) * (m_ba - m_aa) + (c_ab - c_bb) * (m_bb - m_ab);
+      delta -= (c_aa - c_ab) * (m_ab - m_aa) + (c_ba - c_bb) * (m_bb - m_ba);
+      delta += (c_aa - c_bb) * (m_bb - m_aa) + (c_ab - c_ba) * (m_ba - m_ab);
+      if (first_ix == a || first_ix == b) {
+        const double sign = first_ix == a ? 1.0 : -1.0;
+        delta += sign * (model.log_frequency(permutation[b]) -
+                         model.log_frequency(permutation[a]));
+      }
+      deltas(a, b) = delta;
+      deltas(b, a) = delta;
+    }
+  }
+}
+
+int fixed_alphabet_size(int n) {
+  for (int size : kFixedAlphabetSizes) {
+    if (n <= size) {
+      return size;
+    }
+  }
+  return 0;
+}
+
+NgramCounts compute_ngram_counts(const std::string &text,
+                                 const std::map<char, int> &char_to_ix,
+                                 int order) {
+  NgramCounts ngram_counts;
+  ngram_counts.order = order;
+  ngram_counts.by_symbol.resize(char_to_ix.size());
+
+  int byte_to_ix[256];
+  std::fill(byte_to_ix, byte_to_ix + 256, -1);
+  for (const auto &entry : char_to_ix) {
+    byte_to_ix[static_cast<unsigned char>(entry.first)] = entry.second;
+  }
+
+  // Roll the last `order` indices through a key, restarting after any
+  // character outside the alphabet.
+  const uint64_t mask = (uint64_t{1} << (8 * order)) - 1;
+  std::unordered_map<uint32_t, int> position;
+  uint64_t key = 0;
+  int run = 0;
+  for (char c : text) {
+    const int ix = byte_to_ix[static_cast<unsigned char>(c)];
+    if (ix < 0) {
+      run = 0;
+      continue;
+    }
+    key = ((key << 8) | ix) & mask;
+    if (++run < order) {
+      continue;
+    }
+    const int next = ngram_counts.keys.size();
+    auto inserted = position.emplace(static_cast<uint32_t>(key), next);
+    if (inserted.second) {
+      ngram_counts.keys.push_back(static_cast<uint32_t>(key));
+      ngram_counts.counts.push_back(0);
+    }
+    ++ngram_counts.counts[inserted.first->second];
+  }
+
+  for (size_t g = 0; g < ngram_counts.keys.size(); ++g) {
+    for (int k = 0; k < order; ++k) {
+      const int s = (ngram_counts.keys[g] >> (8 * k)) & 255;
+      std::vector<int> &grams = ngram_counts.by_symbol[s];
+      if (grams.empty() || grams.back() != static_cast<int>(g)) {
+        grams.push_back(g);
       }
     }
   }
+  return ngram_counts;
+}
 
+double compute_log_probability_by_ngrams(const NgramCounts &ngram_counts,
+                                         const Permutation &permutation,
+                                         const LanguageModel &model) {
+  const int order = ngram_counts.order;
+  double log_prob = 0.0;
+  for (size_t g = 0; g < ngram_counts.keys.size(); ++g) {
+    const uint32_t key = ngram_counts.keys[g];
+    uint32_t image = 0;
+    for (int k = order - 1; k >= 0; --k) {
+      image = (image << 8) | permutation[(key >> (8 * k)) & 255];
+    }
+    log_prob += ngram_counts.counts[g] * model.log_ngram(image);
+  }
   return log_prob;
-}
\ No newline at end of file
+}
+
+double compute_swap_delta_by_ngrams(const NgramCounts &ngram_counts,
+                                    const Permutation &permutation, int a,
+                                    int b, const LanguageModel &model) {
+  if (a == b) {
+    return 0.0;
+  }
+  const int order = ngram_counts.order;
+  const int pa = permutation[a];
+  const int pb = permutation[b];
+
+  // Rescores one n-gram before and after the swap. With skip_a set, an
+  // n-gram that also contains a is skipped, since the loop over a's n-grams
+  // has already counted it.
+  double delta = 0.0;
+  auto rescore = [&](int g, bool skip_a) {
+    const uint32_t key = ngram_counts.keys[g];
+    uint32_t before = 0;
+    uint32_t after = 0;
+    for (int k = order - 1; k >= 0; --k) {
+      const int s = (key >> (8 * k)) & 255;
+      if (s == a && skip_a) {
+        return;
+      }
+      const int ps = permutation[s];
+      before = (before << 8) | ps;
+      after = (after << 8) | (s == a ? pb : s == b ? pa : ps);
+    }
+    delta += ngram_counts.counts[g] *
+             (model.log_ngram(after) - model.log_ngram(before));
+  };
+  for (int g : ngram_counts.by_symbol[a]) {
+    rescore(g, false);
+  }
+  for (int g : ngram_counts.by_symbol[b]) {
+    rescore(g, true);
+  }
+  return delta;
+}
+
+NgramDensity::NgramDensity(const std::string &text,
+                           const LanguageModel &model,
+                           ScorePrecision precision, bool local_tables)
+    : model_(model),
+      fixed_size_(0),
+      precision_(ScorePrecision::kDouble),
+      first_ix_(-1),
+      local_tables_(false) {
+  if (model.order() == 2) {
+    fixed_size_ = fixed_alphabet_size(model.size());
+    const int n = fixed_size_ > 0 ? fixed_size_ : model.size();
+    transition_counts_ = TransitionCounts(n, n, 0);
+    if (fixed_size_ > 0) {
+      transposed_counts_ = TransitionCounts(n, n, 0);
+      precision_ = precision;
+    }
+    if (precision_ == ScorePrecision::kDouble && fixed_size_ > 0 &&
+        local_tables) {
+      local_tables_ = true;
+      double_table_ = ReducedLogTable<double>(model, 1.0);
+    } else if (precision_ == ScorePrecision::kFloat) {
+      float_table_ = ReducedLogTable<float>(model, 1.0);
+    }
+  }
+  reset(text);
+}
+
+void NgramDensity::reset(const std::string &text) {
+  const std::map<char, int> &char_to_ix = model_.char_to_ix();
+  if (model_.order() > 2) {
+    ngram_counts_ = compute_ngram_counts(text, char_to_ix, model_.order());
+    return;
+  }
+
+  // A byte-indexed copy of char_to_ix keeps map lookups out of the loop.
+  int ix[256];
+  std::fill_n(ix, 256, -1);
+  for (const auto &pair : char_to_ix) {
+    ix[static_cast<unsigned char>(pair.first)] = pair.second;
+  }
+  transition_counts_.fill(0);
+  for (size_t k = 1; k < text.size(); ++k) {
+    const int a = ix[static_cast<unsigned char>(text[k - 1])];
+    const int b = ix[static_cast<unsigned char>(text[k])];
+    if (a >= 0 && b >= 0) {
+      ++transition_counts_(a, b);
+    }
+  }
+  if (fixed_size_ > 0) {
+    for (int i = 0; i < fixed_size_; ++i) {
+      for (int j = 0; j < fixed_size_; ++j) {
+        transposed_counts_(j, i) = transition_counts_(i, j);
+      }
+    }
+  }
+  fill_sparse_bigram_counts(transition_counts_, sparse_counts_);
+  first_ix_ = text.empty() ? -1 : ix[static_cast<unsigned char>(text[0])];
+
+  // The int16 scale depends on the length of the text.
+  if (precision_ == ScorePrecision::kInt16) {
+    long long total_count = 0;
+    for (size_t k = 0; k < sparse_counts_.size; ++k) {
+      total_count += sparse_counts_.counts[k];
+    }
+    const double scale = int16_log_scale(model_, total_count);
+    if (int16_table_.empty() || scale != int16_table_.scale()) {
+      int16_table_ = ReducedLogTable<int16_t>(model_, scale);
+    }
+  }
+}
+
+void NgramDensity::swap_deltas(const Permutation &permutation,
+                               const std::vector<int> &symbols,
+                               DoubleMatrix &deltas,
+                               SwapDeltaScratch &scratch) const {
+  zero_square_matrix(deltas, model_.size());
+  if (model_.order() == 2) {
+    compute_all_swap_deltas(transition_counts_, first_ix_, permutation,
+                            model_, scratch.all, scratch);
+    for (int a : symbols) {
+      for (int b : symbols) {
+        deltas(a, b) = scratch.all(a, b);
+      }
+    }
+    return;
+  }
+  for (size_t x = 0; x < symbols.size(); ++x) {
+    for (size_t y = x + 1; y < symbols.size(); ++y) {
+      const int a = symbols[x];
+      const int b = symbols[y];
+      deltas(a, b) = compute_swap_delta_by_ngrams(ngram_counts_, permutation,
+                                                  a, b, model_);
+      deltas(b, a) = deltas(a, b);
+    }
+  }
+}
@@ -0,0 +1,485 @@
+#include "island.hpp"
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <thread>
+
+#include "metropolis_hastings.hpp"
+#include "rng.hpp"
+#include "utils.hpp"
+
+namespace {
+
+enum class MessageType : uint32_t {
+  // Worker to coordinator, once, to check the text and alphabet.
+  kHello = 1,
+  // Worker to coordinator: a new best key of the worker.
+  kReport = 2,
+  // Coordinator to workers: a new global best key, to adopt as a migrant.
+  kBest = 3,
+  // Worker to coordinator: the worker's final key; it disconnects next.
+  kDone = 4,
+};
+
+// Identifies the protocol and its version.
+constexpr char kIslandMagic[4] = {'I', 'S', 'L', '1'};
+
+// Every message has this one fixed layout, so a reader only has to count
+// bytes. Both ends are assumed to share byte order, as with checkpoints.
+struct IslandMessage {
+  char magic[4];
+  uint32_t type;
+  uint64_t text_hash;
+  double log_prob;
+  uint32_t n_chars;
+  uint32_t reserved;
+  uint8_t forward[kMaxSymbols];
+};
+
+// Workers may start before the coordinator, so connecting is retried.
+constexpr int kConnectAttempts = 50;
+constexpr int kConnectRetryMs = 100;
+// How long the coordinator waits for activity before checking again.
+constexpr int kPollTimeoutMs = 1000;
+
+// Where to listen or connect: a Unix socket path, or a TCP host and port.
+struct Endpoint {
+  bool unix_socket;
+  std::string path;
+  std::string host;
+  std::string port;
+};
+
+Endpoint parse_endpoint(const std::string &text) {
+  Endpoint endpoint;
+  const size_t colon = text.rfind(':');
+  const bool has_port =
+      colon != std::string::npos && colon + 1 < text.size() &&
+      text.find_first_not_of("0123456789", colon + 1) == std::string::npos;
+  if (text.compare(0, 5, "unix:") == 0) {
+    endpoint.unix_socket = true;
+    endpoint.path = text.substr(5);
+  } else if (has_port) {
+    endpoint.unix_socket = false;
+    endpoint.host = text.substr(0, colon);
+    endpoint.port = text.substr(colon + 1);
+  } else {
+    endpoint.unix_socket = true;
+    endpoint.path = text;
+  }
+  return endpoint;
+}
+
+/**
+ * @brief Opens a listening or a connected stream socket for an endpoint.
+ * @return The socket, or -1 on failure.
+ */
+int open_socket(const Endpoint &endpoint, bool listening) {
+  if (endpoint.unix_socket) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (endpoint.path.empty() ||
+        endpoint.path.size() >= sizeof(address.sun_path)) {
+      return -1;
+    }
+    std::strcpy(address.sun_path, endpoint.path.c_str());
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    if (listening) {
+      unlink(endpoint.path.c_str());
+    }
+    const sockaddr *addr = reinterpret_cast<const sockaddr *>(&address);
+    const bool ok =
+        listening ? bind(fd, addr, sizeof(address)) == 0 && listen(fd, 16) == 0
+                  : connect(fd, addr, sizeof(address)) == 0;
+    if (!ok) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = listening ? AI_PASSIVE : 0;
+  addrinfo *addresses = nullptr;
+  const char *host = endpoint.host.empty() ? nullptr : endpoint.host.c_str();
+  if (getaddrinfo(host, endpoint.port.c_str(), &hints, &addresses) != 0) {
+    return -1;
+  }
+  int fd = -1;
+  for (addrinfo *a = addresses; a != nullptr; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (listening) {
+      const int reuse = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+      if (bind(fd, a->ai_addr, a->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+        break;
+      }
+    } else if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+IslandMessage make_message(MessageType type, const IslandOptions &options,
+                           const Permutation &state, double log_prob) {
+  IslandMessage message = {};
+  std::memcpy(message.magic, kIslandMagic, sizeof(kIslandMagic));
+  message.type = static_cast<uint32_t>(type);
+  message.text_hash = options.text_hash;
+  message.log_prob = log_prob;
+  message.n_chars = options.n_chars;
+  for (int i = 0; i < kMaxSymbols; ++i) {
+    message.forward[i] = state[i];
+  }
+  return message;
+}
+
+// Rebuilds the key of a message, rejecting anything that is not a
+// bijection of the alphabet.
+bool read_key(const IslandMessage &message, int n_chars, Permutation &key) {
+  key = Permutation(n_chars);
+  std::vector<bool> used(n_chars, false);
+  for (int i = 0; i < n_chars; ++i) {
+    const int j = message.forward[i];
+    if (j >= n_chars || used[j]) {
+      return false;
+    }
+    used[j] = true;
+    key.set(i, j);
+  }
+  return true;
+}
+
+// A stream socket together with the bytes of a partly received message.
+class Connection {
+ public:
+  explicit Connection(int fd) : fd_(fd) {}
+  ~Connection() { close(); }
+
+  Connection(const Connection &) = delete;
+  Connection &operator=(const Connection &) = delete;
+
+  int fd() const { return fd_; }
+  bool is_open() const { return fd_ >= 0; }
+
+  // Sends one message; false if the peer has gone.
+  bool send(const IslandMessage &message) {
+    const char *data = reinterpret_cast<const char *>(&message);
+    size_t left = sizeof(message);
+    while (is_open() && left > 0) {
+      const ssize_t n = ::send(fd_, data, left, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return false;
+      }
+      data += n;
+      left -= n;
+    }
+    return is_open();
+  }
+
+  /**
+   * @brief Appends every complete message that has arrived, without
+   * waiting for more.
+   * @return False once the peer has closed the connection or failed.
+   */
+  bool receive(std::vector<IslandMessage> &messages) {
+    bool alive = is_open();
+    char chunk[4096];
+    while (alive) {
+      const ssize_t n = recv(fd_, chunk, sizeof(chunk), MSG_DONTWAIT);
+      if (n > 0) {
+        buffer_.append(chunk, n);
+      } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      } else if (n < 0 && errno == EINTR) {
+        continue;
+      } else {
+        alive = false;
+      }
+    }
+    size_t offset = 0;
+    for (; offset + sizeof(IslandMessage) <= buffer_.size();
+         offset += sizeof(IslandMessage)) {
+      IslandMessage message;
+      std::memcpy(&message, buffer_.data() + offset, sizeof(message));
+      if (std::memcmp(message.magic, kIslandMagic, sizeof(kIslandMagic)) !=
+          0) {
+        alive = false;
+        break;
+      }
+      messages.push_back(message);
+    }
+    buffer_.erase(0, offset);
+    return alive;
+  }
+
+  void close() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+ private:
+  int fd_;
+  std::string buffer_;
+};
+
+}  // namespace
+
+bool run_island_worker(const NgramDensity &density,
+                       const std::vector<char> &chars,
+                       const std::vector<int> &symbols,
+                       const IslandOptions &options, ThreadPool &pool,
+                       IslandResult &result) {
+  const Endpoint endpoint = parse_endpoint(options.endpoint);
+  int fd = -1;
+  for (int attempt = 0; attempt < kConnectAttempts && fd < 0; ++attempt) {
+    if (attempt > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(kConnectRetryMs));
+    }
+    fd = open_socket(endpoint, false);
+  }
+  if (fd < 0) {
+    std::cerr << "Could not reach the coordinator at " << options.endpoint
+              << std::endl;
+    return false;
+  }
+  Connection coordinator(fd);
+  bool connected = coordinator.send(make_message(
+      MessageType::kHello, options, Permutation(options.n_chars), 0.0));
+
+  const int n = std::max(1, options.n_chains);
+  std::vector<Rng> rngs;
+  std::vector<Permutation> states;
+  for (int i = 0; i < n; ++i) {
+    rngs.push_back(Rng::stream(options.seed, i));
+    states.push_back(generate_random_permutation(chars, rngs[i]));
+  }
+  std::vector<double> log_probs(n);
+
+  // Segments of at least two iterations, as ExponentialCooling requires.
+  const int rounds = std::max(
+      1, std::min(options.iters / 2,
+                  (options.iters + options.exchange_every - 1) /
+                      std::max(1, options.exchange_every)));
+  auto temperature_at = [&](double x) {
+    return options.initial_temp *
+           std::pow(options.final_temp / options.initial_temp, x);
+  };
+
+  double reported = -std::numeric_limits<double>::infinity();
+  int migrants = 0;
+  int best = 0;
+  for (int round = 0; round < rounds; ++round) {
+    const int begin = static_cast<long long>(options.iters) * round / rounds;
+    const int end =
+        static_cast<long long>(options.iters) * (round + 1) / rounds;
+    const double t_begin = temperature_at(double(round) / rounds);
+    const double t_end = temperature_at(double(round + 1) / rounds);
+    for (int i = 0; i < n; ++i) {
+      pool.submit([&, i]() {
+        UniformSwapProposal proposal(symbols);
+        ExponentialCooling schedule(t_begin, t_end, end - begin);
+        states[i] = metropolis_hastings_annealing(
+            states[i], proposal, density, schedule, rngs[i], end - begin);
+        log_probs[i] = density.score(states[i]);
+      });
+    }
+    pool.wait();
+
+    best = std::max_element(log_probs.begin(), log_probs.end()) -
+           log_probs.begin();
+    const int worst = std::min_element(log_probs.begin(), log_probs.end()) -
+                      log_probs.begin();
+    if (connected && log_probs[best] > reported) {
+      reported = log_probs[best];
+      connected = coordinator.send(make_message(
+          MessageType::kReport, options, states[best], reported));
+    }
+
+    // Adopt the best key broadcast since the last exchange in place of the
+    // worst chain, if it beats that chain.
+    std::vector<IslandMessage> messages;
+    if (connected) {
+      connected = coordinator.receive(messages);
+    }
+    Permutation migrant;
+    double migrant_log_prob = -std::numeric_limits<double>::infinity();
+    for (const IslandMessage &message : messages) {
+      Permutation key;
+      if (message.type == static_cast<uint32_t>(MessageType::kBest) &&
+          message.log_prob > migrant_log_prob &&
+          read_key(message, options.n_chars, key)) {
+        migrant = key;
+        migrant_log_prob = message.log_prob;
+      }
+    }
+    if (migrant_log_prob > log_probs[worst]) {
+      states[worst] = migrant;
+      log_probs[worst] = density.score(migrant);
+      ++migrants;
+    }
+    if (!connected) {
+      std::cerr << "Lost the coordinator; continuing alone." << std::endl;
+      coordinator.close();
+    }
+    std::cout << "Exchange " << round + 1 << "/" << rounds
+              << ": best log prob " << *std::max_element(log_probs.begin(),
+                                                         log_probs.end())
+              << ", " << migrants << " migrants adopted" << std::endl;
+  }
+
+  best = std::max_element(log_probs.begin(), log_probs.end()) -
+         log_probs.begin();
+  result.best_state = states[best];
+  result.best_log_prob = log_probs[best];
+  if (connected) {
+    coordinator.send(make_message(MessageType::kDone, options,
+                                  result.best_state, result.best_log_prob));
+  }
+  return true;
+}
+
+bool run_island_coordinator(const IslandOptions &options,
+                            IslandResult &result) {
+  const Endpoint endpoint = parse_endpoint(options.endpoint);
+  Connection listener(open_socket(endpoint, true));
+  if (!listener.is_open()) {
+    std::cerr << "Could not listen on " << options.endpoint << std::endl;
+    return false;
+  }
+  std::cout << "Coordinator listening on " << options.endpoint
+            << ", waiting for " << options.expected_workers << " worker(s)..."
+            << std::endl;
+
+  std::vector<std::unique_ptr<Connection> > workers;
+  std::vector<bool> greeted;
+  bool have_best = false;
+  result.best_log_prob = -std::numeric_limits<double>::infinity();
+
+  auto drop = [&](size_t w, const char *why) {
+    std::cout << "Worker " << w + 1 << " " << why << "." << std::endl;
+    workers[w]->close();
+  };
+  auto any_open = [&]() {
+    return std::any_of(workers.begin(), workers.end(),
+                       [](const std::unique_ptr<Connection> &worker) {
+                         return worker->is_open();
+                       });
+  };
+
+  while (static_cast<int>(workers.size()) < options.expected_workers ||
+         any_open()) {
+    std::vector<pollfd> fds = {{listener.fd(), POLLIN, 0}};
+    std::vector<size_t> polled;
+    for (size_t w = 0; w < workers.size(); ++w) {
+      if (workers[w]->is_open()) {
+        fds.push_back({workers[w]->fd(), POLLIN, 0});
+        polled.push_back(w);
+      }
+    }
+    if (poll(fds.data(), fds.size(), kPollTimeoutMs) < 0 && errno != EINTR) {
+      std::cerr << "Coordinator poll failed." << std::endl;
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      const int fd = accept(listener.fd(), nullptr, nullptr);
+      if (fd >= 0) {
+        workers.emplace_back(new Connection(fd));
+        greeted.push_back(false);
+        std::cout << "Worker " << workers.size() << " connected."
+                  << std::endl;
+      }
+    }
+
+    for (size_t k = 0; k < polled.size(); ++k) {
+      const size_t w = polled[k];
+      if (fds[k + 1].revents == 0) {
+        continue;
+      }
+      std::vector<IslandMessage> messages;
+      const bool alive = workers[w]->receive(messages);
+      for (const IslandMessage &message : messages) {
+        if (!workers[w]->is_open()) {
+          break;
+        }
+        if (!greeted[w]) {
+          if (message.type != static_cast<uint32_t>(MessageType::kHello) ||
+              message.text_hash != options.text_hash ||
+              static_cast<int>(message.n_chars) != options.n_chars) {
+            drop(w, "was rejected: different text or model");
+          } else {
+            // Only a worker decoding the same text hears about new bests.
+            greeted[w] = true;
+          }
+          continue;
+        }
+        Permutation key;
+        if ((message.type != static_cast<uint32_t>(MessageType::kReport) &&
+             message.type != static_cast<uint32_t>(MessageType::kDone)) ||
+            !read_key(message, options.n_chars, key)) {
+          drop(w, "sent a malformed message");
+          break;
+        }
+        if (message.log_prob > result.best_log_prob) {
+          have_best = true;
+          result.best_log_prob = message.log_prob;
+          result.best_state = key;
+          std::cout << "Worker " << w + 1 << " found a new global best (log "
+                    << "prob " << message.log_prob << ")." << std::endl;
+          // Island-model exchange: every other worker may adopt it.
+          const IslandMessage best = make_message(
+              MessageType::kBest, options, key, message.log_prob);
+          for (size_t other = 0; other < workers.size(); ++other) {
+            if (other != w && greeted[other] && workers[other]->is_open() &&
+                !workers[other]->send(best)) {
+              drop(other, "died");
+            }
+          }
+        }
+        if (message.type == static_cast<uint32_t>(MessageType::kDone)) {
+          drop(w, "finished");
+        }
+      }
+      if (!alive && workers[w]->is_open()) {
+        drop(w, "died");
+      }
+    }
+  }
+
+  listener.close();
+  if (endpoint.unix_socket) {
+    unlink(endpoint.path.c_str());
+  }
+  if (!have_best) {
+    std::cerr << "No worker reported a key." << std::endl;
+    return false;
+  }
+  return true;
+}
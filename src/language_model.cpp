@@ -0,0 +1,448 @@
+#include "language_model.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+
+#include "matrix.hpp"
+#include "utils.hpp"
+
+namespace {
+
+// Every section of the file starts on its own cache line.
+size_t align64(size_t n) { return (n + 63) & ~static_cast<size_t>(63); }
+
+// The hash tables of a model of order 3 or more, before they are laid out.
+struct NgramTables {
+  int log2_capacity = 0;
+  int context_log2_capacity = 0;
+  std::vector<NgramSlot> slots;
+  std::vector<NgramSlot> context_slots;
+  double step = 0;
+};
+
+// Sizes a table to keep its load factor at or below one half.
+int table_log2_capacity(size_t n_keys) {
+  int log2_capacity = 4;
+  while ((size_t{1} << log2_capacity) < 2 * n_keys) {
+    ++log2_capacity;
+  }
+  return log2_capacity;
+}
+
+void insert_code(std::vector<NgramSlot> &slots, int log2_capacity,
+                 uint32_t key, double neg_log_prob, double step) {
+  const uint32_t mask = slots.size() - 1;
+  uint32_t slot = QuantizedLogTable::home_slot(key, 32 - log2_capacity);
+  while (slots[slot].key != kEmptyNgramKey) {
+    slot = (slot + 1) & mask;
+  }
+  slots[slot].key = key;
+  slots[slot].code = static_cast<uint16_t>(std::lround(neg_log_prob / step));
+}
+
+/**
+ * @brief Turns the n-gram counts of a corpus into quantized hash tables keyed
+ * by alphabet indices. An n-gram seen c times in a context seen C times gets
+ * log((c + 1) / (C + n)) and an unseen one log(1 / (C + n)), where n is the
+ * alphabet size.
+ */
+NgramTables build_ngram_tables(const CorpusCounts &counts,
+                               const std::vector<char> &chars) {
+  const int order = counts.order;
+  const double n = chars.size();
+  int byte_to_ix[256] = {};
+  for (size_t i = 0; i < chars.size(); ++i) {
+    byte_to_ix[static_cast<unsigned char>(chars[i])] = i;
+  }
+
+  std::vector<std::pair<uint32_t, uint64_t> > grams;
+  std::unordered_map<uint32_t, uint64_t> context_totals;
+  grams.reserve(counts.ngram.size());
+  for (const auto &entry : counts.ngram) {
+    uint32_t key = 0;
+    for (int k = order - 1; k >= 0; --k) {
+      key = (key << 8) | byte_to_ix[(entry.first >> (8 * k)) & 255];
+    }
+    grams.emplace_back(key, entry.second);
+    context_totals[key >> 8] += entry.second;
+  }
+
+  // The largest value to quantize is the unseen log-probability of the most
+  // frequent context.
+  double max_neg_log_prob = 0;
+  for (const auto &context : context_totals) {
+    max_neg_log_prob =
+        std::max(max_neg_log_prob, std::log(context.second + n));
+  }
+
+  NgramTables tables;
+  tables.step = max_neg_log_prob / UINT16_MAX;
+  tables.log2_capacity = table_log2_capacity(grams.size());
+  const NgramSlot empty = {kEmptyNgramKey, 0, 0};
+  tables.slots.assign(size_t{1} << tables.log2_capacity, empty);
+  for (const auto &gram : grams) {
+    const double total = context_totals[gram.first >> 8] + n;
+    insert_code(tables.slots, tables.log2_capacity, gram.first,
+                std::log(total / (gram.second + 1)), tables.step);
+  }
+  tables.context_log2_capacity = table_log2_capacity(context_totals.size());
+  tables.context_slots.assign(size_t{1} << tables.context_log2_capacity,
+                              empty);
+  for (const auto &context : context_totals) {
+    insert_code(tables.context_slots, tables.context_log2_capacity,
+                context.first, std::log(context.second + n), tables.step);
+  }
+  return tables;
+}
+
+/**
+ * @brief Lays out the alphabet, log tables and, for orders above 2, the
+ * n-gram tables as a model file image.
+ */
+std::vector<unsigned char> build_model_image(
+    const std::vector<char> &chars, const std::vector<double> &log_frequency,
+    const DoubleMatrix &log_transition, int order,
+    const NgramTables &ngrams) {
+  const size_t n = chars.size();
+  // The matrix rows are already padded to whole cache lines, so the file
+  // uses the same stride and the table is copied in one piece.
+  const size_t row_stride = log_transition.stride();
+
+  ModelFileHeader header = {};
+  std::memcpy(header.magic, kModelMagic, sizeof(kModelMagic));
+  header.version = kModelVersion;
+  header.n_chars = n;
+  header.row_stride = row_stride;
+  header.order = order;
+  header.chars_offset = align64(sizeof(ModelFileHeader));
+  header.log_frequency_offset = align64(header.chars_offset + n);
+  header.log_transition_offset =
+      align64(header.log_frequency_offset + n * sizeof(double));
+  header.file_size =
+      header.log_transition_offset + n * row_stride * sizeof(double);
+
+  NgramTableHeader ngram_header = {};
+  if (order > 2) {
+    header.ngram_offset = align64(header.file_size);
+    ngram_header.log2_capacity = ngrams.log2_capacity;
+    ngram_header.context_log2_capacity = ngrams.context_log2_capacity;
+    ngram_header.step = ngrams.step;
+    ngram_header.slots_offset =
+        align64(header.ngram_offset + sizeof(NgramTableHeader));
+    ngram_header.context_slots_offset = align64(
+        ngram_header.slots_offset + ngrams.slots.size() * sizeof(NgramSlot));
+    header.file_size = ngram_header.context_slots_offset +
+                       ngrams.context_slots.size() * sizeof(NgramSlot);
+  }
+
+  std::vector<unsigned char> image(header.file_size, 0);
+  std::memcpy(image.data(), &header, sizeof(header));
+  std::memcpy(image.data() + header.chars_offset, chars.data(), n);
+  std::memcpy(image.data() + header.log_frequency_offset, log_frequency.data(),
+              n * sizeof(double));
+  std::memcpy(image.data() + header.log_transition_offset,
+              log_transition.data(), n * row_stride * sizeof(double));
+  if (order > 2) {
+    std::memcpy(image.data() + header.ngram_offset, &ngram_header,
+                sizeof(ngram_header));
+    std::memcpy(image.data() + ngram_header.slots_offset, ngrams.slots.data(),
+                ngrams.slots.size() * sizeof(NgramSlot));
+    std::memcpy(image.data() + ngram_header.context_slots_offset,
+                ngrams.context_slots.data(),
+                ngrams.context_slots.size() * sizeof(NgramSlot));
+  }
+  return image;
+}
+
+/**
+ * @brief Checks that the n-gram tables described at header.ngram_offset lie
+ * inside an image of `size` bytes.
+ */
+bool is_valid_ngram_tables(const unsigned char *image, size_t size,
+                           const ModelFileHeader &header) {
+  if (header.ngram_offset % 8 != 0 ||
+      header.ngram_offset + sizeof(NgramTableHeader) > size) {
+    return false;
+  }
+  NgramTableHeader tables;
+  std::memcpy(&tables, image + header.ngram_offset, sizeof(tables));
+  if (tables.log2_capacity < 1 || tables.log2_capacity > 31 ||
+      tables.context_log2_capacity < 1 || tables.context_log2_capacity > 31) {
+    return false;
+  }
+  const uint64_t capacity = uint64_t{1} << tables.log2_capacity;
+  const uint64_t context_capacity = uint64_t{1}
+                                    << tables.context_log2_capacity;
+  return tables.slots_offset % alignof(NgramSlot) == 0 &&
+         tables.context_slots_offset % alignof(NgramSlot) == 0 &&
+         tables.slots_offset + capacity * sizeof(NgramSlot) <= size &&
+         tables.context_slots_offset + context_capacity * sizeof(NgramSlot) <=
+             size;
+}
+
+/**
+ * @brief Checks that an image of `size` bytes holds a model this version can
+ * read, with every section inside the image.
+ */
+bool is_valid_model_image(const unsigned char *image, size_t size) {
+  if (size < sizeof(ModelFileHeader)) {
+    return false;
+  }
+  ModelFileHeader header;
+  std::memcpy(&header, image, sizeof(header));
+  if (std::memcmp(header.magic, kModelMagic, sizeof(kModelMagic)) != 0 ||
+      header.version < 1 || header.version > kModelVersion ||
+      header.file_size != size || header.row_stride < header.n_chars) {
+    return false;
+  }
+  if (header.version == 1) {
+    header.order = 2;
+  }
+  if (header.order < 2 || header.order > kMaxNgramOrder ||
+      (header.order > 2 && (header.n_chars > 255 ||
+                            !is_valid_ngram_tables(image, size, header)))) {
+    return false;
+  }
+  const uint64_t n = header.n_chars;
+  return header.chars_offset + n <= size &&
+         header.log_frequency_offset + n * sizeof(double) <= size &&
+         header.log_transition_offset +
+                 n * header.row_stride * sizeof(double) <=
+             size &&
+         header.log_frequency_offset % alignof(double) == 0 &&
+         header.log_transition_offset % alignof(double) == 0;
+}
+
+}  // namespace
+
+LanguageModel::LanguageModel()
+    : image_(nullptr),
+      image_size_(0),
+      log_frequency_(nullptr),
+      log_transition_(nullptr),
+      row_stride_(0),
+      order_(2),
+      step_(0),
+      mapping_(nullptr),
+      mapping_size_(0) {}
+
+LanguageModel::~LanguageModel() { release(); }
+
+LanguageModel::LanguageModel(LanguageModel &&other) noexcept
+    : LanguageModel() {
+  *this = std::move(other);
+}
+
+LanguageModel &LanguageModel::operator=(LanguageModel &&other) noexcept {
+  if (this != &other) {
+    release();
+    chars_ = std::move(other.chars_);
+    char_to_ix_ = std::move(other.char_to_ix_);
+    image_ = other.image_;
+    image_size_ = other.image_size_;
+    log_frequency_ = other.log_frequency_;
+    log_transition_ = other.log_transition_;
+    row_stride_ = other.row_stride_;
+    order_ = other.order_;
+    ngrams_ = other.ngrams_;
+    contexts_ = other.contexts_;
+    step_ = other.step_;
+    // Moving a vector keeps its buffer, so the views above stay valid.
+    storage_ = std::move(other.storage_);
+    mapping_ = other.mapping_;
+    mapping_size_ = other.mapping_size_;
+    other.image_ = nullptr;
+    other.image_size_ = 0;
+    other.log_frequency_ = nullptr;
+    other.log_transition_ = nullptr;
+    other.mapping_ = nullptr;
+    other.mapping_size_ = 0;
+  }
+  return *this;
+}
+
+void LanguageModel::attach(const unsigned char *image, size_t size) {
+  ModelFileHeader header;
+  std::memcpy(&header, image, sizeof(header));
+  const char *chars =
+      reinterpret_cast<const char *>(image + header.chars_offset);
+  chars_.assign(chars, chars + header.n_chars);
+  char_to_ix_ = get_char_to_ix(chars_);
+  image_ = image;
+  image_size_ = size;
+  log_frequency_ =
+      reinterpret_cast<const double *>(image + header.log_frequency_offset);
+  log_transition_ =
+      reinterpret_cast<const double *>(image + header.log_transition_offset);
+  row_stride_ = header.row_stride;
+  order_ = header.version == 1 ? 2 : header.order;
+  if (order_ > 2) {
+    NgramTableHeader tables;
+    std::memcpy(&tables, image + header.ngram_offset, sizeof(tables));
+    ngrams_ = QuantizedLogTable(
+        reinterpret_cast<const NgramSlot *>(image + tables.slots_offset),
+        tables.log2_capacity);
+    contexts_ = QuantizedLogTable(reinterpret_cast<const NgramSlot *>(
+                                      image + tables.context_slots_offset),
+                                  tables.context_log2_capacity);
+    step_ = tables.step;
+  }
+}
+
+void LanguageModel::release() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+    mapping_ = nullptr;
+    mapping_size_ = 0;
+  }
+  storage_.clear();
+  image_ = nullptr;
+  image_size_ = 0;
+}
+
+LanguageModel build_language_model(const CorpusCounts &counts) {
+  // Order the alphabet by first appearance, as get_chars_from_text does.
+  std::vector<char> chars;
+  for (int c = 0; c < 256; ++c) {
+    if (counts.first_seen[c] != kNeverSeen) {
+      chars.push_back(static_cast<char>(c));
+    }
+  }
+  std::sort(chars.begin(), chars.end(), [&](char x, char y) {
+    return counts.first_seen[static_cast<unsigned char>(x)] <
+           counts.first_seen[static_cast<unsigned char>(y)];
+  });
+  const size_t n = chars.size();
+
+  std::vector<double> log_frequency(n);
+  for (size_t i = 0; i < n; ++i) {
+    log_frequency[i] =
+        double(counts.unigram[static_cast<unsigned char>(chars[i])]) /
+        counts.length;
+  }
+
+  DoubleMatrix log_transition(n, n);
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t *row =
+        &counts.bigram[static_cast<unsigned char>(chars[i]) * 256];
+    RowSpan<double> log_row = log_transition.row(i);
+    double total = 0;
+    for (size_t j = 0; j < n; ++j) {
+      // Add-1 smoothing
+      log_row[j] = 1.0 + row[static_cast<unsigned char>(chars[j])];
+      total += log_row[j];
+    }
+    for (double &val : log_row) {
+      val /= total;
+    }
+  }
+
+  // Pre-calculate logs of the statistics
+  for (double &val : log_frequency) {
+    // Add a small epsilon to avoid log(0) which is -infinity
+    val = std::log(val + 1e-10);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    for (double &val : log_transition.row(i)) {
+      val = std::log(val + 1e-10);
+    }
+  }
+
+  // Keys pack one alphabet index per byte, with all ones reserved.
+  int order = counts.order;
+  if (order > 2 && n > 255) {
+    std::cerr << "An alphabet of " << n << " characters is too large for "
+              << "an order " << order << " model; using order 2." << std::endl;
+    order = 2;
+  }
+  NgramTables ngrams;
+  if (order > 2) {
+    ngrams = build_ngram_tables(counts, chars);
+  }
+
+  LanguageModel model;
+  model.storage_ =
+      build_model_image(chars, log_frequency, log_transition, order, ngrams);
+  model.attach(model.storage_.data(), model.storage_.size());
+  return model;
+}
+
+LanguageModel train_language_model(const std::string &text, int order) {
+  return build_language_model(count_text(text, order));
+}
+
+bool train_language_model_from_file(const std::string &filename,
+                                    int n_threads, LanguageModel &model,
+                                    int order) {
+  CorpusCounts counts;
+  if (!count_corpus_file(filename, n_threads, order, counts)) {
+    return false;
+  }
+  if (counts.length == 0) {
+    std::cerr << "Training file is empty: " << filename << std::endl;
+    return false;
+  }
+  model = build_language_model(counts);
+  return true;
+}
+
+bool save_language_model(const LanguageModel &model,
+                         const std::string &filename) {
+  std::ofstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Could not open file to save model: " << filename
+              << std::endl;
+    return false;
+  }
+  file.write(reinterpret_cast<const char *>(model.image_), model.image_size_);
+  file.close();
+  if (!file) {
+    std::cerr << "Could not write model: " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool load_language_model(const std::string &filename, LanguageModel &model) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Unable to open model file " << filename << std::endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    std::cerr << "Unable to read model file " << filename << std::endl;
+    close(fd);
+    return false;
+  }
+  const size_t size = st.st_size;
+  void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    std::cerr << "Unable to map model file " << filename << std::endl;
+    return false;
+  }
+  const unsigned char *image = static_cast<const unsigned char *>(mapping);
+  if (!is_valid_model_image(image, size)) {
+    std::cerr << "Not a model file of version " << kModelVersion
+              << " or earlier: " << filename << std::endl;
+    munmap(mapping, size);
+    return false;
+  }
+
+  LanguageModel loaded;
+  loaded.mapping_ = mapping;
+  loaded.mapping_size_ = size;
+  loaded.attach(image, size);
+  model = std::move(loaded);
+  return true;
+}
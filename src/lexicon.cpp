@@ -0,0 +1,308 @@
+#include "lexicon.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+// Words per bucket on average, and spare slots per word. Larger buckets
+// shrink the displacement table but take longer to place.
+constexpr size_t kWordsPerBucket = 4;
+constexpr double kSlotsPerWord = 1.125;
+
+// The corpus is streamed in chunks of this many bytes.
+constexpr size_t kLexiconChunkSize = 1 << 20;
+
+bool is_letter(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+char fold(char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+
+}  // namespace
+
+Lexicon build_lexicon(
+    const std::unordered_map<std::string, uint64_t> &word_counts) {
+  // Words whose 64-bit hashes collide keep the larger count.
+  std::unordered_map<uint64_t, uint64_t> hash_counts;
+  uint64_t total = 0;
+  for (const auto &entry : word_counts) {
+    uint64_t hash = Lexicon::kHashSeed;
+    for (char c : entry.first) {
+      hash = Lexicon::hash_char(hash, c);
+    }
+    uint64_t &count = hash_counts[hash];
+    count = std::max(count, entry.second);
+    total += entry.second;
+  }
+
+  Lexicon lexicon;
+  lexicon.n_words_ = hash_counts.size();
+  lexicon.miss_log_prob_ = std::log(0.5 / std::max<uint64_t>(total, 1));
+  const size_t n_buckets =
+      std::max<size_t>(1, hash_counts.size() / kWordsPerBucket);
+  const size_t n_slots =
+      std::max<size_t>(1, std::ceil(hash_counts.size() * kSlotsPerWord));
+  lexicon.displacements_.assign(n_buckets, 0);
+  lexicon.fingerprints_.assign(n_slots, 0);
+  // An empty slot reads as a miss whatever fingerprint it matches.
+  lexicon.log_probs_.assign(n_slots, lexicon.miss_log_prob_);
+
+  std::vector<std::vector<uint64_t> > buckets(n_buckets);
+  for (const auto &entry : hash_counts) {
+    buckets[static_cast<uint32_t>(entry.first) % n_buckets].push_back(
+        entry.first);
+  }
+  // Place the largest buckets first, while most slots are still free.
+  std::vector<size_t> order(n_buckets);
+  for (size_t b = 0; b < n_buckets; ++b) {
+    order[b] = b;
+  }
+  std::sort(order.begin(), order.end(), [&buckets](size_t x, size_t y) {
+    return buckets[x].size() > buckets[y].size();
+  });
+
+  std::vector<bool> taken(n_slots, false);
+  std::vector<size_t> slots;
+  for (size_t b : order) {
+    const std::vector<uint64_t> &bucket = buckets[b];
+    if (bucket.empty()) {
+      break;
+    }
+    for (uint32_t displacement = 0;; ++displacement) {
+      slots.clear();
+      for (uint64_t hash : bucket) {
+        const size_t slot = Lexicon::slot_of(hash, displacement, n_slots);
+        if (taken[slot] ||
+            std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+          break;
+        }
+        slots.push_back(slot);
+      }
+      if (slots.size() == bucket.size()) {
+        lexicon.displacements_[b] = displacement;
+        break;
+      }
+    }
+    for (size_t k = 0; k < bucket.size(); ++k) {
+      taken[slots[k]] = true;
+      lexicon.fingerprints_[slots[k]] = static_cast<uint32_t>(bucket[k] >> 32);
+      lexicon.log_probs_[slots[k]] =
+          std::log(static_cast<double>(hash_counts[bucket[k]]) / total);
+    }
+  }
+  return lexicon;
+}
+
+bool build_lexicon_from_file(const std::string &filename, Lexicon &lexicon) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Unable to open file " << filename << std::endl;
+    return false;
+  }
+  std::unordered_map<std::string, uint64_t> word_counts;
+  std::vector<char> chunk(kLexiconChunkSize);
+  // A word may run over the end of a chunk.
+  std::string word;
+  while (file) {
+    file.read(chunk.data(), chunk.size());
+    const std::streamsize n = file.gcount();
+    for (std::streamsize i = 0; i < n; ++i) {
+      if (is_letter(chunk[i])) {
+        word.push_back(fold(chunk[i]));
+      } else if (!word.empty()) {
+        ++word_counts[word];
+        word.clear();
+      }
+    }
+  }
+  if (!word.empty()) {
+    ++word_counts[word];
+  }
+  lexicon = build_lexicon(word_counts);
+  return true;
+}
+
+std::string lexicon_file_name(const std::string &model_file) {
+  return model_file + ".lexicon";
+}
+
+bool save_lexicon(const Lexicon &lexicon, const std::string &filename) {
+  std::ofstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Could not open file to save lexicon: " << filename
+              << std::endl;
+    return false;
+  }
+  LexiconFileHeader header = {};
+  std::memcpy(header.magic, kLexiconMagic, sizeof(kLexiconMagic));
+  header.version = kLexiconVersion;
+  header.n_buckets = lexicon.displacements_.size();
+  header.n_slots = lexicon.fingerprints_.size();
+  header.n_words = lexicon.n_words_;
+  header.miss_log_prob = lexicon.miss_log_prob_;
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(lexicon.displacements_.data()),
+             lexicon.displacements_.size() * sizeof(uint32_t));
+  file.write(reinterpret_cast<const char *>(lexicon.fingerprints_.data()),
+             lexicon.fingerprints_.size() * sizeof(uint32_t));
+  file.write(reinterpret_cast<const char *>(lexicon.log_probs_.data()),
+             lexicon.log_probs_.size() * sizeof(float));
+  file.close();
+  if (!file) {
+    std::cerr << "Could not write lexicon: " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool load_lexicon(const std::string &filename, Lexicon &lexicon) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "Unable to open lexicon file " << filename << std::endl;
+    return false;
+  }
+  LexiconFileHeader header;
+  file.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!file ||
+      std::memcmp(header.magic, kLexiconMagic, sizeof(kLexiconMagic)) != 0 ||
+      header.version != kLexiconVersion || header.n_buckets == 0 ||
+      header.n_slots == 0) {
+    std::cerr << "Not a lexicon file of version " << kLexiconVersion << ": "
+              << filename << std::endl;
+    return false;
+  }
+  lexicon.displacements_.resize(header.n_buckets);
+  lexicon.fingerprints_.resize(header.n_slots);
+  lexicon.log_probs_.resize(header.n_slots);
+  lexicon.n_words_ = header.n_words;
+  lexicon.miss_log_prob_ = header.miss_log_prob;
+  file.read(reinterpret_cast<char *>(lexicon.displacements_.data()),
+            header.n_buckets * sizeof(uint32_t));
+  file.read(reinterpret_cast<char *>(lexicon.fingerprints_.data()),
+            header.n_slots * sizeof(uint32_t));
+  file.read(reinterpret_cast<char *>(lexicon.log_probs_.data()),
+            header.n_slots * sizeof(float));
+  if (!file) {
+    std::cerr << "Truncated lexicon file " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+TextWords compute_text_words(const std::string &text,
+                             const std::vector<char> &chars) {
+  int ix[256];
+  std::fill_n(ix, 256, -1);
+  for (size_t i = 0; i < chars.size(); ++i) {
+    ix[static_cast<unsigned char>(chars[i])] = i;
+  }
+
+  TextWords words;
+  words.offsets.push_back(0);
+  words.by_symbol.resize(chars.size());
+  std::unordered_map<std::string, int> word_ids;
+  std::string word;
+  for (size_t k = 0; k <= text.size(); ++k) {
+    const int s = k < text.size() && is_letter(text[k])
+                      ? ix[static_cast<unsigned char>(text[k])]
+                      : -1;
+    if (s >= 0) {
+      word.push_back(static_cast<char>(s));
+      continue;
+    }
+    if (word.empty()) {
+      continue;
+    }
+    auto inserted = word_ids.emplace(word, words.counts.size());
+    if (inserted.second) {
+      const int w = words.counts.size();
+      words.counts.push_back(0);
+      for (size_t j = 0; j < word.size(); ++j) {
+        const uint8_t symbol = word[j];
+        words.symbols.push_back(symbol);
+        if (word.find(static_cast<char>(symbol)) == j) {
+          words.by_symbol[symbol].push_back(w);
+        }
+      }
+      words.offsets.push_back(words.symbols.size());
+    }
+    ++words.counts[inserted.first->second];
+    word.clear();
+  }
+  return words;
+}
+
+LexiconDensity::LexiconDensity(const NgramDensity &base,
+                               const TextWords &words,
+                               const std::vector<char> &chars,
+                               const Lexicon &lexicon, double weight)
+    : base_(base),
+      words_(words),
+      chars_(chars),
+      lexicon_(lexicon),
+      weight_(weight) {}
+
+double LexiconDensity::word_log_prob(int w, const Permutation &permutation,
+                                     int a, int image_a, int b,
+                                     int image_b) const {
+  uint64_t hash = Lexicon::kHashSeed;
+  for (uint32_t k = words_.offsets[w]; k < words_.offsets[w + 1]; ++k) {
+    const int s = words_.symbols[k];
+    const int image = s == a ? image_a : s == b ? image_b : permutation[s];
+    hash = Lexicon::hash_char(hash, chars_[image]);
+  }
+  return lexicon_.log_prob(hash);
+}
+
+double LexiconDensity::score(const Permutation &permutation) const {
+  double word_score = 0;
+  for (size_t w = 0; w < words_.counts.size(); ++w) {
+    word_score +=
+        words_.counts[w] * word_log_prob(w, permutation, -1, 0, -1, 0);
+  }
+  return base_.score(permutation) + weight_ * word_score;
+}
+
+double LexiconDensity::word_delta(const Permutation &permutation, int a,
+                                  int b) const {
+  const int image_a = permutation[b];
+  const int image_b = permutation[a];
+  double delta = 0;
+  auto rescore = [&](int w) {
+    delta += words_.counts[w] *
+             (word_log_prob(w, permutation, a, image_a, b, image_b) -
+              word_log_prob(w, permutation, -1, 0, -1, 0));
+  };
+  for (int w : words_.by_symbol[a]) {
+    rescore(w);
+  }
+  for (int w : words_.by_symbol[b]) {
+    // Words with both symbols were rescored with a.
+    const uint8_t *begin = &words_.symbols[words_.offsets[w]];
+    const uint8_t *end = &words_.symbols[0] + words_.offsets[w + 1];
+    if (std::find(begin, end, a) == end) {
+      rescore(w);
+    }
+  }
+  return delta;
+}
+
+void LexiconDensity::swap_deltas(const Permutation &permutation,
+                                 const std::vector<int> &symbols,
+                                 DoubleMatrix &deltas,
+                                 SwapDeltaScratch &scratch) const {
+  base_.swap_deltas(permutation, symbols, deltas, scratch);
+  for (size_t x = 0; x < symbols.size(); ++x) {
+    for (size_t y = x + 1; y < symbols.size(); ++y) {
+      const int a = symbols[x];
+      const int b = symbols[y];
+      const double delta = weight_ * word_delta(permutation, a, b);
+      deltas(a, b) += delta;
+      deltas(b, a) += delta;
+    }
+  }
+}
@@ -1,52 +1,144 @@
 #include "metropolis_hastings.hpp"
 
-#include <cmath>
-#include <iostream>
-#include <random>
+namespace {
 
-#include "utils.hpp"
+// Adapts a proposal function that returns a whole new state.
+class FunctionProposal {
+ public:
+  FunctionProposal(
+      const std::function<Permutation(const Permutation &,
+                                      const std::vector<int> &, Rng &)>
+          &function,
+      const std::vector<int> &symbols)
+      : function_(function), symbols_(symbols) {}
 
-std::map<char, char> metropolis_hastings_annealing(
-    const std::map<char, char> &initial_state,
-    std::function<std::map<char, char>(const std::map<char, char> &,
-                                       const std::vector<char> &)>
+  Permutation operator()(const Permutation &state, Rng &rng) {
+    return function_(state, symbols_, rng);
+  }
+
+ private:
+  const std::function<Permutation(const Permutation &,
+                                  const std::vector<int> &, Rng &)> &function_;
+  const std::vector<int> &symbols_;
+};
+
+// Adapts a log density function that rescores the whole text.
+class FunctionDensity {
+ public:
+  FunctionDensity(
+      const std::function<double(const std::string &, const Permutation &)>
+          &function,
+      const std::string &text)
+      : function_(function), text_(text) {}
+
+  double score(const Permutation &state) { return function_(text_, state); }
+  double delta(const Permutation &, double log_prob,
+               const Permutation &proposed) {
+    return function_(text_, proposed) - log_prob;
+  }
+
+ private:
+  const std::function<double(const std::string &, const Permutation &)>
+      &function_;
+  const std::string &text_;
+};
+
+// Adapts a pair of full and incremental log density functions.
+class FunctionSwapDensity {
+ public:
+  FunctionSwapDensity(
+      const std::function<double(const Permutation &)> &score_function,
+      const std::function<double(const Permutation &, int, int)>
+          &delta_function)
+      : score_function_(score_function), delta_function_(delta_function) {}
+
+  double score(const Permutation &state) { return score_function_(state); }
+  double delta(const Permutation &state, double, const SymbolSwap &move) {
+    return delta_function_(state, move.a, move.b);
+  }
+
+ private:
+  const std::function<double(const Permutation &)> &score_function_;
+  const std::function<double(const Permutation &, int, int)> &delta_function_;
+};
+
+// Runs the engine with progress written as text every print_every
+// iterations, as these wrappers always have.
+template <typename Proposal, typename Density>
+Permutation run_with_progress(const Permutation &initial_state,
+                              Proposal &proposal, Density &density,
+                              ExponentialCooling &schedule, Rng &rng,
+                              const std::vector<char> &chars,
+                              const std::string &text, int iters,
+                              int print_every) {
+  if (print_every <= 0) {
+    return metropolis_hastings_annealing(initial_state, proposal, density,
+                                         schedule, rng, iters);
+  }
+  TelemetryOptions options;
+  options.sample_every = print_every;
+  TelemetryReporter telemetry(1, options, chars, text);
+  return metropolis_hastings_annealing(initial_state, proposal, density,
+                                       schedule, rng, iters,
+                                       &telemetry.chain(0));
+}
+
+}  // namespace
+
+Permutation metropolis_hastings_annealing(
+    const Permutation &initial_state,
+    std::function<Permutation(const Permutation &, const std::vector<int> &,
+                              Rng &)>
         proposal_function,
-    std::function<double(const std::string &, const std::map<char, char> &)>
+    std::function<double(const std::string &, const Permutation &)>
         log_density,
-    const std::vector<char> &chars, const std::string &text, int iters,
-    int print_every, double initial_temp, double final_temp) {
-  std::map<char, char> current_state = initial_state;
-  double p1 = log_density(text, current_state);
-
-  std::random_device rd;
-  std::mt19937 g(rd());
-  std::uniform_real_distribution<> dis(0.0, 1.0);
-
-  // Annealing schedule: exponential decay
-  double temp_factor = std::pow(final_temp / initial_temp, 1.0 / (iters - 1));
-  double temp = initial_temp;
-
-  for (int i = 0; i < iters; ++i) {
-    std::map<char, char> proposed_state =
-        proposal_function(current_state, chars);
-    double p2 = log_density(text, proposed_state);
-
-    // Standard Metropolis-Hastings acceptance criterion, but with
-    // temperature
-    if ((p2 - p1) / temp > std::log(dis(g))) {
-      current_state = proposed_state;
-      p1 = p2;
-    }
-
-    if (i % print_every == 0) {
-      std::cout << "Iteration " << i << " (Temp: " << temp
-                << "): " << apply_permutation(text.substr(0, 70), current_state)
-                << "..." << std::endl;
-    }
-
-    // Cool the temperature for the next iteration
-    temp *= temp_factor;
+    const std::vector<int> &symbols, const std::vector<char> &chars,
+    const std::string &text, Rng &rng, int iters, int print_every,
+    double initial_temp, double final_temp) {
+  FunctionProposal proposal(proposal_function, symbols);
+  FunctionDensity density(log_density, text);
+  ExponentialCooling schedule(initial_temp, final_temp, iters);
+  return run_with_progress(initial_state, proposal, density, schedule, rng,
+                           chars, text, iters, print_every);
+}
+
+Permutation metropolis_hastings_annealing(
+    const Permutation &initial_state,
+    std::function<double(const Permutation &)> log_density,
+    std::function<double(const Permutation &, int, int)> log_density_delta,
+    const std::vector<int> &symbols, const std::vector<char> &chars,
+    const std::string &text, Rng &rng, int iters, int print_every,
+    double initial_temp, double final_temp) {
+  if (symbols.size() < 2) {
+    return initial_state;
+  }
+  UniformSwapProposal proposal(symbols);
+  FunctionSwapDensity density(log_density, log_density_delta);
+  ExponentialCooling schedule(initial_temp, final_temp, iters);
+  return run_with_progress(initial_state, proposal, density, schedule, rng,
+                           chars, text, iters, print_every);
+}
+
+bool parse_schedule_kind(const std::string &name, ScheduleKind &kind) {
+  if (name == "exponential") {
+    kind = ScheduleKind::kExponential;
+  } else if (name == "linear") {
+    kind = ScheduleKind::kLinear;
+  } else if (name == "adaptive") {
+    kind = ScheduleKind::kAdaptive;
+  } else {
+    return false;
   }
+  return true;
+}
 
-  return current_state;
-}
\ No newline at end of file
+const char *schedule_kind_name(ScheduleKind kind) {
+  switch (kind) {
+    case ScheduleKind::kLinear:
+      return "linear";
+    case ScheduleKind::kAdaptive:
+      return "adaptive";
+    default:
+      return "exponential";
+  }
+}
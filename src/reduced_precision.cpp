@@ -0,0 +1,46 @@
+#include "reduced_precision.hpp"
+
+#include <algorithm>
+#include <limits>
+
+bool parse_score_precision(const std::string &name,
+                           ScorePrecision &precision) {
+  if (name == "double") {
+    precision = ScorePrecision::kDouble;
+  } else if (name == "float") {
+    precision = ScorePrecision::kFloat;
+  } else if (name == "int16") {
+    precision = ScorePrecision::kInt16;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *score_precision_name(ScorePrecision precision) {
+  switch (precision) {
+    case ScorePrecision::kFloat:
+      return "float";
+    case ScorePrecision::kInt16:
+      return "int16";
+    default:
+      return "double";
+  }
+}
+
+double int16_log_scale(const LanguageModel &model, long long total_count) {
+  double max_abs = 0.0;
+  for (int i = 0; i < model.size(); ++i) {
+    max_abs = std::max(max_abs, std::fabs(model.log_frequency(i)));
+    for (int j = 0; j < model.size(); ++j) {
+      max_abs = std::max(max_abs, std::fabs(model.log_transition(i, j)));
+    }
+  }
+  if (max_abs == 0.0) {
+    return 1.0;
+  }
+  const double table_limit = std::numeric_limits<int16_t>::max() / max_abs;
+  const double sum_limit = std::numeric_limits<int32_t>::max() /
+                           (8.0 * (total_count + 1) * max_abs);
+  return std::min(table_limit, sum_limit);
+}
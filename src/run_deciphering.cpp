@@ -1,27 +1,72 @@
-#include <cmath>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <limits>
-#include <mutex>
+#include <memory>
+#include <random>
 #include <thread>
 #include <vector>
 
+#include "affinity.hpp"
+#include "batch_decoder.hpp"
+#include "checkpoint.hpp"
 #include "deciphering_utils.hpp"
+#include "island.hpp"
+#include "language_model.hpp"
+#include "lexicon.hpp"
 #include "metropolis_hastings.hpp"
+#include "parallel_tempering.hpp"
+#include "population_annealing.hpp"
+#include "solver.hpp"
+#include "telemetry.hpp"
+#include "thread_pool.hpp"
+#include "translate.hpp"
 #include "utils.hpp"
 
 int main(int argc, char *argv[]) {
   std::string train_file;
+  std::string model_file;
   std::string decode_file;
   std::string output_file;
   int iters = 500000;       // Default number of iterations
   int print_every = 10000;  // Default print frequency
+  int order = 2;            // N-gram order when training with -i
+  uint64_t seed = std::random_device{}();  // Random unless -seed is given
+  bool tempering = false;  // Replica exchange instead of independent chains
+  int replicas = 0;        // One per worker thread, at least 2, by default
+  int swap_every = 1000;  // Iterations between replica exchange rounds
+  double t_min = 0.1;     // Temperature of the coldest replica
+  double t_max = 3.0;     // Temperature of the hottest replica
+  BatchOptions batch;     // Batch mode is enabled by -batch <source>
+  PopulationOptions population;  // Enabled by -population <chains>
+  IslandOptions island;  // Enabled by -coordinator or -worker <endpoint>
+  bool coordinator = false;  // Merge keys from workers instead of searching
+  ConvergenceOptions convergence;  // Early stopping rules, off by default
+  TelemetryOptions telemetry_options;  // Progress output format
+  std::string telemetry_file;          // Progress goes to stdout by default
+  std::string checkpoint_file;         // Checkpoints are off by default
+  double checkpoint_every = 60;        // Seconds between two checkpoints
+  bool resume = false;  // Continue from checkpoint_file if it exists
+  bool polish = true;   // Steepest descent on the best key after annealing
+  ScorePrecision precision = ScorePrecision::kDouble;  // Of the bigram tables
+  int n_threads = std::max(1u, std::thread::hardware_concurrency());
+  int n_chains = 0;     // Independent chains; one per thread by default
+  bool pin = false;     // Pin each worker thread to its own CPU
+  bool numa = false;    // One copy of the scoring tables per NUMA node
+  ScheduleOptions schedule_options;  // Exponential from 1 to 0.001 by default
+  bool use_lexicon = false;     // Score whole words at the end of annealing
+  double lexicon_weight = 1.0;  // Of the word score against the character one
+  double lexicon_stage = 0.2;   // The share of the schedule that uses words
+  std::string key_file;       // Decode with this key instead of searching
+  bool invert_key = false;    // The key encodes, as scramble_text writes it
 
   // Loop through command-line arguments
   for (int i = 1; i < argc; ++i) {
     std::string arg = argv[i];
     if (arg == "-i" && i + 1 < argc) {
       train_file = argv[++i];
+    } else if (arg == "-m" && i + 1 < argc) {
+      model_file = argv[++i];
     } else if (arg == "-d" && i + 1 < argc) {
       decode_file = argv[++i];
     } else if (arg == "-o" && i + 1 < argc) {
@@ -41,105 +86,796 @@ int main(int argc, char *argv[]) {
                   << std::endl;
         return 1;
       }
+    } else if (arg == "-telemetry" && i + 1 < argc) {
+      if (!parse_telemetry_format(argv[++i], telemetry_options.format)) {
+        std::cerr << "Unknown telemetry format: " << argv[i]
+                  << " (expected text or json)" << std::endl;
+        return 1;
+      }
+    } else if (arg == "-telemetry_out" && i + 1 < argc) {
+      telemetry_file = argv[++i];
+    } else if (arg == "-order" && i + 1 < argc) {
+      try {
+        order = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -order: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-seed" && i + 1 < argc) {
+      try {
+        seed = std::stoull(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -seed: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-time_limit" && i + 1 < argc) {
+      try {
+        convergence.time_limit = std::stod(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -time_limit: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-agree" && i + 1 < argc) {
+      try {
+        convergence.agree_chains = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -agree: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-patience" && i + 1 < argc) {
+      try {
+        convergence.patience = std::stoll(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -patience: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-checkpoint" && i + 1 < argc) {
+      checkpoint_file = argv[++i];
+    } else if (arg == "-checkpoint_every" && i + 1 < argc) {
+      try {
+        checkpoint_every = std::stod(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -checkpoint_every: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-resume") {
+      resume = true;
+    } else if (arg == "-precision" && i + 1 < argc) {
+      if (!parse_score_precision(argv[++i], precision)) {
+        std::cerr << "Unknown precision: " << argv[i]
+                  << " (expected double, float or int16)" << std::endl;
+        return 1;
+      }
+    } else if (arg == "-threads" && i + 1 < argc) {
+      try {
+        n_threads = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -threads: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-chains" && i + 1 < argc) {
+      try {
+        n_chains = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -chains: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-pin") {
+      pin = true;
+    } else if (arg == "-numa") {
+      pin = numa = true;
+    } else if (arg == "-no_polish") {
+      polish = false;
+    } else if (arg == "-key" && i + 1 < argc) {
+      key_file = argv[++i];
+    } else if (arg == "-invert_key") {
+      invert_key = true;
+    } else if (arg == "-batch" && i + 1 < argc) {
+      batch.source = argv[++i];
+    } else if (arg == "-out_dir" && i + 1 < argc) {
+      batch.output_dir = argv[++i];
+    } else if (arg == "-job_chains" && i + 1 < argc) {
+      try {
+        batch.chains_per_job = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -job_chains: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-pt") {
+      tempering = true;
+    } else if (arg == "-replicas" && i + 1 < argc) {
+      try {
+        replicas = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -replicas: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-swap_every" && i + 1 < argc) {
+      try {
+        swap_every = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -swap_every: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-population" && i + 1 < argc) {
+      try {
+        population.population = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -population: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-rounds" && i + 1 < argc) {
+      try {
+        population.rounds = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -rounds: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-cull" && i + 1 < argc) {
+      try {
+        population.cull_fraction = std::stod(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -cull: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-schedule" && i + 1 < argc) {
+      if (!parse_schedule_kind(argv[++i], schedule_options.kind)) {
+        std::cerr << "Unknown schedule: " << argv[i]
+                  << " (expected exponential, linear or adaptive)"
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-initial_temp" && i + 1 < argc) {
+      try {
+        schedule_options.initial_temp = std::stod(argv[++i]);
+        schedule_options.calibrate = false;
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -initial_temp: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-final_temp" && i + 1 < argc) {
+      try {
+        schedule_options.final_temp = std::stod(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -final_temp: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-initial_accept" && i + 1 < argc) {
+      try {
+        schedule_options.initial_acceptance = std::stod(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -initial_accept: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-final_accept" && i + 1 < argc) {
+      try {
+        schedule_options.final_acceptance = std::stod(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -final_accept: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-lexicon") {
+      use_lexicon = true;
+    } else if (arg == "-lexicon_weight" && i + 1 < argc) {
+      try {
+        lexicon_weight = std::stod(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -lexicon_weight: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-lexicon_stage" && i + 1 < argc) {
+      try {
+        lexicon_stage = std::stod(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -lexicon_stage: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-coordinator" && i + 1 < argc) {
+      island.endpoint = argv[++i];
+      coordinator = true;
+    } else if (arg == "-worker" && i + 1 < argc) {
+      island.endpoint = argv[++i];
+      coordinator = false;
+    } else if (arg == "-workers" && i + 1 < argc) {
+      try {
+        island.expected_workers = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -workers: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-exchange_every" && i + 1 < argc) {
+      try {
+        island.exchange_every = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -exchange_every: " << argv[i]
+                  << std::endl;
+        return 1;
+      }
+    } else if (arg == "-t_min" && i + 1 < argc) {
+      try {
+        t_min = std::stod(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -t_min: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-t_max" && i + 1 < argc) {
+      try {
+        t_max = std::stod(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -t_max: " << argv[i] << std::endl;
+        return 1;
+      }
     }
   }
 
   // Check if required arguments were provided
-  if (train_file.empty() || decode_file.empty()) {
+  if ((train_file.empty() && model_file.empty() && key_file.empty()) ||
+      (decode_file.empty() && batch.source.empty()) || order < 2 ||
+      order > kMaxNgramOrder) {
     std::cerr << "Usage: " << argv[0]
-              << " -i <inputfile> -d <decodefile> [-iters <number>] "
-                 "[-print_every <number>]"
+              << " (-i <inputfile> [-order <2-4>] | -m <modelfile> | "
+                 "-key <keyfile> [-invert_key]) "
+                 "(-d <decodefile> | "
+                 "-batch <dir|manifest|-> [-out_dir <dir>] "
+                 "[-job_chains <number>]) [-iters <number> | "
+                 "-time_limit <seconds>] [-agree <chains>] "
+                 "[-patience <iterations>] "
+                 "[-print_every <number>] [-telemetry <text|json>] "
+                 "[-telemetry_out <file>] [-seed <number>] "
+                 "[-precision <double|float|int16>] [-no_polish] "
+                 "[-schedule <exponential|linear|adaptive>] "
+                 "[-initial_temp <temp>] [-final_temp <temp>] "
+                 "[-initial_accept <rate>] [-final_accept <rate>] "
+                 "[-lexicon [-lexicon_weight <weight>] "
+                 "[-lexicon_stage <fraction>]] "
+                 "[-threads <number>] [-chains <number>] [-pin] [-numa] "
+                 "[-checkpoint <file> [-checkpoint_every <seconds>] "
+                 "[-resume]] [-pt "
+                 "[-replicas <number>] [-swap_every <number>] "
+                 "[-t_min <temp>] [-t_max <temp>] | "
+                 "-population <chains> [-rounds <number>] "
+                 "[-cull <fraction>] | "
+                 "-coordinator <endpoint> [-workers <number>] | "
+                 "-worker <endpoint> [-exchange_every <number>]]"
+              << std::endl;
+    return 1;
+  }
+  if (!checkpoint_file.empty() &&
+      (tempering || convergence.time_limit > 0 || !batch.source.empty())) {
+    std::cerr << "-checkpoint needs independent chains with a fixed "
+                 "-iters budget; it cannot be combined with -pt, "
+                 "-time_limit or -batch."
+              << std::endl;
+    return 1;
+  }
+  if (tempering && numa) {
+    std::cerr << "-numa cannot be combined with -pt; the replicas share one "
+                 "copy of the scoring tables."
+              << std::endl;
+    return 1;
+  }
+  if (population.population > 0 &&
+      (tempering || convergence.time_limit > 0 || !checkpoint_file.empty() ||
+       !batch.source.empty())) {
+    std::cerr << "-population needs a fixed -iters budget; it cannot be "
+                 "combined with -pt, -time_limit, -checkpoint or -batch."
+              << std::endl;
+    return 1;
+  }
+  if (population.population > 0 &&
+      (population.population < 2 || population.rounds < 1 ||
+       population.cull_fraction < 0 || population.cull_fraction >= 1)) {
+    std::cerr << "-population needs at least 2 chains, -rounds at least 1 "
+                 "and -cull in [0, 1)."
+              << std::endl;
+    return 1;
+  }
+  if (!island.endpoint.empty() &&
+      (tempering || population.population > 0 ||
+       convergence.time_limit > 0 || !checkpoint_file.empty() ||
+       !batch.source.empty() || !key_file.empty())) {
+    std::cerr << "-coordinator and -worker need a fixed -iters budget; they "
+                 "cannot be combined with -pt, -population, -time_limit, "
+                 "-checkpoint, -batch or -key."
+              << std::endl;
+    return 1;
+  }
+  if (!island.endpoint.empty() &&
+      (island.expected_workers < 1 || island.exchange_every < 2 ||
+       iters < 2)) {
+    std::cerr << "-workers must be at least 1, and -exchange_every and "
+                 "-iters at least 2."
+              << std::endl;
+    return 1;
+  }
+  if (schedule_options.kind != ScheduleKind::kExponential &&
+      (tempering || population.population > 0 || !island.endpoint.empty() ||
+       convergence.time_limit > 0 || use_lexicon)) {
+    std::cerr << "-schedule linear and adaptive apply to fixed-budget "
+                 "chains; they cannot be combined with -pt, -population, "
+                 "-coordinator, -worker, -time_limit or -lexicon."
+              << std::endl;
+    return 1;
+  }
+  if (schedule_options.kind == ScheduleKind::kAdaptive &&
+      !checkpoint_file.empty()) {
+    std::cerr << "-schedule adaptive cannot be checkpointed." << std::endl;
+    return 1;
+  }
+  if (schedule_options.initial_temp <= 0 ||
+      schedule_options.final_temp <= 0 ||
+      schedule_options.initial_acceptance <= 0 ||
+      schedule_options.initial_acceptance >= 1 ||
+      schedule_options.final_acceptance <= 0 ||
+      schedule_options.final_acceptance >= 1) {
+    std::cerr << "Temperatures must be positive and acceptance rates in "
+                 "(0, 1)."
+              << std::endl;
+    return 1;
+  }
+  population.initial_temp = island.initial_temp =
+      schedule_options.initial_temp;
+  population.final_temp = island.final_temp = schedule_options.final_temp;
+  if (use_lexicon &&
+      (tempering || population.population > 0 || !island.endpoint.empty() ||
+       convergence.time_limit > 0 || !checkpoint_file.empty() ||
+       !batch.source.empty())) {
+    std::cerr << "-lexicon applies to independent chains with a fixed -iters "
+                 "budget; it cannot be combined with -pt, -population, "
+                 "-coordinator, -worker, -time_limit, -checkpoint or -batch."
+              << std::endl;
+    return 1;
+  }
+  if (use_lexicon &&
+      (lexicon_stage <= 0 || lexicon_stage >= 1 || iters < 4)) {
+    std::cerr << "-lexicon_stage must be in (0, 1) and -iters at least 4."
+              << std::endl;
+    return 1;
+  }
+  if (n_threads < 1 || n_chains < 0) {
+    std::cerr << "-threads must be at least 1 and -chains positive."
+              << std::endl;
+    return 1;
+  }
+  if (convergence.time_limit > 0 && n_chains > n_threads) {
+    std::cerr << "-time_limit runs every chain at once; use at most "
+                 "-threads chains."
               << std::endl;
     return 1;
   }
+  if (resume && checkpoint_file.empty()) {
+    std::cerr << "-resume needs -checkpoint <file>." << std::endl;
+    return 1;
+  }
+
+  // With a known key there is nothing to search for: stream the ciphertext
+  // through the key, so files of any size decode in constant memory.
+  if (!key_file.empty()) {
+    if (decode_file.empty()) {
+      std::cerr << "-key needs -d <decodefile>." << std::endl;
+      return 1;
+    }
+    const std::vector<char> az_chars = az_list();
+    Permutation key =
+        load_permutation_map(key_file, get_char_to_ix(az_chars));
+    if (invert_key) {
+      Permutation inverse(az_chars.size());
+      for (size_t i = 0; i < az_chars.size(); ++i) {
+        inverse.set(i, key.inverse(i));
+      }
+      key = inverse;
+    }
+    return translate_file(ByteTranslator(key, az_chars, true), decode_file,
+                          output_file.empty() ? "-" : output_file)
+               ? 0
+               : 1;
+  }
 
-  std::string train_text, decode_text;
-  read_file(train_file, train_text);
+  // Load a pre-trained model if one was given, otherwise train from scratch
+  LanguageModel model;
+  if (!model_file.empty()) {
+    if (!load_language_model(model_file, model)) {
+      return 1;
+    }
+  } else if (!train_language_model_from_file(train_file, n_threads, model,
+                                             order)) {
+    return 1;
+  }
+
+  // The lexicon is cached next to a model file, or built from the corpus.
+  Lexicon lexicon;
+  if (use_lexicon) {
+    if (!model_file.empty()) {
+      if (!load_lexicon(lexicon_file_name(model_file), lexicon)) {
+        std::cerr << "Write a lexicon with train_model -lexicon." << std::endl;
+        return 1;
+      }
+    } else if (!build_lexicon_from_file(train_file, lexicon)) {
+      return 1;
+    }
+    std::cout << "Loaded a lexicon of " << lexicon.size() << " words."
+              << std::endl;
+  }
+
+  // Batch mode decodes many ciphertexts with the one loaded model
+  if (!batch.source.empty()) {
+    batch.iters = iters;
+    batch.seed = seed;
+    batch.polish = polish;
+    batch.precision = precision;
+    batch.schedule = schedule_options;
+    batch.n_threads = n_threads;
+    return decode_batch(model, batch) < 0 ? 1 : 0;
+  }
+
+  std::string decode_text;
   read_file(decode_file, decode_text);
 
-  std::vector<char> model_chars = get_chars_from_text(train_text);
-  auto char_to_ix = get_char_to_ix(model_chars);
-  auto freq_stats =
-      get_frequency_statistics(train_text, model_chars, char_to_ix);
-  auto trans_matrix =
-      get_transition_matrix(train_text, model_chars, char_to_ix);
-  std::vector<char> az_chars = az_list();
-
-  // Pre-calculate logs of the statistics
-  std::vector<double> log_freq_stats = freq_stats;
-  for (double &val : log_freq_stats) {
-    // Add a small epsilon to avoid log(0) which is -infinity
-    val = std::log(val + 1e-10);
-  }
-
-  std::vector<std::vector<double> > log_trans_matrix = trans_matrix;
-  for (auto &row : log_trans_matrix) {
-    for (double &val : row) {
-      val = std::log(val + 1e-10);
-    }
-  }
-
-  // Pre-calculate the transition counts of the text to decode
-  TransitionCounts decode_text_counts =
-      compute_transition_counts(decode_text, char_to_ix);
-  char first_char = decode_text.empty() ? ' ' : decode_text[0];
-
-  // The log density function uses the pre-calculated counts
-  auto log_density_func = [&](const std::string &text,
-                              const std::map<char, char> &p_map) {
-    // The text parameter is ignored, but kept to match the function
-    // signature required by metropolis_hastings_annealing.
-    return compute_log_probability_by_counts(decode_text_counts, first_char,
-                                             p_map, char_to_ix, log_freq_stats,
-                                             log_trans_matrix);
-  };
-
-  int n_chains = std::thread::hardware_concurrency();
-  std::vector<std::thread> threads;
-  std::map<char, char> best_permutation;
+  // Chains report progress through telemetry rather than writing to stdout.
+  telemetry_options.sample_every = std::max(print_every, 0);
+  std::ofstream telemetry_stream;
+  if (!telemetry_file.empty()) {
+    telemetry_stream.open(telemetry_file);
+    if (!telemetry_stream.is_open()) {
+      std::cerr << "Could not open telemetry file: " << telemetry_file
+                << std::endl;
+      return 1;
+    }
+  }
+  std::ostream &telemetry_out =
+      telemetry_file.empty() ? std::cout : telemetry_stream;
+
+  const std::vector<char> &model_chars = model.chars();
+  const std::map<char, int> &char_to_ix = model.char_to_ix();
+  // The letters of the alphabet are the symbols the chains may permute.
+  std::vector<int> az_symbols = get_symbol_indices(az_list(), char_to_ix);
+
+  // A resumed run takes its seed, budget, chain count, schedule and scoring
+  // precision from the checkpoint, whatever the command line says. The
+  // checkpoint is read before the scoring tables are built, so they are
+  // built at the precision it was written with.
+  RunCheckpoint checkpoint;
+  bool resuming = false;
+  if (resume) {
+    std::ifstream probe(checkpoint_file);
+    if (!probe.is_open()) {
+      std::cout << "No checkpoint at " << checkpoint_file
+                << ", starting a new run." << std::endl;
+    } else if (!load_checkpoint(checkpoint_file, checkpoint)) {
+      return 1;
+    } else if (checkpoint.text_hash !=
+                   checkpoint_text_hash(decode_text, model_chars) ||
+               checkpoint.n_chars != static_cast<int>(model_chars.size())) {
+      std::cerr << "Checkpoint " << checkpoint_file
+                << " was written for a different text or model." << std::endl;
+      return 1;
+    } else {
+      resuming = true;
+      seed = checkpoint.seed;
+      iters = checkpoint.iters;
+      n_chains = checkpoint.chains.size();
+      schedule_options.kind = checkpoint.schedule;
+      schedule_options.initial_temp = checkpoint.initial_temp;
+      schedule_options.final_temp = checkpoint.final_temp;
+      precision = checkpoint.precision;
+    }
+  }
+
+  // The log density uses the bigram or n-gram counts of the text to decode,
+  // pre-calculated at the model's order. Swap proposals are scored
+  // incrementally from the counts that contain the two swapped symbols.
+  NgramDensity density(decode_text, model, precision);
+  if (density.precision() != precision) {
+    std::cout << "No " << score_precision_name(precision)
+              << " tables for this model; scoring in "
+              << score_precision_name(density.precision()) << "."
+              << std::endl;
+  }
+
+  const TextWords text_words =
+      use_lexicon ? compute_text_words(decode_text, model_chars) : TextWords();
+
+  Permutation best_permutation(model_chars.size());
   double max_log_prob = -std::numeric_limits<double>::infinity();
-  std::mutex mtx;
 
-  std::cout << "Starting " << n_chains
-            << " parallel MCMC chains with Simulated Annealing..." << std::endl;
+  // With a time limit the chains run until the convergence board stops them.
+  const bool timed = convergence.time_limit > 0;
+  if (timed) {
+    iters = std::numeric_limits<int>::max();
+  }
+
+  if (tempering) {
+    // Every replica needs its own thread, since they meet at a barrier.
+    replicas = std::max(replicas > 0 ? replicas : n_threads, 2);
+    swap_every = std::max(swap_every, 1);
+    std::vector<double> temperatures =
+        geometric_temperature_ladder(replicas, t_min, t_max);
+    std::vector<Rng> rngs;
+    std::vector<Permutation> initial_states;
+    for (int k = 0; k < replicas; ++k) {
+      rngs.push_back(Rng::stream(seed, k));
+      initial_states.push_back(
+          generate_random_permutation(model_chars, rngs[k]));
+    }
+
+    std::cout << "Starting parallel tempering with " << replicas
+              << " replicas from temperature " << t_min << " to " << t_max
+              << " (seed " << seed << ")..." << std::endl;
+
+    UniformSwapProposal proposal(az_symbols);
+    ConvergenceBoard board(1, convergence);
+    TelemetryReporter telemetry(replicas, telemetry_options, model_chars,
+                                decode_text, telemetry_out);
+    TemperingResult result = parallel_tempering(
+        initial_states, proposal, density, temperatures, rngs, iters,
+        swap_every, &telemetry, &board,
+        pin ? available_cpus() : std::vector<int>());
+    telemetry.stop();
+    if (board.stopped()) {
+      std::cout << "\nStopped early: " << stop_reason_name(board.stop_reason())
+                << std::endl;
+    }
+    best_permutation = result.best_state;
+    max_log_prob = density.score(best_permutation);
+
+    std::cout << "\nReplica exchange acceptance:" << std::endl;
+    for (size_t k = 0; k < result.swap_attempts.size(); ++k) {
+      long long attempts = result.swap_attempts[k];
+      long long accepts = result.swap_accepts[k];
+      std::cout << "  T " << temperatures[k] << " <-> " << temperatures[k + 1]
+                << ": " << accepts << "/" << attempts << " ("
+                << (attempts ? 100.0 * accepts / attempts : 0.0) << "%)"
+                << std::endl;
+    }
+  } else if (!island.endpoint.empty()) {
+    // Workers only talk to a coordinator decoding the same text with the
+    // same alphabet.
+    island.text_hash = checkpoint_text_hash(decode_text, model_chars);
+    island.n_chars = model_chars.size();
+    IslandResult result;
+    if (coordinator) {
+      if (!run_island_coordinator(island, result)) {
+        return 1;
+      }
+    } else {
+      island.iters = iters;
+      island.n_chains = n_chains > 0 ? n_chains : n_threads;
+      island.seed = seed;
+      std::cout << "Starting " << island.n_chains << " chains on "
+                << n_threads << " threads as a worker of " << island.endpoint
+                << ", exchanging every " << island.exchange_every
+                << " iterations (seed " << seed << ")..." << std::endl;
+      ThreadPool pool(n_threads, pin ? available_cpus() : std::vector<int>());
+      if (!run_island_worker(density, model_chars, az_symbols, island, pool,
+                             result)) {
+        return 1;
+      }
+    }
+    best_permutation = result.best_state;
+    max_log_prob = density.score(best_permutation);
+  } else if (population.population > 0) {
+    // The population shares the budget of one chain per thread, so it
+    // costs about as much wall-clock time as the default run.
+    n_chains = population.population;
+    const int chain_iters =
+        std::max(2LL * population.rounds,
+                 static_cast<long long>(iters) * n_threads / n_chains);
+    std::vector<Rng> rngs;
+    std::vector<Permutation> initial_states;
+    for (int i = 0; i < n_chains; ++i) {
+      rngs.push_back(Rng::stream(seed, i));
+      initial_states.push_back(
+          generate_random_permutation(model_chars, rngs[i]));
+    }
+
+    std::cout << "Starting a population of " << n_chains
+              << " annealing chains on " << n_threads << " threads, "
+              << population.rounds << " rounds of " << chain_iters
+              << " iterations per chain (seed " << seed << ")..." << std::endl;
 
-  for (int i = 0; i < n_chains; ++i) {
-    threads.emplace_back([&, i]() {
-      std::cout << "--- Chain " << i + 1 << " starting ---" << std::endl;
-      auto initial_permutation = generate_random_permutation_map(model_chars);
+    ThreadPool pool(n_threads, pin ? available_cpus() : std::vector<int>());
+    UniformSwapProposal proposal(az_symbols);
+    ConvergenceBoard board(n_chains, convergence);
+    TelemetryReporter telemetry(n_chains, telemetry_options, model_chars,
+                                decode_text, telemetry_out);
+    PopulationResult result = population_annealing(
+        initial_states, proposal, density, rngs, chain_iters, az_symbols,
+        population, pool, &board, &telemetry, &std::cout);
+    telemetry.stop();
+    if (board.stopped()) {
+      std::cout << "Stopped early: " << stop_reason_name(board.stop_reason())
+                << std::endl;
+    }
+    std::cout << "Respawned " << result.respawned << " chains." << std::endl;
+    best_permutation = result.best_state;
+    max_log_prob = result.best_log_prob;
+  } else {
+    if (n_chains == 0) {
+      n_chains = n_threads;
+    }
 
-      auto final_chain_permutation = metropolis_hastings_annealing(
-          initial_permutation, propose_move, log_density_func, az_chars,
-          decode_text, iters, print_every);
+    if (!resuming) {
+      checkpoint.seed = seed;
+      checkpoint.iters = iters;
+      checkpoint.schedule = schedule_options.kind;
+      checkpoint.initial_temp = schedule_options.initial_temp;
+      checkpoint.final_temp = schedule_options.final_temp;
+      checkpoint.precision = precision;
+      checkpoint.text_hash = checkpoint_text_hash(decode_text, model_chars);
+      checkpoint.n_chars = model_chars.size();
+      checkpoint.chains.resize(n_chains);
+      // Chains still queued for a thread are saved at the state they will
+      // start from, so a resumed run starts them exactly as this one would.
+      if (!checkpoint_file.empty()) {
+        for (int i = 0; i < n_chains; ++i) {
+          ChainCheckpoint &start = checkpoint.chains[i];
+          Rng rng;
+          start.state = chain_start(model_chars, seed, i, rng);
+          start.rng_state = rng.state();
+          start.log_prob = start.best_log_prob = density.score(start.state);
+          start.temperature = schedule_options.initial_temp;
+        }
+      }
+    }
 
-      double final_log_prob =
-          log_density_func(decode_text, final_chain_permutation);
+    ConvergenceBoard board(n_chains, convergence);
 
-      // Lock the mutex before accessing shared variables
-      std::lock_guard<std::mutex> lock(mtx);
-      std::cout << "\n--- Chain " << i + 1
-                << " finished with log probability: " << final_log_prob
-                << " ---\n"
+    // Pinned workers take the available CPUs in order. With -numa every
+    // node gets its own density, built by a thread pinned to that node so
+    // the kernel places the tables there on first touch.
+    const std::vector<int> cpus = pin ? available_cpus() : std::vector<int>();
+    std::vector<int> worker_nodes(n_threads, 0);
+    std::vector<std::unique_ptr<NgramDensity>> replicas;
+    if (numa) {
+      std::vector<int> node_cpus;
+      for (int w = 0; w < n_threads; ++w) {
+        const int cpu = cpus[w % cpus.size()];
+        worker_nodes[w] = cpu_numa_node(cpu);
+        if (worker_nodes[w] >= static_cast<int>(node_cpus.size())) {
+          node_cpus.resize(worker_nodes[w] + 1, -1);
+        }
+        if (node_cpus[worker_nodes[w]] < 0) {
+          node_cpus[worker_nodes[w]] = cpu;
+        }
+      }
+      replicas.resize(node_cpus.size());
+      std::vector<std::thread> builders;
+      for (size_t node = 0; node < node_cpus.size(); ++node) {
+        if (node_cpus[node] >= 0) {
+          builders.emplace_back([&, node]() {
+            pin_current_thread(node_cpus[node]);
+            replicas[node].reset(
+                new NgramDensity(decode_text, model, precision, true));
+          });
+        }
+      }
+      for (auto &th : builders) {
+        th.join();
+      }
+      std::cout << "Built scoring tables on " << builders.size()
+                << " NUMA node(s)." << std::endl;
+    }
+
+    if (resuming) {
+      std::cout << "Resuming " << n_chains << " parallel MCMC chains from "
+                << checkpoint_file << " (seed " << seed << ")..."
+                << std::endl;
+    } else {
+      std::cout << "Starting " << n_chains
+                << " parallel MCMC chains with Simulated Annealing on "
+                << n_threads << " threads (seed " << seed << ")..."
                 << std::endl;
-      // std::cout << apply_permutation(decode_text, final_chain_permutation)
-      // << std::endl;
+    }
+    if (schedule_options.kind != ScheduleKind::kExponential) {
+      std::cout << "Cooling schedule: "
+                << schedule_kind_name(schedule_options.kind) << std::endl;
+    }
+    TelemetryReporter telemetry(n_chains, telemetry_options, model_chars,
+                                decode_text, telemetry_out);
+    std::unique_ptr<CheckpointWriter> checkpoints;
+    if (!checkpoint_file.empty()) {
+      checkpoints.reset(
+          new CheckpointWriter(checkpoint_file, checkpoint, checkpoint_every));
+    }
 
-      if (final_log_prob > max_log_prob) {
-        max_log_prob = final_log_prob;
-        best_permutation = final_chain_permutation;
+    // Each chain reports into its own cache line rather than a shared best
+    // behind a mutex; the best is picked once every chain is done.
+    struct alignas(64) ChainResult {
+      Permutation state;
+      double log_prob = -std::numeric_limits<double>::infinity();
+    };
+    std::vector<ChainResult> results(n_chains);
+
+    DecodeOptions chain_options;
+    chain_options.iters = iters;
+    chain_options.seed = seed;
+    chain_options.schedule = schedule_options;
+    const LexiconStage word_stage{lexicon, text_words, lexicon_weight,
+                                  lexicon_stage};
+
+    ThreadPool pool(n_threads, cpus);
+    for (int i = 0; i < n_chains; ++i) {
+      pool.submit([&, i]() {
+        const NgramDensity &chain_density =
+            replicas.empty()
+                ? density
+                : *replicas[worker_nodes[ThreadPool::current_worker()]];
+        ChainHooks hooks;
+        hooks.telemetry = &telemetry.chain(i);
+        hooks.board = &board;
+        hooks.checkpoints = checkpoints.get();
+        hooks.resume = resuming ? &checkpoint.chains[i] : nullptr;
+        hooks.lexicon = use_lexicon ? &word_stage : nullptr;
+        results[i].log_prob =
+            anneal_chain(chain_density, model_chars, az_symbols,
+                         chain_options, i, hooks, results[i].state);
+      });
+    }
+    pool.wait();
+
+    for (const ChainResult &result : results) {
+      if (result.log_prob > max_log_prob) {
+        max_log_prob = result.log_prob;
+        best_permutation = result.state;
       }
-    });
+    }
+    telemetry.stop();
+    if (checkpoints) {
+      checkpoints->stop();
+    }
+    if (board.stopped()) {
+      std::cout << "Stopped early: " << stop_reason_name(board.stop_reason())
+                << std::endl;
+    }
   }
 
-  for (auto &th : threads) {
-    th.join();
+  // The result is judged by the double character score, whatever tables
+  // steered the search and whether words were blended in.
+  std::unique_ptr<NgramDensity> exact_storage;
+  const NgramDensity &exact =
+      exact_density(density, decode_text, model, exact_storage);
+  if (exact_storage || use_lexicon) {
+    max_log_prob = exact.score(best_permutation);
+  }
+
+  // Annealing can end a swap or two short of the optimum; finish the best
+  // key off with deterministic steepest descent.
+  if (polish) {
+    // With a lexicon the polish keeps scoring whole words too.
+    const int swaps =
+        use_lexicon
+            ? steepest_descent_polish(
+                  best_permutation,
+                  LexiconDensity(exact, text_words, model_chars, lexicon,
+                                 lexicon_weight),
+                  az_symbols)
+            : steepest_descent_polish(best_permutation, exact, az_symbols);
+    if (swaps > 0) {
+      const double polished_log_prob = exact.score(best_permutation);
+      std::cout << "\nPolishing applied " << swaps << " swaps (log prob "
+                << max_log_prob << " -> " << polished_log_prob << ")"
+                << std::endl;
+      max_log_prob = polished_log_prob;
+    }
   }
 
   std::cout << "\n*************************************************************"
                "*******************\n"
             << std::endl;
   std::cout << "Best Deciphered Text (log prob: " << max_log_prob << "):\n\n\n"
-            << apply_permutation(decode_text, best_permutation) << "\n\n"
+            << apply_permutation(decode_text, best_permutation, model_chars)
+            << "\n\n"
             << std::endl;
   std::cout << "***************************************************************"
                "*****************"
@@ -149,13 +885,10 @@ int main(int argc, char *argv[]) {
   if (!output_file.empty()) {
     std::cout << "\nSaving best deciphered text to " << output_file << "..."
               << std::endl;
-    std::ofstream out_f(output_file);
-    if (!out_f.is_open()) {
-      std::cerr << "Error: Could not open file to save output: " << output_file
-                << std::endl;
-    } else {
-      out_f << apply_permutation(decode_text, best_permutation);
-      out_f.close();
+    // Stream the ciphertext from disk rather than translating the copy in
+    // memory, joining its lines the way read_file did.
+    if (translate_file(ByteTranslator(best_permutation, model_chars, true),
+                       decode_file, output_file)) {
       std::cout << "Successfully saved to " << output_file << std::endl;
     }
   }
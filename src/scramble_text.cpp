@@ -1,14 +1,17 @@
 #include <fstream>
 #include <iostream>
+#include <random>
 #include <string>
 #include <vector>
 
+#include "translate.hpp"
 #include "utils.hpp"
 
 int main(int argc, char *argv[]) {
   std::string input_file;
   std::string output_file;
   std::string key_file;
+  uint64_t seed = std::random_device{}();
 
   // Command-line argument parsing
   for (int i = 1; i < argc; ++i) {
@@ -19,49 +22,57 @@ int main(int argc, char *argv[]) {
       output_file = argv[++i];
     } else if (arg == "-k" && i + 1 < argc) {
       key_file = argv[++i];
+    } else if (arg == "-seed" && i + 1 < argc) {
+      try {
+        seed = std::stoull(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -seed: " << argv[i] << std::endl;
+        return 1;
+      }
     }
   }
 
   if (input_file.empty() || output_file.empty() || key_file.empty()) {
     std::cerr << "Usage: " << argv[0]
-              << " -i <input_file> -o <output_file> -k <key_file>" << std::endl;
+              << " -i <input_file> -o <output_file> -k <key_file> "
+                 "[-seed <number>]"
+              << std::endl;
     std::cerr << "  -i: The text file to encode." << std::endl;
     std::cerr << "  -o: The file to write the secret message to." << std::endl;
     std::cerr << "  -k: The file to save the cipher key to." << std::endl;
+    std::cerr << "  -seed: Seed for the key, for reproducible runs."
+              << std::endl;
     return 1;
   }
 
-  // Read the source text
-  std::string text;
-  read_file(input_file, text);
-  if (text.empty()) {
+  // The text is streamed through the key rather than read whole, so only
+  // check up front that there is something to encode.
+  std::ifstream probe(input_file, std::ios::binary);
+  if (!probe.is_open() || probe.peek() == std::ifstream::traits_type::eof()) {
     std::cerr << "Input file is empty or could not be read." << std::endl;
     return 1;
   }
+  probe.close();
 
   // Generate a random permutation key
   std::vector<char> az_chars = az_list();
-  std::map<char, char> p_map = generate_random_permutation_map(az_chars);
+  Rng rng(seed);
+  Permutation permutation = generate_random_permutation(az_chars, rng);
 
   std::cout << "Generated a new random key." << std::endl;
-  print_permutation_map(p_map);
+  print_permutation_map(permutation, az_chars);
 
-  // Apply the permutation to scramble the text
-  std::string scrambled_text = apply_permutation(text, p_map);
-
-  // Write the scrambled text to the output file
-  std::ofstream out_file(output_file);
-  if (!out_file.is_open()) {
-    std::cerr << "Could not open output file: " << output_file << std::endl;
+  // Scramble the text chunk by chunk straight into the output file, with
+  // newlines joined as read_file joins them
+  if (!translate_file(ByteTranslator(permutation, az_chars, true), input_file,
+                      output_file)) {
     return 1;
   }
-  out_file << scrambled_text;
-  out_file.close();
   std::cout << "Successfully saved scrambled text to " << output_file
             << std::endl;
 
   // Save the key to its own file
-  save_permutation_map(p_map, key_file);
+  save_permutation_map(permutation, az_chars, key_file);
 
   return 0;
 }
@@ -0,0 +1,238 @@
+#include "solver.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <iostream>
+
+#include "deciphering_utils.hpp"
+#include "metropolis_hastings.hpp"
+#include "translate.hpp"
+#include "utils.hpp"
+
+// The buffers of one decode call, kept for the next call at the same
+// precision.
+struct Solver::Session {
+  Session(const LanguageModel &model, ScorePrecision precision)
+      : requested(precision), density("", model, precision) {}
+
+  ScorePrecision requested;
+  NgramDensity density;
+  // Only for reduced precision: the double density the key is judged with.
+  std::unique_ptr<NgramDensity> exact;
+  std::vector<Permutation> chain_states;
+  std::vector<double> chain_log_probs;
+  // The polish's swap deltas and their working matrices.
+  DoubleMatrix polish_deltas;
+  SwapDeltaScratch polish_scratch;
+  // Counts the chains still running; the caller waits for zero.
+  std::mutex mutex;
+  std::condition_variable done;
+  int chains_remaining = 0;
+  // The first error a chain threw, if any; a task must not let it escape
+  // into the pool.
+  bool failed = false;
+  std::string error;
+};
+
+Permutation chain_start(const std::vector<char> &chars, uint64_t seed,
+                        int chain, Rng &rng) {
+  // Every chain draws from its own non-overlapping stream of the seed.
+  rng = Rng::stream(seed, chain);
+  return generate_random_permutation(chars, rng);
+}
+
+double anneal_chain(const NgramDensity &density,
+                    const std::vector<char> &chars,
+                    const std::vector<int> &symbols,
+                    const DecodeOptions &options, int chain,
+                    const ChainHooks &hooks, Permutation &key) {
+  Rng rng;
+  const Permutation initial = chain_start(chars, options.seed, chain, rng);
+  const ChainCheckpoint *resume = hooks.resume;
+  if (resume != nullptr) {
+    rng.set_state(resume->rng_state);
+  }
+  UniformSwapProposal proposal(symbols);
+  const ScheduleOptions &schedule_options = options.schedule;
+
+  if (hooks.board != nullptr && hooks.board->time_limit() > 0) {
+    TimedExponentialCooling schedule(schedule_options.initial_temp,
+                                     schedule_options.final_temp,
+                                     hooks.board->time_limit());
+    key = metropolis_hastings_annealing(initial, proposal, density, schedule,
+                                        rng, options.iters, hooks.telemetry,
+                                        hooks.board, chain);
+    return density.score(key);
+  }
+
+  if (hooks.lexicon != nullptr) {
+    const LexiconStage &stage = *hooks.lexicon;
+    // The schedule is split where the words are blended in; the word stage
+    // continues it at the temperature reached.
+    const int iters = options.iters;
+    const int word_iters = std::min(
+        iters - 2, std::max(2, static_cast<int>(iters * stage.fraction)));
+    const int char_iters = iters - word_iters;
+    const double switch_temp =
+        schedule_options.initial_temp *
+        std::pow(schedule_options.final_temp / schedule_options.initial_temp,
+                 static_cast<double>(char_iters) / iters);
+    // Both stages report and publish as one run of iters iterations.
+    // Blended scores sit far below character ones, so in the word stage
+    // the shared best stops rising and patience counts from the switch.
+    ChainProgress progress;
+    progress.last = false;
+    ExponentialCooling schedule(schedule_options.initial_temp, switch_temp,
+                                char_iters);
+    const Permutation annealed = metropolis_hastings_annealing(
+        initial, proposal, density, schedule, rng, char_iters,
+        hooks.telemetry, hooks.board, chain, nullptr, nullptr, &progress);
+    const LexiconDensity word_density(density, stage.words, chars,
+                                      stage.lexicon, stage.weight);
+    ExponentialCooling word_schedule(switch_temp, schedule_options.final_temp,
+                                     word_iters);
+    progress.last = true;
+    key = metropolis_hastings_annealing(
+        annealed, proposal, word_density, word_schedule, rng, word_iters,
+        hooks.telemetry, hooks.board, chain, nullptr, nullptr, &progress);
+    // The best chain is picked by the blended score.
+    return word_density.score(key);
+  }
+
+  key = run_with_schedule(
+      schedule_options, options.iters, initial, proposal, density, rng,
+      [&](auto &schedule) {
+        if (resume != nullptr) {
+          schedule.set_temperature(resume->temperature);
+        }
+        return metropolis_hastings_annealing(
+            initial, proposal, density, schedule, rng, options.iters,
+            hooks.telemetry, hooks.board, chain, hooks.checkpoints, resume);
+      });
+  return density.score(key);
+}
+
+const NgramDensity &exact_density(const NgramDensity &density,
+                                  const std::string &text,
+                                  const LanguageModel &model,
+                                  std::unique_ptr<NgramDensity> &exact) {
+  if (density.precision() == ScorePrecision::kDouble) {
+    return density;
+  }
+  if (exact) {
+    exact->reset(text);
+  } else {
+    exact.reset(new NgramDensity(text, model));
+  }
+  return *exact;
+}
+
+Solver::Solver(LanguageModel model, int n_threads)
+    : model_(std::move(model)),
+      symbols_(get_symbol_indices(az_list(), model_.char_to_ix())),
+      pool_(std::max(1, n_threads)) {}
+
+Solver::~Solver() = default;
+
+std::unique_ptr<Solver::Session> Solver::acquire_session(
+    ScorePrecision precision) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t k = 0; k < idle_sessions_.size(); ++k) {
+      if (idle_sessions_[k]->requested == precision) {
+        std::unique_ptr<Session> session = std::move(idle_sessions_[k]);
+        idle_sessions_.erase(idle_sessions_.begin() + k);
+        return session;
+      }
+    }
+  }
+  return std::unique_ptr<Session>(new Session(model_, precision));
+}
+
+void Solver::release_session(std::unique_ptr<Session> session) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  idle_sessions_.push_back(std::move(session));
+}
+
+bool Solver::decode(const std::string &ciphertext,
+                    const DecodeOptions &options, DecodeResult &result) {
+  if (options.iters < 2 || options.chains < 1) {
+    std::cerr << "decode needs at least 2 iterations and 1 chain."
+              << std::endl;
+    return false;
+  }
+  const auto start = std::chrono::steady_clock::now();
+  std::unique_ptr<Session> session = acquire_session(options.precision);
+  Session &s = *session;
+  s.density.reset(ciphertext);
+  s.chain_states.resize(options.chains);
+  s.chain_log_probs.resize(options.chains);
+  s.chains_remaining = options.chains;
+  s.failed = false;
+
+  for (int c = 0; c < options.chains; ++c) {
+    pool_.submit([this, &s, &options, c]() {
+      bool chain_failed = false;
+      std::string error;
+      try {
+        s.chain_log_probs[c] =
+            anneal_chain(s.density, model_.chars(), symbols_, options, c,
+                         ChainHooks(), s.chain_states[c]);
+      } catch (const std::exception &e) {
+        chain_failed = true;
+        error = e.what();
+      } catch (...) {
+        chain_failed = true;
+        error = "unknown error";
+      }
+
+      // Counted down whatever happened, so the caller never waits forever.
+      std::lock_guard<std::mutex> lock(s.mutex);
+      if (chain_failed && !s.failed) {
+        s.failed = true;
+        s.error = error;
+      }
+      if (--s.chains_remaining == 0) {
+        s.done.notify_all();
+      }
+    });
+  }
+  {
+    std::unique_lock<std::mutex> lock(s.mutex);
+    s.done.wait(lock, [&s]() { return s.chains_remaining == 0; });
+  }
+  if (s.failed) {
+    std::cerr << "A decode chain failed: " << s.error << std::endl;
+    release_session(std::move(session));
+    return false;
+  }
+
+  const int best = std::max_element(s.chain_log_probs.begin(),
+                                    s.chain_log_probs.end()) -
+                   s.chain_log_probs.begin();
+  result.key = s.chain_states[best];
+
+  const NgramDensity &exact =
+      exact_density(s.density, ciphertext, model_, s.exact);
+  result.stats.polish_swaps =
+      options.polish ? steepest_descent_polish(result.key, exact, symbols_,
+                                               s.polish_deltas,
+                                               s.polish_scratch)
+                     : 0;
+  result.log_prob = exact.score(result.key);
+
+  result.plaintext.resize(ciphertext.size());
+  ByteTranslator(result.key, model_.chars())
+      .translate(ciphertext.data(), &result.plaintext[0], ciphertext.size());
+
+  result.stats.chains = options.chains;
+  result.stats.iterations =
+      static_cast<long long>(options.iters) * options.chains;
+  result.stats.seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  release_session(std::move(session));
+  return true;
+}
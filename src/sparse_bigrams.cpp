@@ -0,0 +1,157 @@
+#include "sparse_bigrams.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SPARSE_BIGRAMS_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Adds the terms to log_prob one at a time, in the dense function's order.
+double sparse_log_prob_scalar(const SparseBigramCounts &sparse_counts,
+                              const int32_t *perm, const double *table,
+                              int stride, double log_prob) {
+  for (size_t k = 0; k < sparse_counts.size; ++k) {
+    log_prob += sparse_counts.counts[k] *
+                table[perm[sparse_counts.rows[k]] * stride +
+                      perm[sparse_counts.cols[k]]];
+  }
+  return log_prob;
+}
+
+#ifdef SPARSE_BIGRAMS_X86
+
+// AVX2 integer gathers cost more than the four scalar loads they replace,
+// so the indices are built in scalar code and only the model is gathered.
+__attribute__((target("avx2,fma"))) double sparse_log_prob_avx2(
+    const SparseBigramCounts &sparse_counts, const int32_t *perm,
+    const double *table, int stride) {
+  const int32_t *rows = sparse_counts.rows.data();
+  const int32_t *cols = sparse_counts.cols.data();
+  __m256d sum = _mm256_setzero_pd();
+  for (size_t k = 0; k < sparse_counts.counts.size(); k += 4) {
+    const __m128i index =
+        _mm_setr_epi32(perm[rows[k]] * stride + perm[cols[k]],
+                       perm[rows[k + 1]] * stride + perm[cols[k + 1]],
+                       perm[rows[k + 2]] * stride + perm[cols[k + 2]],
+                       perm[rows[k + 3]] * stride + perm[cols[k + 3]]);
+    const __m256d log_probs = _mm256_i32gather_pd(table, index, 8);
+    sum = _mm256_fmadd_pd(_mm256_loadu_pd(&sparse_counts.counts[k]),
+                          log_probs, sum);
+  }
+  const __m128d half =
+      _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+__attribute__((target("avx512f,avx2,fma"))) double sparse_log_prob_avx512(
+    const SparseBigramCounts &sparse_counts, const int32_t *perm,
+    const double *table, int stride) {
+  const __m256i stride8 = _mm256_set1_epi32(stride);
+  __m512d sum = _mm512_setzero_pd();
+  for (size_t k = 0; k < sparse_counts.counts.size(); k += 8) {
+    const __m256i rows = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(&sparse_counts.rows[k]));
+    const __m256i cols = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(&sparse_counts.cols[k]));
+    const __m256i index = _mm256_add_epi32(
+        _mm256_mullo_epi32(_mm256_i32gather_epi32(perm, rows, 4), stride8),
+        _mm256_i32gather_epi32(perm, cols, 4));
+    const __m512d log_probs = _mm512_i32gather_pd(index, table, 8);
+    sum = _mm512_fmadd_pd(_mm512_loadu_pd(&sparse_counts.counts[k]),
+                          log_probs, sum);
+  }
+  return _mm512_reduce_add_pd(sum);
+}
+
+#endif  // SPARSE_BIGRAMS_X86
+
+}  // namespace
+
+SparseBigramCounts compute_sparse_bigram_counts(const Matrix<int> &counts) {
+  SparseBigramCounts sparse_counts;
+  fill_sparse_bigram_counts(counts, sparse_counts);
+  return sparse_counts;
+}
+
+void fill_sparse_bigram_counts(const Matrix<int> &counts,
+                               SparseBigramCounts &sparse_counts) {
+  sparse_counts.rows.clear();
+  sparse_counts.cols.clear();
+  sparse_counts.counts.clear();
+  for (size_t i = 0; i < counts.rows(); ++i) {
+    const RowSpan<const int> row = counts.row(i);
+    for (size_t j = 0; j < row.size(); ++j) {
+      if (row[j] > 0) {
+        sparse_counts.rows.push_back(i);
+        sparse_counts.cols.push_back(j);
+        sparse_counts.counts.push_back(row[j]);
+      }
+    }
+  }
+  sparse_counts.size = sparse_counts.counts.size();
+  while (sparse_counts.counts.size() % kSparseBigramPadding != 0) {
+    sparse_counts.rows.push_back(0);
+    sparse_counts.cols.push_back(0);
+    sparse_counts.counts.push_back(0.0);
+  }
+}
+
+SimdLevel detect_simd_level() {
+#ifdef SPARSE_BIGRAMS_X86
+  static const SimdLevel level = []() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      return SimdLevel::kAvx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      return SimdLevel::kAvx2;
+    }
+    return SimdLevel::kScalar;
+  }();
+  return level;
+#else
+  return SimdLevel::kScalar;
+#endif
+}
+
+const char *simd_level_name(SimdLevel level) {
+  switch (level) {
+    case SimdLevel::kAvx2:
+      return "avx2";
+    case SimdLevel::kAvx512:
+      return "avx512";
+    default:
+      return "scalar";
+  }
+}
+
+double compute_log_probability_by_sparse_counts(
+    const SparseBigramCounts &sparse_counts, int first_ix,
+    const Permutation &permutation, const LanguageModel &model,
+    SimdLevel level) {
+  double log_prob =
+      first_ix < 0 ? 0.0 : model.log_frequency(permutation[first_ix]);
+
+  // The kernels gather 32-bit indices, so widen the permutation first.
+  int32_t perm[kMaxSymbols];
+  for (int i = 0; i < permutation.size(); ++i) {
+    perm[i] = permutation[i];
+  }
+  const double *table = model.log_transition_row(0);
+  const int stride = model.row_stride();
+
+  if (level > detect_simd_level()) {
+    level = detect_simd_level();
+  }
+#ifdef SPARSE_BIGRAMS_X86
+  if (level == SimdLevel::kAvx512) {
+    return log_prob +
+           sparse_log_prob_avx512(sparse_counts, perm, table, stride);
+  }
+  if (level == SimdLevel::kAvx2) {
+    return log_prob + sparse_log_prob_avx2(sparse_counts, perm, table, stride);
+  }
+#endif
+  return sparse_log_prob_scalar(sparse_counts, perm, table, stride, log_prob);
+}
@@ -0,0 +1,199 @@
+#include "telemetry.hpp"
+
+#include <cmath>
+#include <sstream>
+
+#include "utils.hpp"
+
+namespace {
+
+// Writes text as the contents of a JSON string. Bytes outside printable
+// ASCII are escaped one by one as if they were Latin-1, so a preview that
+// cuts a multi-byte character in half still yields valid JSON.
+void write_json_string(std::ostream &out, const std::string &text) {
+  static const char kHex[] = "0123456789abcdef";
+  for (char c : text) {
+    const unsigned char u = c;
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (u < 0x20 || u >= 0x7f) {
+      out << "\\u00" << kHex[u >> 4] << kHex[u & 15];
+    } else {
+      out << c;
+    }
+  }
+}
+
+// JSON has no infinities or NaN; a chain that has not scored a key yet
+// reports -inf, which is written as null.
+void write_json_number(std::ostream &out, double value) {
+  if (std::isfinite(value)) {
+    out << value;
+  } else {
+    out << "null";
+  }
+}
+
+}  // namespace
+
+ChainTelemetry::ChainTelemetry()
+    : sample_every_(0),
+      start_time_(std::chrono::steady_clock::now()),
+      last_time_(start_time_),
+      start_iteration_(0),
+      last_iteration_(0),
+      dropped_(0) {}
+
+void ChainTelemetry::start(long long iteration) {
+  start_time_ = last_time_ = std::chrono::steady_clock::now();
+  start_iteration_ = iteration;
+  last_iteration_ = iteration;
+}
+
+void ChainTelemetry::record(long long iteration, long long accepts,
+                            double temperature, double log_prob,
+                            double best_log_prob, const Permutation &state,
+                            bool final) {
+  const auto now = std::chrono::steady_clock::now();
+  // A final sample reports the rate over the whole run.
+  const double elapsed =
+      std::chrono::duration<double>(now - (final ? start_time_ : last_time_))
+          .count();
+  const long long iterations =
+      iteration - (final ? start_iteration_ : last_iteration_);
+  TelemetrySample sample;
+  sample.iteration = iteration;
+  sample.accepts = accepts;
+  sample.temperature = temperature;
+  sample.log_prob = log_prob;
+  sample.best_log_prob = best_log_prob;
+  sample.iters_per_sec = elapsed > 0 ? iterations / elapsed : 0.0;
+  sample.final = final;
+  sample.state = state;
+  last_time_ = now;
+  last_iteration_ = iteration;
+
+  // A final sample must not be lost, so wait for the reporter to make room.
+  while (!ring_.try_push(sample)) {
+    if (!final) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    std::this_thread::yield();
+  }
+}
+
+TelemetryReporter::TelemetryReporter(int n_chains,
+                                     const TelemetryOptions &options,
+                                     const std::vector<char> &chars,
+                                     const std::string &text,
+                                     std::ostream &out)
+    : n_chains_(n_chains),
+      options_(options),
+      chars_(chars),
+      preview_(text.substr(0, 70)),
+      out_(out),
+      chains_(new ChainTelemetry[n_chains]),
+      stopping_(false) {
+  for (int c = 0; c < n_chains_; ++c) {
+    chains_[c].sample_every_ = options_.sample_every;
+  }
+  thread_ = std::thread([this]() { run(); });
+}
+
+TelemetryReporter::~TelemetryReporter() { stop(); }
+
+void TelemetryReporter::stop() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  stopping_.store(true, std::memory_order_release);
+  thread_.join();
+  for (int c = 0; c < n_chains_; ++c) {
+    const long long dropped = chains_[c].dropped_.load();
+    if (dropped > 0 && options_.format == TelemetryFormat::kText) {
+      out_ << "Chain " << c + 1 << " dropped " << dropped
+           << " telemetry samples" << std::endl;
+    }
+  }
+}
+
+void TelemetryReporter::run() {
+  for (;;) {
+    // Read the flag before draining so samples pushed before stop() are
+    // always written.
+    const bool stopping = stopping_.load(std::memory_order_acquire);
+    if (!drain()) {
+      if (stopping) {
+        return;
+      }
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(options_.poll_ms));
+    }
+  }
+}
+
+bool TelemetryReporter::drain() {
+  bool any = false;
+  TelemetrySample sample;
+  for (int c = 0; c < n_chains_; ++c) {
+    while (chains_[c].ring_.try_pop(sample)) {
+      write(c, sample);
+      any = true;
+    }
+  }
+  if (any) {
+    out_.flush();
+  }
+  return any;
+}
+
+void TelemetryReporter::write(int chain, const TelemetrySample &sample) {
+  const long long rejects = sample.iteration - sample.accepts;
+  const double accept_rate =
+      sample.iteration > 0 ? double(sample.accepts) / sample.iteration : 0.0;
+  const std::string preview =
+      apply_permutation(preview_, sample.state, chars_);
+
+  // Build the whole line first so it reaches the stream in one write.
+  std::ostringstream line;
+  if (options_.format == TelemetryFormat::kJson) {
+    line << "{\"chain\": " << chain << ", \"iteration\": " << sample.iteration
+         << ", \"accepts\": " << sample.accepts << ", \"rejects\": " << rejects
+         << ", \"accept_rate\": ";
+    write_json_number(line, accept_rate);
+    line << ", \"temperature\": ";
+    write_json_number(line, sample.temperature);
+    line << ", \"log_prob\": ";
+    write_json_number(line, sample.log_prob);
+    line << ", \"best_log_prob\": ";
+    write_json_number(line, sample.best_log_prob);
+    line << ", \"iters_per_sec\": ";
+    write_json_number(line, sample.iters_per_sec);
+    line << ", \"final\": " << (sample.final ? "true" : "false")
+         << ", \"preview\": \"";
+    write_json_string(line, preview);
+    line << "\"}\n";
+  } else {
+    line << "Chain " << chain + 1
+         << (sample.final ? " finished after " : " iteration ")
+         << sample.iteration << (sample.final ? " iterations" : "")
+         << " (Temp: " << sample.temperature
+         << ", Log prob: " << sample.log_prob
+         << ", Best: " << sample.best_log_prob
+         << ", Accept: " << 100.0 * accept_rate << "%, "
+         << sample.iters_per_sec << " it/s): " << preview << "...\n";
+  }
+  out_ << line.str();
+}
+
+bool parse_telemetry_format(const std::string &name, TelemetryFormat &format) {
+  if (name == "text") {
+    format = TelemetryFormat::kText;
+  } else if (name == "json") {
+    format = TelemetryFormat::kJson;
+  } else {
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,115 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+#include "affinity.hpp"
+
+namespace {
+
+// The pool and queue index of the current thread, if it is a pool worker.
+thread_local const ThreadPool *current_pool = nullptr;
+thread_local int current_queue = -1;
+
+}  // namespace
+
+ThreadPool::ThreadPool(int n_threads, const std::vector<int> &cpus)
+    : next_queue_(0), queued_(0), pending_(0), stopping_(false) {
+  n_threads = std::max(1, n_threads);
+  queues_.reset(new Queue[n_threads]);
+  for (int i = 0; i < n_threads; ++i) {
+    const int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+    threads_.emplace_back([this, i, cpu]() {
+      if (cpu >= 0) {
+        pin_current_thread(cpu);
+      }
+      worker(i);
+    });
+  }
+}
+
+int ThreadPool::current_worker() { return current_queue; }
+
+ThreadPool::~ThreadPool() {
+  wait();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  task_ready_.notify_all();
+  for (auto &th : threads_) {
+    th.join();
+  }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+  const int n_queues = threads_.size();
+  const int index = current_pool == this
+                        ? current_queue
+                        : next_queue_.fetch_add(1, std::memory_order_relaxed) %
+                              n_queues;
+  {
+    std::lock_guard<std::mutex> lock(queues_[index].mutex);
+    queues_[index].tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++queued_;
+    ++pending_;
+  }
+  task_ready_.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  all_done_.wait(lock, [this]() { return pending_ == 0; });
+}
+
+bool ThreadPool::take(int index, std::function<void()> &task) {
+  {
+    Queue &own = queues_[index];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.front());
+      own.tasks.pop_front();
+      return true;
+    }
+  }
+  const int n_queues = threads_.size();
+  for (int k = 1; k < n_queues; ++k) {
+    Queue &victim = queues_[(index + k) % n_queues];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.back());
+      victim.tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::worker(int index) {
+  current_pool = this;
+  current_queue = index;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_ready_.wait(lock, [this]() { return stopping_ || queued_ > 0; });
+      if (queued_ == 0) {
+        return;
+      }
+      // Claim one queued task; it is in some queue until taken below.
+      --queued_;
+    }
+    std::function<void()> task;
+    while (!take(index, task)) {
+      std::this_thread::yield();
+    }
+    task();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--pending_ == 0) {
+        all_done_.notify_all();
+      }
+    }
+  }
+}
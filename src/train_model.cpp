@@ -0,0 +1,85 @@
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "language_model.hpp"
+#include "lexicon.hpp"
+
+int main(int argc, char *argv[]) {
+  std::string input_file;
+  std::string output_file;
+  int n_threads = std::thread::hardware_concurrency();
+  int order = 2;
+  bool lexicon = false;
+
+  // Command-line argument parsing
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "-i" && i + 1 < argc) {
+      input_file = argv[++i];
+    } else if (arg == "-o" && i + 1 < argc) {
+      output_file = argv[++i];
+    } else if (arg == "-order" && i + 1 < argc) {
+      try {
+        order = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -order: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-lexicon") {
+      lexicon = true;
+    } else if (arg == "-threads" && i + 1 < argc) {
+      try {
+        n_threads = std::stoi(argv[++i]);
+      } catch (const std::exception &e) {
+        std::cerr << "Invalid number for -threads: " << argv[i] << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  if (input_file.empty() || output_file.empty() || order < 2 ||
+      order > kMaxNgramOrder) {
+    std::cerr << "Usage: " << argv[0]
+              << " -i <training_file> -o <model_file> [-order <2-4>] "
+                 "[-threads <number>] [-lexicon]"
+              << std::endl;
+    std::cerr << "  -i: The text file to learn character statistics from."
+              << std::endl;
+    std::cerr << "  -o: The binary model file to write, for use with "
+                 "run_deciphering -m."
+              << std::endl;
+    std::cerr << "  -order: The n-gram order to score with, 2 (bigrams, the "
+                 "default) to 4."
+              << std::endl;
+    std::cerr << "  -threads: The number of threads to count the corpus with."
+              << std::endl;
+    std::cerr << "  -lexicon: Also write the corpus words to <model_file>"
+                 ".lexicon, for run_deciphering -lexicon."
+              << std::endl;
+    return 1;
+  }
+
+  // The corpus is streamed from disk, so it may be larger than memory.
+  LanguageModel model;
+  if (!train_language_model_from_file(input_file, n_threads, model, order)) {
+    return 1;
+  }
+  if (!save_language_model(model, output_file)) {
+    return 1;
+  }
+  std::cout << "Saved an order " << model.order() << " model of "
+            << model.size() << " characters to " << output_file << std::endl;
+
+  if (lexicon) {
+    Lexicon words;
+    const std::string lexicon_file = lexicon_file_name(output_file);
+    if (!build_lexicon_from_file(input_file, words) ||
+        !save_lexicon(words, lexicon_file)) {
+      return 1;
+    }
+    std::cout << "Saved a lexicon of " << words.size() << " words to "
+              << lexicon_file << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,175 @@
+#include "translate.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define TRANSLATE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+void translate_scalar(const uint8_t *table, const char *in, char *out,
+                      size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = table[static_cast<unsigned char>(in[i])];
+  }
+}
+
+#ifdef TRANSLATE_X86
+
+// Each changed block of the table becomes a 16-byte shuffle indexed by the
+// low nibble, and its result is blended into the bytes whose high nibble
+// selects that block; bytes in unchanged blocks pass through as they are.
+__attribute__((target("avx2"))) void translate_avx2(
+    const uint8_t *table, const std::vector<uint8_t> &changed_blocks,
+    const char *in, char *out, size_t n) {
+  const int n_blocks = changed_blocks.size();
+  __m256i lookups[16];
+  __m256i nibbles[16];
+  for (int k = 0; k < n_blocks; ++k) {
+    lookups[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(table + 16 * changed_blocks[k])));
+    nibbles[k] = _mm256_set1_epi8(changed_blocks[k]);
+  }
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+    const __m256i low = _mm256_and_si256(bytes, low_mask);
+    const __m256i high =
+        _mm256_and_si256(_mm256_srli_epi16(bytes, 4), low_mask);
+    __m256i result = bytes;
+    for (int k = 0; k < n_blocks; ++k) {
+      result = _mm256_blendv_epi8(result, _mm256_shuffle_epi8(lookups[k], low),
+                                  _mm256_cmpeq_epi8(high, nibbles[k]));
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), result);
+  }
+  translate_scalar(table, in + i, out + i, n - i);
+}
+
+#endif  // TRANSLATE_X86
+
+// Writes all n bytes, retrying short writes.
+bool write_all(int fd, const char *data, size_t n) {
+  while (n > 0) {
+    const ssize_t written = write(fd, data, n);
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    n -= written;
+  }
+  return true;
+}
+
+}  // namespace
+
+ByteTranslator::ByteTranslator(const Permutation &permutation,
+                               const std::vector<char> &chars,
+                               bool join_lines)
+    : join_lines_(join_lines) {
+  for (int c = 0; c < 256; ++c) {
+    table_[c] = static_cast<uint8_t>(c);
+  }
+  for (size_t i = 0; i < chars.size(); ++i) {
+    table_[static_cast<unsigned char>(chars[i])] = chars[permutation[i]];
+  }
+  if (join_lines) {
+    table_[static_cast<unsigned char>('\n')] = table_[' '];
+  }
+  for (int block = 0; block < 16; ++block) {
+    for (int low = 0; low < 16; ++low) {
+      if (table_[16 * block + low] != 16 * block + low) {
+        changed_blocks_.push_back(block);
+        break;
+      }
+    }
+  }
+}
+
+void ByteTranslator::translate(const char *in, char *out, size_t n,
+                               SimdLevel level) const {
+#ifdef TRANSLATE_X86
+  if (level >= SimdLevel::kAvx2 && detect_simd_level() >= SimdLevel::kAvx2) {
+    translate_avx2(table_, changed_blocks_, in, out, n);
+    return;
+  }
+#endif
+  translate_scalar(table_, in, out, n);
+}
+
+std::string ByteTranslator::translate(const std::string &text) const {
+  std::string out(text.size(), '\0');
+  translate(text.data(), &out[0], text.size());
+  return out;
+}
+
+bool translate_file(const ByteTranslator &translator,
+                    const std::string &input_file,
+                    const std::string &output_file) {
+  const bool from_stdin = input_file == "-";
+  const bool to_stdout = output_file == "-";
+  const int in_fd =
+      from_stdin ? STDIN_FILENO : open(input_file.c_str(), O_RDONLY);
+  if (in_fd < 0) {
+    std::cerr << "Unable to open file " << input_file << std::endl;
+    return false;
+  }
+  const int out_fd =
+      to_stdout ? STDOUT_FILENO
+                : open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0) {
+    std::cerr << "Could not open output file: " << output_file << std::endl;
+    if (!from_stdin) {
+      close(in_fd);
+    }
+    return false;
+  }
+
+  // One spare byte in front holds the translated newline that ended the
+  // previous chunk; it is only written once more text follows, because a
+  // final newline is dropped when joining lines.
+  std::vector<char> buffer(kTranslateChunkSize + 1);
+  char *chunk = buffer.data() + 1;
+  bool held_newline = false;
+  bool ok = true;
+  while (true) {
+    const ssize_t n = read(in_fd, chunk, kTranslateChunkSize);
+    if (n < 0) {
+      std::cerr << "Error reading " << input_file << std::endl;
+      ok = false;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    const bool ends_line = translator.join_lines() && chunk[n - 1] == '\n';
+    translator.translate(chunk, chunk, n);
+    const char *begin = chunk;
+    if (held_newline) {
+      buffer[0] = translator.translate_byte('\n');
+      begin = buffer.data();
+    }
+    if (!write_all(out_fd, begin, chunk + n - begin - (ends_line ? 1 : 0))) {
+      std::cerr << "Error writing " << output_file << std::endl;
+      ok = false;
+      break;
+    }
+    held_newline = ends_line;
+  }
+
+  if (!from_stdin) {
+    close(in_fd);
+  }
+  if (!to_stdout && close(out_fd) != 0 && ok) {
+    std::cerr << "Error writing " << output_file << std::endl;
+    ok = false;
+  }
+  return ok;
+}
@@ -3,9 +3,10 @@
 #include <algorithm>
 #include <fstream>
 #include <iostream>
-#include <random>
 #include <vector>
 
+#include "translate.hpp"
+
 std::vector<char> az_list() {
   std::vector<char> cx;
   for (char c = 'a'; c <= 'z'; ++c) {
@@ -16,27 +17,27 @@ std::vector<char> az_list() {
   }
   return cx;
 }
-std::map<char, char> generate_random_permutation_map(
-    const std::vector<char> &chars) {
-  std::map<char, char> p_map = generate_identity_p_map(chars);
-  std::vector<char> cx = az_list();
-  std::vector<char> cx2 = az_list();
-  std::random_device rd;
-  std::mt19937 g(rd());
-  std::shuffle(cx2.begin(), cx2.end(), g);
+Permutation generate_random_permutation(const std::vector<char> &chars,
+                                        Rng &rng) {
+  Permutation permutation = generate_identity_permutation(chars);
+  // Only the letters are scrambled; every other symbol maps to itself.
+  std::vector<int> letters =
+      get_symbol_indices(az_list(), get_char_to_ix(chars));
+  std::vector<int> images = letters;
+  // Fisher-Yates with our own generator keeps keys identical across standard
+  // libraries for a given seed.
+  for (size_t i = images.size(); i > 1; --i) {
+    std::swap(images[i - 1], images[rng.uniform_int(i)]);
+  }
 
-  for (size_t i = 0; i < cx.size(); ++i) {
-    p_map[cx[i]] = cx2[i];
+  for (size_t i = 0; i < letters.size(); ++i) {
+    permutation.set(letters[i], images[i]);
   }
-  return p_map;
+  return permutation;
 }
 
-std::map<char, char> generate_identity_p_map(const std::vector<char> &chars) {
-  std::map<char, char> p_map;
-  for (char c : chars) {
-    p_map[c] = c;
-  }
-  return p_map;
+Permutation generate_identity_permutation(const std::vector<char> &chars) {
+  return Permutation(chars.size());
 }
 
 std::vector<char> get_chars_from_text(const std::string &text) {
@@ -59,13 +60,41 @@ std::map<char, int> get_char_to_ix(const std::vector<char> &chars) {
   return char_to_ix;
 }
 
+std::vector<int> get_symbol_indices(const std::vector<char> &symbols,
+                                    const std::map<char, int> &char_to_ix) {
+  std::vector<int> indices;
+  for (char c : symbols) {
+    if (char_to_ix.count(c)) {
+      indices.push_back(char_to_ix.at(c));
+    }
+  }
+  return indices;
+}
+
+namespace {
+
+// Expands char_to_ix into a byte table; characters outside it map to -1.
+void get_index_table(const std::map<char, int> &char_to_ix, int *table) {
+  for (int c = 0; c < 256; ++c) {
+    table[c] = -1;
+  }
+  for (const auto &pair : char_to_ix) {
+    table[static_cast<unsigned char>(pair.first)] = pair.second;
+  }
+}
+
+}  // namespace
+
 std::vector<double> get_frequency_statistics(
     const std::string &text, const std::vector<char> &chars,
     const std::map<char, int> &char_to_ix) {
+  int table[256];
+  get_index_table(char_to_ix, table);
   std::vector<double> freq(chars.size(), 0.0);
   for (char c : text) {
-    if (char_to_ix.count(c)) {
-      freq[char_to_ix.at(c)]++;
+    int ix = table[static_cast<unsigned char>(c)];
+    if (ix >= 0) {
+      freq[ix]++;
     }
   }
   for (size_t i = 0; i < freq.size(); ++i) {
@@ -74,83 +103,139 @@ std::vector<double> get_frequency_statistics(
   return freq;
 }
 
-std::vector<std::vector<double> > get_transition_matrix(
-    const std::string &text, const std::vector<char> &chars,
-    const std::map<char, int> &char_to_ix) {
+DoubleMatrix get_transition_matrix(const std::string &text,
+                                   const std::vector<char> &chars,
+                                   const std::map<char, int> &char_to_ix) {
+  int table[256];
+  get_index_table(char_to_ix, table);
   int n_chars = chars.size();
-  std::vector<std::vector<double> > trans_matrix(
-      n_chars, std::vector<double>(n_chars, 1.0));  // Add-1 smoothing
-  for (size_t i = 0; i < text.length() - 1; ++i) {
-    if (char_to_ix.count(text[i]) && char_to_ix.count(text[i + 1])) {
-      trans_matrix[char_to_ix.at(text[i])][char_to_ix.at(text[i + 1])]++;
+  DoubleMatrix trans_matrix(n_chars, n_chars, 1.0);  // Add-1 smoothing
+  for (size_t i = 0; i + 1 < text.length(); ++i) {
+    int ix1 = table[static_cast<unsigned char>(text[i])];
+    int ix2 = table[static_cast<unsigned char>(text[i + 1])];
+    if (ix1 >= 0 && ix2 >= 0) {
+      trans_matrix(ix1, ix2)++;
     }
   }
 
   for (int i = 0; i < n_chars; ++i) {
+    RowSpan<double> row = trans_matrix.row(i);
     double total = 0;
-    for (int j = 0; j < n_chars; ++j) {
-      total += trans_matrix[i][j];
+    for (double val : row) {
+      total += val;
     }
-    for (int j = 0; j < n_chars; ++j) {
-      trans_matrix[i][j] /= total;
+    for (double &val : row) {
+      val /= total;
     }
   }
   return trans_matrix;
 }
 
 std::string apply_permutation(const std::string &text,
-                              const std::map<char, char> &permutation_map) {
-  std::string new_text = "";
-  for (char c : text) {
-    if (permutation_map.count(c)) {
-      new_text += permutation_map.at(c);
-    } else {
-      new_text += c;
-    }
-  }
-  return new_text;
+                              const Permutation &permutation,
+                              const std::vector<char> &chars) {
+  return ByteTranslator(permutation, chars).translate(text);
 }
 
 void read_file(const std::string &filename, std::string &text) {
-  std::ifstream file(filename);
+  std::ifstream file(filename, std::ios::binary);
   if (file.is_open()) {
-    std::string line;
-    // Correctly replace newlines with spaces, matching the Python
-    // implementation
-    while (std::getline(file, line)) {
-      text += line + " ";
+    // Read the whole file in as few reads as possible, then correctly
+    // replace newlines with spaces, matching the Python implementation. A
+    // regular file is read in one go; a pipe or FIFO cannot report its
+    // size, so it is read in chunks until EOF.
+    constexpr std::streamoff kReadChunk = 1 << 16;
+    std::streamoff chunk = kReadChunk;
+    file.seekg(0, std::ios::end);
+    const std::streamoff size = file.tellg();
+    if (size >= 0 && file.seekg(0, std::ios::beg)) {
+      // One byte more than the file holds, so the first read reaches EOF.
+      chunk = size + 1;
     }
+    file.clear();
+    size_t start = text.size();
+    do {
+      const size_t end = text.size();
+      text.resize(end + chunk);
+      file.read(&text[end], chunk);
+      text.resize(end + file.gcount());
+      chunk = kReadChunk;
+    } while (file);
     file.close();
-    // Remove the final trailing space
-    if (!text.empty()) {
+    // A final newline does not become a trailing space
+    if (text.size() > start && text.back() == '\n') {
       text.pop_back();
     }
+    std::replace(text.begin() + start, text.end(), '\n', ' ');
   } else {
     std::cerr << "Unable to open file " << filename << std::endl;
   }
 }
 
-void print_permutation_map(const std::map<char, char> &p_map) {
-  std::cout << "Permutation Map (Key):\n";
+Permutation get_permutation_from_map(const std::map<char, char> &p_map,
+                                     const std::map<char, int> &char_to_ix) {
+  Permutation permutation(char_to_ix.size());
   for (const auto &pair : p_map) {
+    if (char_to_ix.count(pair.first) && char_to_ix.count(pair.second)) {
+      permutation.set(char_to_ix.at(pair.first), char_to_ix.at(pair.second));
+    }
+  }
+  return permutation;
+}
+
+std::map<char, char> get_map_from_permutation(const Permutation &permutation,
+                                              const std::vector<char> &chars) {
+  std::map<char, char> p_map;
+  for (size_t i = 0; i < chars.size(); ++i) {
+    p_map[chars[i]] = chars[permutation[i]];
+  }
+  return p_map;
+}
+
+void print_permutation_map(const Permutation &permutation,
+                           const std::vector<char> &chars) {
+  std::cout << "Permutation Map (Key):\n";
+  for (const auto &pair : get_map_from_permutation(permutation, chars)) {
     std::cout << "  " << pair.first << " -> " << pair.second << "\n";
   }
   std::cout << std::endl;
 }
 
 /**
- * @brief Saves the permutation map to a file, one mapping per line.
+ * @brief Saves the permutation to a file, one mapping per line.
  */
-void save_permutation_map(const std::map<char, char> &p_map,
+void save_permutation_map(const Permutation &permutation,
+                          const std::vector<char> &chars,
                           const std::string &filename) {
   std::ofstream file(filename);
   if (!file.is_open()) {
     std::cerr << "Could not open file to save key: " << filename << std::endl;
     return;
   }
-  for (const auto &pair : p_map) {
+  for (const auto &pair : get_map_from_permutation(permutation, chars)) {
     file << pair.first << " " << pair.second << "\n";
   }
   file.close();
   std::cout << "Successfully saved key to " << filename << std::endl;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Loads a permutation from a file written by save_permutation_map.
+ */
+Permutation load_permutation_map(const std::string &filename,
+                                 const std::map<char, int> &char_to_ix) {
+  std::map<char, char> p_map;
+  std::ifstream file(filename);
+  if (!file.is_open()) {
+    std::cerr << "Could not open key file: " << filename << std::endl;
+    return Permutation(char_to_ix.size());
+  }
+  // Each line is "<from> <to>"; read by position so a space can be a symbol.
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.size() >= 3) {
+      p_map[line[0]] = line[2];
+    }
+  }
+  return get_permutation_from_map(p_map, char_to_ix);
+}